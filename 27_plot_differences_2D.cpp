@@ -12,6 +12,9 @@
 #include <string>
 #include "TSystem.h"
 #include "TSystemDirectory.h"
+#include <vector>
+#include "bulk_tree_reader.h"
+#include "event_join.h"
 
 using namespace std;
 
@@ -33,39 +36,25 @@ int main() {
   TTree* tree_optics1 = (TTree*)file_optics1->Get("ntuple");
   TTree* tree_optics2 = (TTree*)file_optics2->Get("ntuple");
 
-  tree_optics1->SetMakeClass(1);
-  tree_optics2->SetMakeClass(1);
-
-  Float_t x1, x2, y1, y2, sx1, sx2, sy1, sy2, px, py, pz;
-
-  tree_optics1->SetBranchAddress("x", &x1);
-  tree_optics2->SetBranchAddress("x", &x2);
-
-  tree_optics1->SetBranchAddress("y", &y1);
-  tree_optics2->SetBranchAddress("y", &y2);
-
-  tree_optics1->SetBranchAddress("sx", &sx1);
-  tree_optics2->SetBranchAddress("sx", &sx2);
-
-  tree_optics1->SetBranchAddress("sy", &sy1);
-  tree_optics2->SetBranchAddress("sy", &sy2);
-
-  tree_optics1->SetBranchAddress("px", &px);
-  tree_optics1->SetBranchAddress("py", &py);
-  tree_optics1->SetBranchAddress("pz", &pz);
-
-  Long64_t nentries = tree_optics1->GetEntriesFast();
-  Long64_t nentries2 = tree_optics2->GetEntriesFast();
-  cout<<"Difference in protons: "<<nentries- nentries2<<'\n';
+  // x and y of both trees, read in bulk into plain arrays
+  std::vector<float> x1, x2, y1, y2;
+  std::vector<int> ev1, ev2;
+  BulkTreeReader reader1(tree_optics1), reader2(tree_optics2);
+  reader1.Add("ev_id", &ev1);
+  reader1.Add("x", &x1);
+  reader1.Add("y", &y1);
+  reader2.Add("ev_id", &ev2);
+  reader2.Add("x", &x2);
+  reader2.Add("y", &y2);
+  Long64_t nentries = reader1.Read();
+  Long64_t nentries2 = reader2.Read();
+  // which events differ, not only how many
+  EventJoin join = JoinByEventId(ev1, ev2);
+  cout<<"Difference in protons: "<<nentries- nentries2<<" (only in default: "<<join.only1.size()
+      <<", only in reduced: "<<join.only2.size()<<")"<<'\n';
   //std::cout<< std::endl << "Number of entries: " << nentries << std::endl<< std::endl;
 
 
-  // Here I calcluate means and StdDev for differences, which are later used to set axis limits for 2D histos, those 4 histograms below are not plotted
-
-
-  double num_of_Stdev=3.5;
-
-
   // 2D histos for the x, y, sx and sy vs px/py/pz difference between optics1_default(-185murad) and optics2_shifted(-185murad)
   // TH2F* x_vs_y_def = new TH2F("x_vs_y_def", "Default;x;y;nOfEvents",
   //  		100,tree_optics1->GetMinimum("x"),tree_optics1->GetMaximum("x") , 100, tree_optics1->GetMinimum("y"), tree_optics1->GetMaximum("y"));
@@ -73,11 +62,24 @@ int main() {
   // TH2F* x_vs_y_chang = new TH2F("x_vs_y_chang", "Reduced;x;y;nOfEvents",
   //     100,tree_optics2->GetMinimum("x"),tree_optics2->GetMaximum("x") , 100, tree_optics2->GetMinimum("y"), tree_optics2->GetMaximum("y"));
 
-  double x_min,x_max,y_min,y_max;
-  x_min=min(tree_optics1->GetMinimum("x"),tree_optics2->GetMinimum("x"));
-  x_max=max(tree_optics1->GetMaximum("x"),tree_optics2->GetMaximum("x"));
-  y_min=min(tree_optics1->GetMinimum("y"),tree_optics2->GetMinimum("y"));
-  y_max=max(tree_optics1->GetMaximum("y"),tree_optics2->GetMaximum("y"));
+  // the ranges come from the arrays, TTree::GetMinimum/GetMaximum would read each branch again
+  float x_min = 0, x_max = 0, y_min = 0, y_max = 0;
+  if (!x1.empty() || !x2.empty()) {
+    x_min = x_max = x1.empty() ? x2[0] : x1[0];
+    y_min = y_max = y1.empty() ? y2[0] : y1[0];
+  }
+  for (const std::vector<float>* x : {&x1, &x2}) {
+    for (float v : *x) {
+      x_min = v < x_min ? v : x_min;
+      x_max = v > x_max ? v : x_max;
+    }
+  }
+  for (const std::vector<float>* y : {&y1, &y2}) {
+    for (float v : *y) {
+      y_min = v < y_min ? v : y_min;
+      y_max = v > y_max ? v : y_max;
+    }
+  }
 
 
   TH2F* x_vs_y_def = new TH2F("x_vs_y_def", "Default;x [m];y [m];nOfEvents",
@@ -90,22 +92,8 @@ int main() {
 
 
 
-  for (Int_t i = 0; i < nentries; i++) {
-    tree_optics1->GetEntry(i);
-
-
-    x_vs_y_def->Fill(x1, y1);
-
-
-  }
-  for (Int_t i = 0; i < nentries2; i++) {
-
-    tree_optics2->GetEntry(i);
-
-
-    x_vs_y_chang->Fill(x2, y2);
-
-  }
+  for (Long64_t i = 0; i < nentries; i++) x_vs_y_def->Fill(x1[i], y1[i]);
+  for (Long64_t i = 0; i < nentries2; i++) x_vs_y_chang->Fill(x2[i], y2[i]);
   delete tree_optics1, tree_optics2, file_optics1, file_optics2;
 
 
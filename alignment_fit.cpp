@@ -0,0 +1,341 @@
+#include "alignment_fit.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <math.h>
+#include "output_writer.h"
+#include <TFile.h>
+#include <TTree.h>
+
+namespace {
+
+double SumOfSquares(const std::vector<double>& r) {
+  double sum = 0;
+  for (double v : r) sum += v * v;
+  return sum;
+}
+
+// In-place Cholesky factorisation of the n x n matrix a (lower triangle); false if not positive definite.
+bool Cholesky(std::vector<double>& a, size_t n) {
+  for (size_t j = 0; j < n; j++) {
+    double d = a[j * n + j];
+    for (size_t k = 0; k < j; k++) d -= a[j * n + k] * a[j * n + k];
+    if (!(d > 0)) return false;
+    d = sqrt(d);
+    a[j * n + j] = d;
+    for (size_t i = j + 1; i < n; i++) {
+      double s = a[i * n + j];
+      for (size_t k = 0; k < j; k++) s -= a[i * n + k] * a[j * n + k];
+      a[i * n + j] = s / d;
+    }
+  }
+  return true;
+}
+
+// Solve L L^T x = b with the factor from Cholesky.
+std::vector<double> CholeskySolve(const std::vector<double>& l, size_t n, std::vector<double> b) {
+  for (size_t i = 0; i < n; i++) {
+    for (size_t k = 0; k < i; k++) b[i] -= l[i * n + k] * b[k];
+    b[i] /= l[i * n + i];
+  }
+  for (size_t i = n; i-- > 0; ) {
+    for (size_t k = i + 1; k < n; k++) b[i] -= l[k * n + i] * b[k];
+    b[i] /= l[i * n + i];
+  }
+  return b;
+}
+
+// Eigen-decomposition of the symmetric n x n matrix a (cyclic Jacobi): eigenvalues in values,
+// eigenvectors in the columns of vectors.
+void SymmetricEigen(std::vector<double> a, size_t n, std::vector<double>& values, std::vector<double>& vectors) {
+  vectors.assign(n * n, 0.);
+  for (size_t i = 0; i < n; i++) vectors[i * n + i] = 1.;
+  for (int sweep = 0; sweep < 50; sweep++) {
+    double off = 0, diagonal = 0;
+    for (size_t i = 0; i < n; i++) {
+      diagonal += a[i * n + i] * a[i * n + i];
+      for (size_t j = i + 1; j < n; j++) off += a[i * n + j] * a[i * n + j];
+    }
+    if (off <= 1.e-30 * diagonal) break;
+    for (size_t p = 0; p < n; p++) {
+      for (size_t q = p + 1; q < n; q++) {
+        double apq = a[p * n + q];
+        if (apq == 0) continue;
+        double theta = (a[q * n + q] - a[p * n + p]) / (2 * apq);
+        double t = (theta >= 0 ? 1. : -1.) / (fabs(theta) + sqrt(theta * theta + 1));
+        double c = 1 / sqrt(t * t + 1), s = t * c;
+        for (size_t k = 0; k < n; k++) {
+          double akp = a[k * n + p], akq = a[k * n + q];
+          a[k * n + p] = c * akp - s * akq;
+          a[k * n + q] = s * akp + c * akq;
+        }
+        for (size_t k = 0; k < n; k++) {
+          double apk = a[p * n + k], aqk = a[q * n + k];
+          a[p * n + k] = c * apk - s * aqk;
+          a[q * n + k] = s * apk + c * aqk;
+        }
+        for (size_t k = 0; k < n; k++) {
+          double vkp = vectors[k * n + p], vkq = vectors[k * n + q];
+          vectors[k * n + p] = c * vkp - s * vkq;
+          vectors[k * n + q] = s * vkp + c * vkq;
+        }
+      }
+    }
+  }
+  values.resize(n);
+  for (size_t i = 0; i < n; i++) values[i] = a[i * n + i];
+}
+
+// Normal equations J^T J and J^T r restricted to the free parameters.
+void NormalEquations(const std::vector<double>& jacobian, const std::vector<double>& residuals, 
+                     const std::vector<size_t>& free, size_t n_parameters, 
+                     std::vector<double>& jtj, std::vector<double>& jtr) {
+  size_t n = free.size();
+  jtj.assign(n * n, 0.);
+  jtr.assign(n, 0.);
+  for (size_t r = 0; r < residuals.size(); r++) {
+    const double* row = &jacobian[r * n_parameters];
+    for (size_t i = 0; i < n; i++) {
+      double ji = row[free[i]];
+      if (ji == 0) continue;
+      jtr[i] += ji * residuals[r];
+      for (size_t k = 0; k <= i; k++) jtj[i * n + k] += ji * row[free[k]];
+    }
+  }
+  for (size_t i = 0; i < n; i++)
+    for (size_t k = 0; k < i; k++) jtj[k * n + i] = jtj[i * n + k];
+}
+
+} // namespace
+
+/**
+\brief Minimise the sum of squared residuals with Levenberg-Marquardt, on a growing subsample.
+
+Damping uses Marquardt's scaling by diag(J^T J), so parameters of different units (shifts in
+m, strength ratios) are handled alike. The covariance is (J^T J)^-1 scaled by chi2 / ndf at
+the solution on the final subsample. Exactly degenerate parameter combinations (e.g. shifts
+that can be traded against each other) are left out through a pseudo-inverse. The events
+of a subsample are selected once at its start; a step that loses a proton of one of them
+is rejected like one that raises chi2, so the fit cannot lower chi2 by dropping events.
+*/
+AlignmentFitResult LevenbergMarquardtFit(const ResidualFunction& evaluate, const EventSelection& select, 
+                                         const std::vector<double>& start, int n_total_events, 
+                                         const AlignmentFitOptions& options) {
+  AlignmentFitResult result;
+  const size_t n_parameters = start.size();
+  result.parameters = start;
+
+  int max_events = options.max_events > 0 ? std::min(options.max_events, n_total_events) : n_total_events;
+  int n_events = std::min(std::max(1, options.initial_events), max_events);
+
+  std::vector<double> residuals, jacobian, jtj, jtr;
+  std::vector<size_t> free;
+  double lambda = 1.e-3;
+  double chi2 = 0;
+  select(result.parameters, n_events);
+
+  for (result.iterations = 0; result.iterations < options.max_iterations; result.iterations++) {
+    evaluate(result.parameters, n_events, residuals, &jacobian);
+    chi2 = SumOfSquares(residuals);
+
+    free.clear();
+    result.fixed.assign(n_parameters, 1);
+    for (size_t j = 0; j < n_parameters; j++) {
+      for (size_t r = 0; r < residuals.size(); r++) {
+        if (jacobian[r * n_parameters + j] != 0) {
+          free.push_back(j);
+          result.fixed[j] = 0;
+          break;
+        }
+      }
+    }
+    NormalEquations(jacobian, residuals, free, n_parameters, jtj, jtr);
+    const size_t n = free.size();
+
+    // damped steps until chi2 decreases
+    bool improved = false;
+    double new_chi2 = chi2;
+    std::vector<double> trial;
+    while (lambda < 1.e12) {
+      std::vector<double> a = jtj;
+      for (size_t i = 0; i < n; i++) a[i * n + i] *= 1. + lambda;
+      std::vector<double> minus_jtr(n);
+      for (size_t i = 0; i < n; i++) minus_jtr[i] = -jtr[i];
+      if (Cholesky(a, n)) {
+        std::vector<double> step = CholeskySolve(a, n, minus_jtr);
+        trial = result.parameters;
+        for (size_t i = 0; i < n; i++) trial[free[i]] += step[i];
+        std::vector<double> trial_residuals;
+        bool same_events = evaluate(trial, n_events, trial_residuals, 0);
+        new_chi2 = SumOfSquares(trial_residuals);
+        if (same_events && new_chi2 < chi2) {
+          improved = true;
+          break;
+        }
+      }
+      lambda *= 10;
+    }
+
+    std::cout << "Alignment fit iteration " << result.iterations << ": " << n_events << " events, chi2 = " 
+              << chi2 << (improved ? " -> " + std::to_string(new_chi2) : std::string(" (no better step)")) << std::endl;
+
+    // improvements far below one unit of chi2 per residual are numerical noise
+    bool settled = !improved || (chi2 - new_chi2) <= options.tolerance * std::max(chi2, (double)residuals.size());
+    if (improved) {
+      result.parameters = trial;
+      lambda = std::max(1.e-9, lambda / 10);
+      chi2 = new_chi2;
+    }
+    if (settled) {
+      if (n_events >= max_events) {
+        result.converged = true;
+        break;
+      }
+      n_events = std::min(2 * n_events, max_events);
+      select(result.parameters, n_events);
+      lambda = 1.e-3;
+    }
+  }
+
+  // covariance at the solution
+  evaluate(result.parameters, n_events, residuals, &jacobian);
+  result.chi2 = SumOfSquares(residuals);
+  result.n_events = n_events;
+  result.n_residuals = 0;
+  for (size_t r = 0; r < residuals.size(); r++) {
+    for (size_t j = 0; j < n_parameters; j++) {
+      if (jacobian[r * n_parameters + j] != 0) {
+        result.n_residuals++;
+        break;
+      }
+    }
+  }
+  NormalEquations(jacobian, residuals, free, n_parameters, jtj, jtr);
+  const size_t n = free.size();
+  long ndf = result.n_residuals - (long)n;
+  double scale = ndf > 0 ? result.chi2 / ndf : 1.;
+
+  result.covariance.assign(n_parameters * n_parameters, 0.);
+  result.errors.assign(n_parameters, 0.);
+  // pseudo-inverse of J^T J in correlation scaling; directions with eigenvalues below
+  // 1e-12 of the largest are unconstrained and dropped
+  if (n > 0) {
+    std::vector<double> d(n), scaled(n * n), values, vectors;
+    for (size_t i = 0; i < n; i++) d[i] = 1. / sqrt(jtj[i * n + i]);
+    for (size_t i = 0; i < n; i++)
+      for (size_t k = 0; k < n; k++) scaled[i * n + k] = jtj[i * n + k] * d[i] * d[k];
+    SymmetricEigen(scaled, n, values, vectors);
+    double largest = *std::max_element(values.begin(), values.end());
+    int n_unconstrained = 0;
+    for (size_t e = 0; e < n; e++) {
+      if (values[e] <= 1.e-12 * largest) {
+        n_unconstrained++;
+        continue;
+      }
+      for (size_t i = 0; i < n; i++)
+        for (size_t k = 0; k < n; k++)
+          result.covariance[free[i] * n_parameters + free[k]] += scale * d[i] * d[k] * vectors[i * n + e] * vectors[k * n + e] / values[e];
+    }
+    for (size_t j = 0; j < n_parameters; j++) result.errors[j] = sqrt(std::max(0., result.covariance[j * n_parameters + j]));
+    if (n_unconstrained > 0) {
+      std::cout << "WARNING! " << n_unconstrained << " combinations of the fitted parameters are not constrained by the data"
+                << " and are left out of the covariance." << std::endl;
+    }
+  }
+  return result;
+}
+
+/**
+\brief Read the ev_id, is_lost, x, sx, y, sy columns of sample sample_name ("ntuple", or
+"ntuple_<obs>m" with several planes) of an output of simple_tracking.
+
+A ".columns" file is read with ReadColumnarSample; a ROOT file must hold the sample as a
+TTree, RNTuple outputs are rejected.
+\return false, after printing the reason, if the sample cannot be read
+*/
+bool ReadObservedSample(const std::string& file_name, const std::string& sample_name, ObservedSample& sample) {
+  sample = ObservedSample();
+  const std::string columnar_extension = ".columns";
+  if (file_name.size() >= columnar_extension.size() && 
+      file_name.compare(file_name.size() - columnar_extension.size(), columnar_extension.size(), columnar_extension) == 0) {
+    TrackedColumns columns;
+    if (!ReadColumnarSample(file_name, sample_name, columns)) {
+      std::cout << "ERROR! Cannot read sample " << sample_name << " of " << file_name << std::endl;
+      return false;
+    }
+    sample.ev_id = columns.ev_id;
+    sample.is_lost = columns.is_lost;
+    sample.x = columns.x;
+    sample.sx = columns.sx;
+    sample.y = columns.y;
+    sample.sy = columns.sy;
+    return true;
+  }
+
+  TFile* f = new TFile(file_name.c_str(), "READ");
+  if (f->IsZombie()) {
+    std::cout << "ERROR! Cannot open " << file_name << std::endl;
+    delete f;
+    return false;
+  }
+  TObject* object = f->Get(sample_name.c_str());
+  TTree* tree = dynamic_cast<TTree*>(object);
+  if (!tree) {
+    if (object) std::cout << "ERROR! " << sample_name << " in " << file_name << " is not a TTree (RNTuple outputs cannot be fitted)" << std::endl;
+    else std::cout << "ERROR! No " << sample_name << " in " << file_name << std::endl;
+    delete f;
+    return false;
+  }
+  tree->SetMakeClass(1);
+
+  int ev_id;
+  bool is_lost;
+  float x, sx, y, sy;
+  tree->SetBranchAddress("ev_id", &ev_id);
+  tree->SetBranchAddress("is_lost", &is_lost);
+  tree->SetBranchAddress("x", &x);
+  tree->SetBranchAddress("sx", &sx);
+  tree->SetBranchAddress("y", &y);
+  tree->SetBranchAddress("sy", &sy);
+
+  Long64_t nentries = tree->GetEntriesFast();
+  for (Long64_t i = 0; i < nentries; i++) {
+    tree->GetEntry(i);
+    sample.ev_id.push_back(ev_id);
+    sample.is_lost.push_back(is_lost);
+    sample.x.push_back(x);
+    sample.sx.push_back(sx);
+    sample.y.push_back(y);
+    sample.sy.push_back(sy);
+  }
+  f->Close();
+  delete f;
+  return true;
+}
+
+/**
+\brief One row per parameter: fitted value, error and whether it was fixed; the full covariance follows.
+*/
+bool WriteAlignmentFitCsv(const std::string& filename, const AlignmentFitResult& result) {
+  std::ofstream f(filename);
+  if (!f) return false;
+  size_t n = result.parameters.size();
+
+  f << "# chi2=" << result.chi2 << " residuals=" << result.n_residuals << " events=" << result.n_events 
+    << " iterations=" << result.iterations << " converged=" << result.converged << "\n";
+  f << "Parameter,Value,Error,Fixed\n";
+  for (size_t j = 0; j < n; j++) {
+    f << result.parameter_names[j] << "," << result.parameters[j] << "," << result.errors[j] << "," 
+      << int(result.fixed[j]) << "\n";
+  }
+  f << "\nCovariance";
+  for (size_t j = 0; j < n; j++) f << "," << result.parameter_names[j];
+  f << "\n";
+  for (size_t i = 0; i < n; i++) {
+    f << result.parameter_names[i];
+    for (size_t j = 0; j < n; j++) f << "," << result.covariance[i * n + j];
+    f << "\n";
+  }
+  return bool(f);
+}
@@ -0,0 +1,75 @@
+#ifndef alignment_fit_h
+#define alignment_fit_h
+
+#include <functional>
+#include <string>
+#include <vector>
+
+/**
+\brief Settings of the Levenberg-Marquardt alignment fit.
+
+The fit starts on initial_events events and doubles the subsample every time it has
+converged on the current one (relative chi2 change below tolerance), until max_events
+(0: the whole sample) is reached. Residuals are divided by the resolutions.
+*/
+struct AlignmentFitOptions {
+  int initial_events = 1000;
+  int max_events = 0;
+  int max_iterations = 100;
+  double tolerance = 1.e-6;
+  double position_resolution = 1.e-5;  //!< [m]
+  double slope_resolution = 1.e-6;     //!< [rad]
+};
+
+/**
+\brief Fitted parameters with their covariance matrix.
+
+Parameters to which no residual is sensitive are kept fixed at their start value and
+have zero rows and columns in the covariance.
+*/
+struct AlignmentFitResult {
+  std::vector<std::string> parameter_names;
+  std::vector<double> parameters;
+  std::vector<double> errors;
+  std::vector<double> covariance;
+  std::vector<unsigned char> fixed;
+  double chi2 = 0;
+  long n_residuals = 0;
+  int n_events = 0;
+  int iterations = 0;
+  bool converged = false;
+  bool overlay_written = false;  //!< observed vs fitted distributions written (ProtonTransport::FitAlignment)
+};
+
+/**
+\brief Fix the events of the first n whose residuals enter the fit, at parameters p.
+
+Called at the start of every subsample, so the fitted event set only changes when the
+subsample grows.
+*/
+using EventSelection = std::function<void(const std::vector<double>&, int)>;
+
+/**
+\brief Residuals of the selected events among the first n at parameters p; also the
+Jacobian (row-major, residuals x parameters) if the last argument is not null.
+\return false if p loses a proton of a selected event; such parameters are not accepted
+*/
+using ResidualFunction = std::function<bool(const std::vector<double>&, int, std::vector<double>&, std::vector<double>*)>;
+
+AlignmentFitResult LevenbergMarquardtFit(const ResidualFunction&, const EventSelection&, const std::vector<double>&, 
+                                         int, const AlignmentFitOptions&);
+
+/**
+\brief Output sample of a simulated misaligned machine, the "measurement" an alignment is fitted to.
+*/
+struct ObservedSample {
+  std::vector<int> ev_id;
+  std::vector<float> x, sx, y, sy;
+  std::vector<unsigned char> is_lost;
+};
+
+bool ReadObservedSample(const std::string& file_name, const std::string& sample_name, ObservedSample&);
+
+bool WriteAlignmentFitCsv(const std::string&, const AlignmentFitResult&);
+
+#endif
@@ -0,0 +1,85 @@
+#if defined(__GNUC__) && !defined(__clang__)
+// The comparisons of the loss test are only if-converted without FP trap semantics.
+#pragma GCC optimize ("no-trapping-math")
+#endif
+
+#include "aperture.h"
+
+#include <cctype>
+
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__)
+#define APERTURE_TARGET_CLONES __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define APERTURE_TARGET_CLONES
+#endif
+
+namespace {
+
+APERTURE_TARGET_CLONES
+void LossMask(const Aperture aperture, const double* __restrict x, const double* __restrict y, size_t n,
+              unsigned char* __restrict lost) {
+#pragma GCC ivdep
+  for (size_t i = 0; i < n; i++) {
+    lost[i] = lost[i] | aperture.IsLost(x[i], y[i]);
+  }
+}
+
+} // namespace
+
+ApertureType ParseApertureType(const std::string& keyword, bool& known) {
+  std::string name;
+  for (char c : keyword) {
+    if (c != '"') name += toupper(static_cast<unsigned char>(c));
+  }
+  known = true;
+  if (name == "" || name == "NONE") return ApertureType::kNone;
+  if (name == "CIRCLE") return ApertureType::kCircle;
+  if (name == "ELLIPSE") return ApertureType::kEllipse;
+  if (name == "RECTANGLE") return ApertureType::kRectangle;
+  if (name == "RECTELLIPSE" || name == "LHCSCREEN") return ApertureType::kRectEllipse;
+  known = false;
+  return ApertureType::kRectEllipse;
+}
+
+const char* ApertureTypeName(ApertureType type) {
+  switch (type) {
+    case ApertureType::kCircle: return "CIRCLE";
+    case ApertureType::kEllipse: return "ELLIPSE";
+    case ApertureType::kRectangle: return "RECTANGLE";
+    case ApertureType::kRectEllipse: return "RECTELLIPSE";
+    default: return "NONE";
+  }
+}
+
+Aperture MakeAperture(ApertureType type, double aper_1, double aper_2, double aper_3, double aper_4) {
+  double rect_x = 0, rect_y = 0, el_x = 0, el_y = 0;
+  switch (type) {
+    case ApertureType::kCircle: el_x = el_y = aper_1; break;
+    case ApertureType::kEllipse: el_x = aper_1; el_y = aper_2; break;
+    case ApertureType::kRectangle: rect_x = aper_1; rect_y = aper_2; break;
+    case ApertureType::kRectEllipse: rect_x = aper_1; rect_y = aper_2; el_x = aper_3; el_y = aper_4; break;
+    default: break;
+  }
+
+  Aperture aperture;
+  if (rect_x > 0) aperture.rect_x = rect_x;
+  if (rect_y > 0) aperture.rect_y = rect_y;
+  if (el_x > 0) aperture.inv_el_x2 = 1. / (el_x * el_x);
+  if (el_y > 0) aperture.inv_el_y2 = 1. / (el_y * el_y);
+  bool has_limit = rect_x > 0 || rect_y > 0 || el_x > 0 || el_y > 0;
+  aperture.type = has_limit ? type : ApertureType::kNone;
+  return aperture;
+}
+
+Aperture WithHalfGapX(const Aperture& aperture, double half_gap_x) {
+  Aperture gap = aperture;
+  gap.rect_x = half_gap_x;
+  bool has_ellipse = gap.inv_el_x2 > 0 || gap.inv_el_y2 > 0;
+  gap.type = has_ellipse ? ApertureType::kRectEllipse : ApertureType::kRectangle;
+  return gap;
+}
+
+void ApertureLossMask(const Aperture& aperture, const double* x, const double* y, size_t n, unsigned char* lost) {
+  if (!aperture.IsChecked()) return;
+  LossMask(aperture, x, y, n, lost);
+}
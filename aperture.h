@@ -0,0 +1,82 @@
+#ifndef aperture_h
+#define aperture_h
+
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <string>
+
+/**
+\brief MAD-X APERTYPE of an element, resolved once when the beamline is compiled.
+
+kNone stands for a missing type as well as for an aperture with all limits zero;
+such elements are never checked.
+*/
+enum class ApertureType {
+  kNone,
+  kCircle,
+  kEllipse,
+  kRectangle,
+  kRectEllipse
+};
+
+/**
+\brief Aperture limits of one element in the form used by the loss test.
+
+Rectangular half widths and reciprocal squared ellipse semi-axes. A limit that does not
+exist for the type is neutral: infinite half width, zero reciprocal semi-axis. The test
+is then the same branch-free expression for all types, without divisions.
+*/
+struct Aperture {
+  ApertureType type = ApertureType::kNone;
+  double rect_x = std::numeric_limits<double>::infinity();
+  double rect_y = std::numeric_limits<double>::infinity();
+  double inv_el_x2 = 0;
+  double inv_el_y2 = 0;
+
+  bool IsChecked() const { return type != ApertureType::kNone; }
+
+  /**
+  \brief True if (x, y) is outside the aperture; always false for kNone.
+  */
+  bool IsLost(double x, double y) const {
+    return (x*x*inv_el_x2 + y*y*inv_el_y2 > 1) | (fabs(x) > rect_x) | (fabs(y) > rect_y);
+  }
+};
+
+/**
+\brief APERTYPE keyword (quoted or not, any case) to type.
+
+Unknown keywords with non-zero limits are taken as RECTELLIPSE, the limits used for
+every element before APERTYPE was read; known is set to false for them.
+*/
+ApertureType ParseApertureType(const std::string&, bool& known);
+
+/**
+\brief Name of the type as in MAD-X ("NONE", "CIRCLE", ...).
+*/
+const char* ApertureTypeName(ApertureType);
+
+/**
+\brief Aperture from APERTYPE and APER_1..APER_4.
+
+CIRCLE: APER_1 is the radius. ELLIPSE: APER_1, APER_2 semi-axes. RECTANGLE: APER_1, APER_2
+half widths. RECTELLIPSE: APER_1, APER_2 half widths and APER_3, APER_4 semi-axes.
+Zero or negative limits are not applied; with no limit left the type is kNone.
+*/
+Aperture MakeAperture(ApertureType, double aper_1, double aper_2, double aper_3, double aper_4);
+
+/**
+\brief Aperture with the horizontal half width replaced, e.g. by a collimator gap set in units of beam sigma.
+*/
+Aperture WithHalfGapX(const Aperture&, double half_gap_x);
+
+/**
+\brief lost[i] |= aperture.IsLost(x[i], y[i]) for i < n.
+
+The loop is compiled for AVX-512, AVX2 and a scalar baseline as the BatchTransport kernels.
+Nothing is done for an aperture of type kNone.
+*/
+void ApertureLossMask(const Aperture&, const double* x, const double* y, size_t n, unsigned char* lost);
+
+#endif
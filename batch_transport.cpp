@@ -0,0 +1,270 @@
+#if defined(__GNUC__) && !defined(__clang__)
+// The aperture comparisons are only if-converted (and the loops vectorized) without FP trap
+// semantics. Set before the includes so that PlaneMap::Apply can still be inlined.
+#pragma GCC optimize ("no-trapping-math")
+#endif
+
+#include "batch_transport.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__)
+#define BATCH_TARGET_CLONES __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define BATCH_TARGET_CLONES
+#endif
+
+namespace {
+
+const int kSeriesOrder = 12;
+const double kMaxSeriesArgument = 4.; // (qk L)^2; truncation error below 1e-17
+
+struct SeriesCoefficients {
+  double cos[kSeriesOrder + 1]; // 1/(2n)!
+  double sinc[kSeriesOrder + 1]; // 1/(2n+1)!
+};
+
+constexpr SeriesCoefficients MakeSeriesCoefficients() {
+  SeriesCoefficients c{};
+  double factorial = 1;
+  for (int n = 0; n <= kSeriesOrder; n++) {
+    if (n > 0) factorial *= 2 * n;
+    c.cos[n] = 1 / factorial;
+    factorial *= 2 * n + 1;
+    c.sinc[n] = 1 / factorial;
+  }
+  return c;
+}
+
+constexpr SeriesCoefficients kSeries = MakeSeriesCoefficients();
+
+// cos(t), sin(t)/t for w = -t^2 and cosh(t), sinh(t)/t for w = t^2
+inline void EvenSeries(double w, double& c, double& s) {
+  c = kSeries.cos[kSeriesOrder];
+  s = kSeries.sinc[kSeriesOrder];
+  for (int n = kSeriesOrder - 1; n >= 0; n--) {
+    c = c * w + kSeries.cos[n];
+    s = s * w + kSeries.sinc[n];
+  }
+}
+
+// The kernels work on a local copy of the segment, take the columns as separate restrict
+// pointers and mark the loops ivdep; otherwise GCC assumes the stores may alias the
+// segment coefficients and gives up on vectorizing.
+#define BUNDLE_COLUMNS double* __restrict x, double* __restrict sx, double* __restrict y, \
+                       double* __restrict sy, double* __restrict z, const double* __restrict pz, \
+                       unsigned char* __restrict lost
+
+// Protons passing the aperture leave through the exit map; lost ones stay in front of
+// the element, moved into and out of its frame. Already lost lanes are not touched.
+#define SETTLE_LANE(seg, i, energy_ratio, x0, sx0, y0, sy0)                     \
+  {                                                                             \
+    bool out = seg.aperture.IsLost(x0, y0);                                     \
+    double xl = x[i], sxl = sx[i], yl = y[i], syl = sy[i];                      \
+    seg.entry_x.Apply(xl, sxl, energy_ratio);                                   \
+    seg.entry_y.Apply(yl, syl, energy_ratio);                                   \
+    seg.exit_x.Apply(xl, sxl, energy_ratio);                                    \
+    seg.exit_y.Apply(yl, syl, energy_ratio);                                    \
+    seg.exit_x.Apply(x0, sx0, energy_ratio);                                    \
+    seg.exit_y.Apply(y0, sy0, energy_ratio);                                    \
+    x0 += seg.separation_after;                                                 \
+    bool alive = !lost[i];                                                      \
+    bool stop = alive & out;                                                    \
+    bool pass = alive & !out;                                                   \
+    x[i] = pass ? x0 : (stop ? xl : x[i]);                                      \
+    sx[i] = pass ? sx0 : (stop ? sxl : sx[i]);                                  \
+    y[i] = pass ? y0 : (stop ? yl : y[i]);                                      \
+    sy[i] = pass ? sy0 : (stop ? syl : sy[i]);                                  \
+    z[i] = pass ? seg.z_end : (stop ? seg.z_begin : z[i]);                      \
+    lost[i] = lost[i] | stop;                                                   \
+  }
+
+BATCH_TARGET_CLONES
+void AffineSegment(const TransferSegment& segment, BUNDLE_COLUMNS, size_t n, double beam_energy) {
+  const TransferSegment seg = segment;
+#pragma GCC ivdep
+  for (size_t i = 0; i < n; i++) {
+    double energy_ratio = beam_energy / pz[i];
+    double x0 = x[i], sx0 = sx[i], y0 = y[i], sy0 = sy[i];
+    seg.fused_x.Apply(x0, sx0, energy_ratio);
+    seg.fused_y.Apply(y0, sy0, energy_ratio);
+    SETTLE_LANE(seg, i, energy_ratio, x0, sx0, y0, sy0)
+  }
+}
+
+BATCH_TARGET_CLONES
+void QuadrupoleSegment(const TransferSegment& segment, BUNDLE_COLUMNS, size_t n, double beam_energy) {
+  const TransferSegment seg = segment;
+  double L = seg.length;
+  double sign = seg.strength >= 0. ? 1. : -1.; //horizontal or vertical focussing
+#pragma GCC ivdep
+  for (size_t i = 0; i < n; i++) {
+    double qk2 = (fabs(seg.strength) * beam_energy)/(pz[i] * L);
+    double w = qk2 * L * L;
+    // x plane sees cos/sin for sign > 0 and cosh/sinh otherwise, y plane the opposite
+    double cx, sincx, cy, sincy;
+    EvenSeries(-sign * w, cx, sincx);
+    EvenSeries(sign * w, cy, sincy);
+
+    double x0 = x[i], sx0 = sx[i], y0 = y[i], sy0 = sy[i];
+    seg.entry_x.Apply(x0, sx0, 0);
+    seg.entry_y.Apply(y0, sy0, 0);
+    double x1 = cx * x0 + L * sincx * sx0;
+    double sx1 = -sign * qk2 * L * sincx * x0 + cx * sx0;
+    double y1 = cy * y0 + L * sincy * sy0;
+    double sy1 = sign * qk2 * L * sincy * y0 + cy * sy0;
+    SETTLE_LANE(seg, i, 0, x1, sx1, y1, sy1)
+  }
+}
+
+// libm version for bundles where the series is not accurate enough
+void QuadrupoleSegmentScalar(const TransferSegment& segment, BUNDLE_COLUMNS, size_t n, double beam_energy) {
+  const TransferSegment seg = segment;
+  double L = seg.length;
+  for (size_t i = 0; i < n; i++) {
+    double qk  = sqrt((fabs(seg.strength) * beam_energy)/(pz[i] * L));
+    double qkl = qk * L;
+    PlaneMap focusing, defocusing;
+    focusing.m11 = cos(qkl);
+    focusing.m12 = sin(qkl) / qk;
+    focusing.m21 = -qk * sin(qkl);
+    focusing.m22 = cos(qkl);
+    defocusing.m11 = cosh(qkl);
+    defocusing.m12 = sinh(qkl) / qk;
+    defocusing.m21 = qk * sinh(qkl);
+    defocusing.m22 = cosh(qkl);
+
+    double x0 = x[i], sx0 = sx[i], y0 = y[i], sy0 = sy[i];
+    seg.entry_x.Apply(x0, sx0, 0);
+    seg.entry_y.Apply(y0, sy0, 0);
+    (seg.strength >= 0. ? focusing : defocusing).Apply(x0, sx0, 0);
+    (seg.strength >= 0. ? defocusing : focusing).Apply(y0, sy0, 0);
+    SETTLE_LANE(seg, i, 0, x0, sx0, y0, sy0)
+  }
+}
+
+// Drift segment ending at an observation plane, anywhere along the line.
+BATCH_TARGET_CLONES
+void PlaneDrift(const TransferSegment& segment, BUNDLE_COLUMNS, size_t n) {
+  (void)pz; // a drift does not depend on the momentum
+  const TransferSegment seg = segment;
+#pragma GCC ivdep
+  for (size_t i = 0; i < n; i++) {
+    double x0 = x[i], sx0 = sx[i], y0 = y[i], sy0 = sy[i];
+    seg.entry_x.Apply(x0, sx0, 0);
+    seg.entry_y.Apply(y0, sy0, 0);
+    bool alive = !lost[i];
+    x[i] = alive ? x0 : x[i];
+    y[i] = alive ? y0 : y[i];
+    z[i] = alive ? seg.z_end : z[i];
+  }
+}
+
+void RecordStation(ProtonBundle& bundle, ProtonBundle::Station& station) {
+  station.x = bundle.x;
+  station.sx = bundle.sx;
+  station.y = bundle.y;
+  station.sy = bundle.sy;
+  station.z = bundle.z;
+  station.lost = bundle.lost;
+}
+
+// Kept out of the segment kernels: a conditional int store next to the double columns
+// stops GCC from vectorizing them.
+BATCH_TARGET_CLONES
+void MarkLossElement(int element, const unsigned char* __restrict lost, int* __restrict lost_element, size_t n) {
+#pragma GCC ivdep
+  for (size_t i = 0; i < n; i++) {
+    lost_element[i] = (lost[i] && lost_element[i] < 0) ? element : lost_element[i];
+  }
+}
+
+} // namespace
+
+void ProtonBundle::Resize(size_t n) {
+  x.resize(n);
+  sx.resize(n);
+  y.resize(n);
+  sy.resize(n);
+  z.resize(n);
+  pz.resize(n);
+  lost.resize(n);
+  recorded.resize(n);
+  lost_element.resize(n);
+}
+
+size_t ProtonBundle::Size() const {
+  return pz.size();
+}
+
+void ProtonBundle::Set(size_t i, double sx_, double sy_, double pz_) {
+  x[i] = 0.;
+  y[i] = 0.;
+  z[i] = 0.;
+  sx[i] = sx_;
+  sy[i] = sy_;
+  pz[i] = pz_;
+  lost[i] = 0;
+  recorded[i] = 0;
+  lost_element[i] = -1;
+}
+
+BatchTransport::BatchTransport(const TransferLine& line) : line(line) {}
+
+void BatchTransport::Track(ProtonBundle& bundle) const {
+  size_t n = bundle.Size();
+  if (n == 0) return;
+#define BUNDLE_DATA bundle.x.data(), bundle.sx.data(), bundle.y.data(), bundle.sy.data(), \
+                    bundle.z.data(), bundle.pz.data(), bundle.lost.data()
+  double beam_energy = line.GetBeamEnergy();
+  double min_pz = *std::min_element(bundle.pz.begin(), bundle.pz.end());
+  size_t n_planes = line.GetNumberOfPlanes();
+  size_t n_recorded = 0;
+  bundle.stations.resize(n_planes);
+
+  for (const auto& seg : line.GetSegments()) {
+    switch (seg.kind) {
+      case ElementKind::kDrift:
+        PlaneDrift(seg, BUNDLE_DATA, n);
+        break;
+      case ElementKind::kQuadrupole:
+        if (fabs(seg.strength) * beam_energy / min_pz * seg.length <= kMaxSeriesArgument) {
+          QuadrupoleSegment(seg, BUNDLE_DATA, n, beam_energy);
+        } else {
+          QuadrupoleSegmentScalar(seg, BUNDLE_DATA, n, beam_energy);
+        }
+        break;
+      default:
+        AffineSegment(seg, BUNDLE_DATA, n, beam_energy);
+        break;
+    }
+    if (seg.kind != ElementKind::kDrift) MarkLossElement(seg.element, bundle.lost.data(), bundle.lost_element.data(), n);
+    // lost lanes are frozen, so a copy of the columns is the state at the plane
+    // for the protons passing it and the loss record for the others
+    for (int k = 0; k < seg.n_observed; k++) RecordStation(bundle, bundle.stations[n_recorded++]);
+  }
+
+#undef BUNDLE_DATA
+
+  for (size_t i = 0; i < n; i++) {
+    bundle.recorded[i] = bundle.lost[i] || line.ReachesObsPoint();
+  }
+  for (size_t k = 0; k < n_planes; k++) {
+    ProtonBundle::Station& station = bundle.stations[k];
+    // planes past the end of the line record the lost protons only
+    if (k >= n_recorded) RecordStation(bundle, station);
+    station.recorded.resize(n);
+    for (size_t i = 0; i < n; i++) station.recorded[i] = station.lost[i] || k < n_recorded;
+  }
+}
+
+const char* BatchTransport::GetInstructionSet() {
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__)
+  // same selection as the target_clones resolver
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) return "avx512f";
+  if (__builtin_cpu_supports("avx2")) return "avx2";
+#endif
+  return "scalar";
+}
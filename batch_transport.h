@@ -0,0 +1,63 @@
+#ifndef batch_transport_h
+#define batch_transport_h
+
+#include <vector>
+#include "transfer_map.h"
+
+/**
+\brief Bundle of protons in structure-of-arrays layout.
+
+lost and recorded are 0/1 flags; recorded is set for protons that were lost or reached
+the observation point, i.e. the ones written by simple_tracking. lost_element is the
+beamline index of the element that stopped a lost proton. stations holds the columns
+at each observation plane of the line.
+*/
+struct ProtonBundle {
+  /**
+  \brief Columns of the bundle recorded at one observation plane.
+  */
+  struct Station {
+    std::vector<double> x, sx, y, sy, z;
+    std::vector<unsigned char> lost, recorded;
+  };
+
+  std::vector<double> x, sx, y, sy, z, pz;
+  std::vector<unsigned char> lost, recorded;
+  std::vector<int> lost_element;
+  std::vector<Station> stations;
+
+  void Resize(size_t);
+
+  size_t Size() const;
+
+  /**
+  \brief Put a proton starting at the IP with slopes sx, sy into slot i.
+  */
+  void Set(size_t i, double sx_, double sy_, double pz_);
+};
+
+/**
+\brief Transport of a whole bundle through a TransferLine.
+
+Each segment is applied to all protons of the bundle before going to the next one,
+with lost protons masked out. The loops are compiled for AVX-512, AVX2 and a scalar
+baseline and the best version is picked at load time from the CPU features.
+Quadrupole cos/sin/cosh/sinh are evaluated as polynomials in (qk L)^2, which is
+branch free and vectorizes; a bundle with (qk L)^2 above 4 falls back to libm.
+*/
+class BatchTransport {
+public:
+  explicit BatchTransport(const TransferLine&);
+
+  void Track(ProtonBundle&) const;
+
+  /**
+  \brief Instruction set used by the batch kernels on this CPU ("avx512f", "avx2" or "scalar").
+  */
+  static const char* GetInstructionSet();
+
+private:
+  const TransferLine& line;
+};
+
+#endif
@@ -0,0 +1,124 @@
+#include "beamline.h"
+
+#include <cmath>
+#include <iostream>
+
+namespace {
+
+void SetAperture(BeamElement& el, const std::vector<std::string>& row, bool verbose) {
+  bool known;
+  ApertureType type = ParseApertureType(row.at(9), known);
+  if (!known && verbose) {
+    std::cout << "Warning! APERTYPE " << row.at(9) << " taken as RECTELLIPSE! Position: " << row.at(1) << std::endl;
+  }
+  el.aperture = MakeAperture(type, std::stod(row.at(10)), std::stod(row.at(11)), 
+                             std::stod(row.at(12)), std::stod(row.at(13)));
+}
+
+void WarnMultipole(const std::string& taken_as, const std::string& position, bool verbose) {
+  if (!verbose) return;
+  std::cout << "Warning! MULTIPOLE taken as " << taken_as 
+            << "! Check in twiss files if this is correct! Position: " << position << std::endl;
+}
+
+} // namespace
+
+std::string MagnetType(ElementKind kind) {
+  switch (kind) {
+    case ElementKind::kRectangularDipole: return "RBEND";
+    case ElementKind::kHorizontalKicker: return "HKICKER";
+    case ElementKind::kVerticalKicker: return "VKICKER";
+    case ElementKind::kQuadrupole: return "QUADRUPOLE";
+    default: return "";
+  }
+}
+
+const char* ElementKindName(ElementKind kind) {
+  switch (kind) {
+    case ElementKind::kMarker: return "MARKER";
+    case ElementKind::kDrift: return "DRIFT";
+    case ElementKind::kRectangularDipole: return "RBEND";
+    case ElementKind::kHorizontalKicker: return "HKICKER";
+    case ElementKind::kVerticalKicker: return "VKICKER";
+    case ElementKind::kQuadrupole: return "QUADRUPOLE";
+    case ElementKind::kCollimator: return "COLLIMATOR";
+  }
+  return "";
+}
+
+std::vector<BeamElement> CompileBeamline(const std::vector<std::vector<std::string>>& rows, bool verbose) {
+  std::vector<BeamElement> beamline;
+  beamline.reserve(rows.size());
+  int dipole_it = 0, hkicker_it = 0, vkicker_it = 0, quadrupole_it = 0;
+
+  for (const auto& row : rows) {
+    const std::string& keyword = row.at(0);
+    BeamElement el;
+    el.position = std::stod(row.at(1));
+    el.length = std::stod(row.at(2));
+
+    if (keyword == "\"MARKER\"") {
+      el.kind = ElementKind::kMarker;
+    } else if (keyword == "\"DRIFT\"") {
+      el.kind = ElementKind::kDrift;
+    } else if (keyword == "\"RBEND\"") {
+      el.kind = ElementKind::kRectangularDipole;
+      el.strength = std::stod(row.at(5));
+      SetAperture(el, row, verbose);
+    } else if (keyword == "\"HKICKER\"") {
+      el.kind = ElementKind::kHorizontalKicker;
+      el.strength = std::stod(row.at(3));
+      SetAperture(el, row, verbose);
+    } else if (keyword == "\"VKICKER\"") {
+      el.kind = ElementKind::kVerticalKicker;
+      el.strength = std::stod(row.at(4));
+      SetAperture(el, row, verbose);
+    } else if (keyword == "\"QUADRUPOLE\"") {
+      el.kind = ElementKind::kQuadrupole;
+      el.strength = std::stod(row.at(6));
+      SetAperture(el, row, verbose);
+    } else if (keyword == "\"MULTIPOLE\"") {
+      if (fabs(std::stod(row.at(5))) > 1.e-10) {
+        WarnMultipole("rectangular dipole", row.at(1), verbose);
+        el.kind = ElementKind::kRectangularDipole;
+        el.strength = std::stod(row.at(5));
+        SetAperture(el, row, verbose);
+      } else if (fabs(std::stod(row.at(3))) > 1.e-10) {
+        WarnMultipole("horizontal kicker", row.at(1), verbose);
+        el.kind = ElementKind::kHorizontalKicker;
+        el.strength = std::stod(row.at(3));
+        SetAperture(el, row, verbose);
+      } else if (fabs(std::stod(row.at(4))) > 1.e-10) {
+        WarnMultipole("vertical kicker", row.at(1), verbose);
+        el.kind = ElementKind::kVerticalKicker;
+        el.strength = std::stod(row.at(4));
+        SetAperture(el, row, verbose);
+      } else if (fabs(std::stod(row.at(6))) > 1.e-10) {
+        WarnMultipole("quadrupole", row.at(1), verbose);
+        el.kind = ElementKind::kQuadrupole;
+        el.strength = std::stod(row.at(6));
+        SetAperture(el, row, verbose);
+      } else {
+        el.kind = ElementKind::kDrift;
+      }
+    } else if (fabs(el.position - 150.53) < 1e-10 || fabs(el.position - 184.857) < 1e-10) {
+      el.kind = ElementKind::kCollimator;
+      el.collimator = fabs(el.position - 150.53) < 1e-10 ? CollimatorSlot::kCollimator150m 
+                                                          : CollimatorSlot::kCollimator185m;
+      SetAperture(el, row, verbose);
+    } else {
+      // SOLENOID, RCOLLIMATOR, MONITOR, PLACEHOLDER, INSTRUMENT: drift if L!=0, marker otherwise
+      el.kind = el.length > 1.e-10 ? ElementKind::kDrift : ElementKind::kMarker;
+    }
+
+    switch (el.kind) {
+      case ElementKind::kRectangularDipole: el.magnet_id = ++dipole_it; break;
+      case ElementKind::kHorizontalKicker: el.magnet_id = ++hkicker_it; break;
+      case ElementKind::kVerticalKicker: el.magnet_id = ++vkicker_it; break;
+      case ElementKind::kQuadrupole: el.magnet_id = ++quadrupole_it; break;
+      default: break;
+    }
+    beamline.push_back(el);
+  }
+  return beamline;
+}
@@ -0,0 +1,70 @@
+#ifndef beamline_h
+#define beamline_h
+
+#include <string>
+#include <vector>
+#include "aperture.h"
+
+/**
+\brief Kind of a compiled beam element.
+
+MULTIPOLE and the "other" Twiss keywords (MONITOR, INSTRUMENT, PLACEHOLDER, ...)
+are resolved to one of these kinds when the beamline is compiled.
+*/
+enum class ElementKind {
+  kMarker,
+  kDrift,
+  kRectangularDipole,
+  kHorizontalKicker,
+  kVerticalKicker,
+  kQuadrupole,
+  kCollimator
+};
+
+/**
+\brief Collimators treated as apertures in a drift (TCL at 150.53 m and 184.857 m).
+
+The horizontal half-gap is set at tracking time in units of beam sigma.
+*/
+enum class CollimatorSlot {
+  kNone,
+  kCollimator150m,
+  kCollimator185m
+};
+
+/**
+\brief Typed Twiss row used by the tracking loop.
+
+strength holds the value relevant for the kind: K0L for dipoles, HKICK/VKICK
+for kickers and K1L for quadrupoles. Apertures are APER_1..APER_4, filled only
+for the kinds that check them, and classified by APERTYPE. magnet_id is the 1-based ordinal of the element
+among elements of the same magnet kind, i.e. the id of the matching Magnet.
+*/
+struct BeamElement {
+  ElementKind kind = ElementKind::kMarker;
+  double position = 0;
+  double length = 0;
+  double strength = 0;
+  Aperture aperture;
+  CollimatorSlot collimator = CollimatorSlot::kNone;
+  int magnet_id = 0;
+};
+
+/**
+\brief Magnet type name ("RBEND", "QUADRUPOLE", ...) for the kind, empty for non-magnets.
+*/
+std::string MagnetType(ElementKind);
+
+/**
+\brief Twiss KEYWORD of the kind ("DRIFT", "RBEND", "QUADRUPOLE", ...), as in the loss maps and run reports.
+*/
+const char* ElementKindName(ElementKind);
+
+/**
+\brief Turn rows sorted by PrepareBeamline into typed elements.
+
+Row layout: KEYWORD, S, L, HKICK, VKICK, K0L, K1L, K2L, K3L, APERTYPE, APER_1..APER_4, X, Y, PX, PY.
+*/
+std::vector<BeamElement> CompileBeamline(const std::vector<std::vector<std::string>>&, bool verbose = true);
+
+#endif
@@ -0,0 +1,151 @@
+#include "benchmark.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <math.h>
+#include <stdio.h>
+
+namespace {
+
+// JSON string literal of s
+std::string Quoted(const std::string& s) {
+  std::string out = "\"";
+  for (char c : s) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if ((unsigned char)c < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      out += escaped;
+    } else {
+      out += c;
+    }
+  }
+  return out + "\"";
+}
+
+} // namespace
+
+double BenchmarkResult::GetMean() const {
+  if (seconds.empty()) return 0;
+  double sum = 0;
+  for (double s : seconds) sum += s;
+  return sum / seconds.size();
+}
+
+double BenchmarkResult::GetStdDev() const {
+  if (seconds.size() < 2) return 0;
+  double mean = GetMean(), sum2 = 0;
+  for (double s : seconds) sum2 += (s - mean) * (s - mean);
+  return sqrt(sum2 / (seconds.size() - 1));
+}
+
+double BenchmarkResult::GetMin() const {
+  return seconds.empty() ? 0 : *std::min_element(seconds.begin(), seconds.end());
+}
+
+double BenchmarkResult::GetMax() const {
+  return seconds.empty() ? 0 : *std::max_element(seconds.begin(), seconds.end());
+}
+
+double BenchmarkResult::GetThroughput() const {
+  double mean = GetMean();
+  return mean > 0 ? items / mean : 0;
+}
+
+double BenchmarkResult::GetTimePerItem() const {
+  return items > 0 ? GetMean() / items : 0;
+}
+
+/**
+\brief Time run: warmup untimed calls, then repetitions timed ones.
+
+reset, if given, is called before every call of run and is not timed (e.g. to restore
+the protons a kernel moved).
+*/
+BenchmarkResult RunBenchmark(const std::string& name, const std::string& item, double items,
+                             int warmup, int repetitions, const std::function<void()>& run,
+                             const std::function<void()>& reset) {
+  BenchmarkResult result;
+  result.name = name;
+  result.item = item;
+  result.items = items;
+  result.warmup = warmup;
+  for (int i = 0; i < warmup; i++) {
+    if (reset) reset();
+    run();
+  }
+  PerfCounters& counters = PerfCounters::ForThisThread();
+  PerfSample perf_begin, perf_end;
+  for (int i = 0; i < repetitions; i++) {
+    if (reset) reset();
+    counters.Read(perf_begin);
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    run();
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    counters.Read(perf_end);
+    result.seconds.push_back(std::chrono::duration<double>(end - begin).count());
+    result.perf.Add(perf_begin, perf_end);
+  }
+  return result;
+}
+
+/**
+\brief One line per benchmark: mean +- standard deviation, minimum, time per item, throughput
+and, with hardware counters, instructions per cycle.
+*/
+void PrintBenchmarks(std::ostream& out, const std::vector<BenchmarkResult>& results) {
+  out << std::left << std::setw(44) << "benchmark" << std::right << std::setw(14) << "mean [ms]"
+      << std::setw(12) << "+- [%]" << std::setw(12) << "min [ms]" << std::setw(14) << "ns/item"
+      << std::setw(8) << "IPC" << std::setw(16) << "items/s" << '\n';
+  for (const auto& r : results) {
+    double mean = r.GetMean();
+    out << std::left << std::setw(44) << r.name << std::right << std::fixed << std::setprecision(3)
+        << std::setw(14) << mean * 1.e3 << std::setprecision(1) << std::setw(12) << (mean > 0 ? 100 * r.GetStdDev() / mean : 0.)
+        << std::setprecision(3) << std::setw(12) << r.GetMin() * 1.e3 << std::setprecision(2)
+        << std::setw(14) << r.GetTimePerItem() * 1.e9;
+    if (r.perf.GetIPC() > 0) out << std::setw(8) << r.perf.GetIPC();
+    else out << std::setw(8) << "-";
+    out << std::setprecision(0) << std::setw(16) << r.GetThroughput() << " " << r.item << "/s\n" << std::defaultfloat;
+  }
+}
+
+/**
+\brief Results as JSON: the context strings (machine, settings, ...) and per benchmark
+the raw repetition times next to their summary, and the hardware events per item of
+the counters that were available.
+*/
+bool WriteBenchmarksJson(const std::string& filename, const std::vector<BenchmarkResult>& results,
+                         const std::map<std::string, std::string>& context) {
+  std::ofstream f(filename, std::fstream::trunc);
+  if (!f) return false;
+  f << std::setprecision(9);
+  f << "{\n  \"context\": {";
+  bool first = true;
+  for (const auto& [key, value] : context) {
+    f << (first ? "\n" : ",\n") << "    " << Quoted(key) << ": " << Quoted(value);
+    first = false;
+  }
+  f << "\n  },\n  \"benchmarks\": [";
+  for (size_t i = 0; i < results.size(); i++) {
+    const BenchmarkResult& r = results[i];
+    f << (i ? ",\n" : "\n") << "    {\"name\": " << Quoted(r.name) << ", \"item\": " << Quoted(r.item)
+      << ", \"items\": " << r.items << ", \"warmup\": " << r.warmup << ", \"repetitions\": " << r.seconds.size()
+      << ", \"mean_s\": " << r.GetMean() << ", \"stddev_s\": " << r.GetStdDev() << ", \"min_s\": " << r.GetMin()
+      << ", \"max_s\": " << r.GetMax() << ", \"s_per_item\": " << r.GetTimePerItem()
+      << ", \"items_per_s\": " << r.GetThroughput() << ", \"seconds\": [";
+    for (size_t k = 0; k < r.seconds.size(); k++) f << (k ? ", " : "") << r.seconds[k];
+    f << "]";
+    double n_items = r.items * r.seconds.size();
+    if (n_items > 0 && r.perf.GetIPC() > 0) f << ", \"ipc\": " << r.perf.GetIPC();
+    for (int e = 0; e < kNumberOfPerfEvents && n_items > 0; e++) {
+      if (r.perf.available[e]) f << ", \"" << PerfEventName((PerfEvent)e) << "_per_item\": " << r.perf.count[e] / n_items;
+    }
+    f << "}";
+  }
+  f << "\n  ]\n}\n";
+  return bool(f);
+}
@@ -0,0 +1,50 @@
+#ifndef benchmark_h
+#define benchmark_h
+
+#include <functional>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "perf_counters.h"
+
+/**
+\brief Wall times of the timed repetitions of one benchmark.
+
+items is the work done per repetition (protons, events, files, ...), so that
+GetThroughput is items per second and GetTimePerItem seconds per item. perf holds the
+hardware events of the timed repetitions where the counters are available; they are
+those of the calling thread, so they cover the work only if run does not hand it to
+other threads.
+*/
+struct BenchmarkResult {
+  std::string name;
+  std::string item; //!< what items counts, e.g. "proton" or "event"
+  double items = 1;
+  int warmup = 0;
+  std::vector<double> seconds;
+  PerfTotals perf;
+
+  double GetMean() const;
+
+  double GetStdDev() const; //!< sample standard deviation of the repetitions
+
+  double GetMin() const;
+
+  double GetMax() const;
+
+  double GetThroughput() const;
+
+  double GetTimePerItem() const;
+};
+
+BenchmarkResult RunBenchmark(const std::string& name, const std::string& item, double items,
+                             int warmup, int repetitions, const std::function<void()>& run,
+                             const std::function<void()>& reset = std::function<void()>());
+
+void PrintBenchmarks(std::ostream&, const std::vector<BenchmarkResult>&);
+
+bool WriteBenchmarksJson(const std::string&, const std::vector<BenchmarkResult>&,
+                         const std::map<std::string, std::string>& context);
+
+#endif
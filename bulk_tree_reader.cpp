@@ -0,0 +1,133 @@
+#include "bulk_tree_reader.h"
+
+#include <algorithm>
+#include <iostream>
+#include <Bytes.h>
+#include <TBranch.h>
+#include <TBufferFile.h>
+#include <TTree.h>
+
+#if __has_include(<ROOT/TBulkBranchRead.hxx>)
+#define PPSS_HAVE_BULK_READ 1
+#include <ROOT/TBulkBranchRead.hxx>
+#endif
+
+namespace {
+
+const long long kCacheBytes = 64 * 1024 * 1024;
+
+// Convert count big-endian values of type Stored from a serialized basket.
+template <class Stored, class T>
+void Unpack(char* data, int count, T* out) {
+  for (int i = 0; i < count; i++) {
+    Stored value;
+    frombuf(data, &value);
+    out[i] = value;
+  }
+}
+
+} // namespace
+
+BulkTreeReader::BulkTreeReader(TTree* tree) : tree(tree) {}
+
+void BulkTreeReader::Add(const std::string& branch, std::vector<float>* values) {
+  columns.push_back(Column{branch, kFloat, values, 0, 0, true});
+}
+
+void BulkTreeReader::Add(const std::string& branch, std::vector<int>* values) {
+  columns.push_back(Column{branch, kInt, values, 0, 0, true});
+}
+
+void BulkTreeReader::Add(const std::string& branch, std::vector<unsigned char>* values) {
+  columns.push_back(Column{branch, kBool, values, 0, 0, true});
+}
+
+long long BulkTreeReader::Read() {
+  for (auto& column : columns) {
+    column.branch = tree->GetBranch(column.name.c_str());
+    if (!column.branch) {
+      std::cout << "ERROR! No branch " << column.name << " in tree " << tree->GetName() << std::endl;
+      return -1;
+    }
+  }
+
+  // nothing but the requested branches is decompressed or even fetched from disk
+  tree->SetBranchStatus("*", false);
+  for (const auto& column : columns) tree->SetBranchStatus(column.name.c_str(), true);
+  tree->SetCacheSize(kCacheBytes);
+  for (const auto& column : columns) tree->AddBranchToCache(column.name.c_str(), true);
+  tree->StopCacheLearningPhase();
+
+  long long n = tree->GetEntries();
+  for (auto& column : columns) {
+    column.next = 0;
+    switch (column.type) {
+      case kFloat: static_cast<std::vector<float>*>(column.values)->resize(n); break;
+      case kInt: static_cast<std::vector<int>*>(column.values)->resize(n); break;
+      case kBool: static_cast<std::vector<unsigned char>*>(column.values)->resize(n); break;
+    }
+  }
+
+  // a cluster is fetched into the cache once and then read branch by branch
+  TTree::TClusterIterator clusters = tree->GetClusterIterator(0);
+  for (long long first = clusters(); first < n; first = clusters()) {
+    long long last = std::min(n, clusters.GetNextEntry());
+    tree->LoadTree(first);
+    for (auto& column : columns) ReadBaskets(column, last);
+  }
+  return n;
+}
+
+/**
+\brief Read column from its next entry on, whole baskets at a time, until at least entry last.
+
+Baskets are read from their first entry, so column.next always sits on a basket boundary.
+A branch the bulk API rejects is read entry by entry from then on.
+*/
+void BulkTreeReader::ReadBaskets(Column& column, long long last) {
+#ifdef PPSS_HAVE_BULK_READ
+  long long n = tree->GetEntries();
+  TBufferFile buffer(TBuffer::kWrite, 32 * 1024);
+  while (column.bulk && column.next < last) {
+    int count = column.branch->GetBulkRead().GetEntriesSerialized(column.next, buffer);
+    if (count <= 0) {
+      column.bulk = false;
+      break;
+    }
+    count = std::min<long long>(count, n - column.next);
+    char* data = buffer.GetCurrent();
+    switch (column.type) {
+      case kFloat: Unpack<Float_t>(data, count, static_cast<std::vector<float>*>(column.values)->data() + column.next); break;
+      case kInt: Unpack<Int_t>(data, count, static_cast<std::vector<int>*>(column.values)->data() + column.next); break;
+      case kBool: Unpack<Bool_t>(data, count, static_cast<std::vector<unsigned char>*>(column.values)->data() + column.next); break;
+    }
+    column.next += count;
+  }
+#endif
+  ReadEntries(column, last);
+}
+
+/**
+\brief Entry by entry reading of column up to entry last, for branches the bulk API rejects.
+*/
+void BulkTreeReader::ReadEntries(Column& column, long long last) {
+  if (column.next >= last) return;
+  Float_t f;
+  Int_t i;
+  Bool_t b;
+  switch (column.type) {
+    case kFloat: column.branch->SetAddress(&f); break;
+    case kInt: column.branch->SetAddress(&i); break;
+    case kBool: column.branch->SetAddress(&b); break;
+  }
+  for (; column.next < last; column.next++) {
+    column.branch->GetEntry(column.next);
+    switch (column.type) {
+      case kFloat: (*static_cast<std::vector<float>*>(column.values))[column.next] = f; break;
+      case kInt: (*static_cast<std::vector<int>*>(column.values))[column.next] = i; break;
+      case kBool: (*static_cast<std::vector<unsigned char>*>(column.values))[column.next] = b; break;
+    }
+  }
+  // the branch must not keep pointing at the locals above
+  column.branch->ResetAddress();
+}
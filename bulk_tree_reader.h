@@ -0,0 +1,61 @@
+#ifndef bulk_tree_reader_h
+#define bulk_tree_reader_h
+
+#include <string>
+#include <vector>
+
+class TBranch;
+class TTree;
+
+/**
+\brief Reads whole branches of a flat tree (one number per entry) into contiguous arrays.
+
+Only the added branches are enabled and the TTreeCache is set up for exactly them. The
+tree is read cluster by cluster, and within a cluster every branch basket by basket with
+ROOT's bulk API: a basket is copied and byte-swapped in one go instead of being
+deserialised entry by entry. Branches the bulk API cannot read (and ROOT versions without
+it) are read entry by entry through the branch, still without touching the other branches.
+
+  BulkTreeReader reader(tree);
+  reader.Add("x", &x);
+  reader.Add("is_lost", &is_lost);
+  Long64_t n = reader.Read();
+*/
+class BulkTreeReader {
+public:
+  explicit BulkTreeReader(TTree*);
+
+  void Add(const std::string& branch, std::vector<float>*);
+
+  void Add(const std::string& branch, std::vector<int>*);
+
+  void Add(const std::string& branch, std::vector<unsigned char>*); //!< bool branches
+
+  /**
+  \brief Fill every added array with all entries of its branch.
+
+  \return number of entries, -1 if an added branch does not exist
+  */
+  long long Read();
+
+private:
+  enum ColumnType { kFloat, kInt, kBool };
+
+  struct Column {
+    std::string name;
+    ColumnType type;
+    void* values;
+    TBranch* branch;
+    long long next; //!< first entry not read yet
+    bool bulk; //!< false once the bulk API failed for this branch
+  };
+
+  void ReadBaskets(Column&, long long last);
+
+  void ReadEntries(Column&, long long last);
+
+  TTree* tree;
+  std::vector<Column> columns;
+};
+
+#endif
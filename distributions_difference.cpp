@@ -1,106 +1,187 @@
 #include "distributions_difference.h"
 
-struct Variable {
-  std::string type;
-  float value;
-};
-
+#include <algorithm>
+#include "bulk_tree_reader.h"
+
+/**
+\brief Compare the "ntuple" trees of two files event by event.
+
+Entries are paired by ev_id (see JoinByEventId), so the files may hold their events in
+any order and either may miss events of the other; unmatched events are counted, not
+compared. With LostPairs::kDrop the pairs with a proton lost in either file are left out
+(and counted). The compared branches are read in bulk into arrays (see BulkTreeReader).
+Mean, RMS, minimum and maximum of every variable of both files ("histos1", "histos2")
+and of their differences ("histos_1d_diffs", keys "d_" + variable) are computed exactly
+from them. With with_histograms the arrays are kept and histograms with the exact ranges
+are booked and filled from them; they are owned by this object.
+*/
 DistributionsDifference::DistributionsDifference(
-    const std::string& fname1, const std::string& fname2) 
+    const std::string& fname1, const std::string& fname2, bool with_histograms, LostPairs lost_pairs) 
 {
-  VarNameToHist var_name_to_hist1, 
-                               var_name_to_hist2, 
-                               var_name_to_hist_1d_diffs, 
-                               var_name_to_hist_2d_diffs;
-
   TFile* file1 =  new TFile(fname1.c_str());
   TFile* file2 =  new TFile(fname2.c_str());
 
   TTree* tree1 = (TTree*)file1->Get("ntuple");
   TTree* tree2 = (TTree*)file2->Get("ntuple");
 
-  tree1->SetMakeClass(1);
-  tree2->SetMakeClass(1);
-
-  std::vector<Variable> vars1 = {Variable{"x", 0},
-                                 Variable{"sx", 0},
-                                 Variable{"y", 0},
-                                 Variable{"sy", 0},
-                                 Variable{"px", 0},
-                                 Variable{"py", 0},
-                                 Variable{"pz", 0}};
-  std::vector<Variable> vars2 = {Variable{"x", 0},
-                                 Variable{"sx", 0},
-                                 Variable{"y", 0},
-                                 Variable{"sy", 0},
-                                 Variable{"px", 0},
-                                 Variable{"py", 0},
-                                 Variable{"pz", 0}};
-
-  for (int i = 0; i < vars1.size(); i++) {
-    std::string hist_name = "d_" + vars1[i].type;
-    double min, max;
-
-    tree1->SetBranchAddress(vars1[i].type.c_str(), &vars1[i].value);
-    tree2->SetBranchAddress(vars2[i].type.c_str(), &vars2[i].value);
-
-    min = tree1->GetMinimum(vars1[i].type.c_str());
-    max = tree1->GetMaximum(vars1[i].type.c_str());
-    var_name_to_hist1[vars1[i].type] = new TH1F((vars1[i].type + "1").c_str(),
-                                                vars1[i].type.c_str(),
-                                                100,
-                                                min,
-                                                max);
-
-    min = tree2->GetMinimum(vars2[i].type.c_str());
-    max = tree2->GetMaximum(vars2[i].type.c_str());
-    var_name_to_hist2[vars2[i].type] = new TH1F((vars2[i].type + "2").c_str(),
-                                            vars2[i].type.c_str(),
-                                            100,
-                                            min,
-                                            max);
-
-    min = tree1->GetMinimum(vars1[i].type.c_str()) - tree2->GetMaximum(vars2[i].type.c_str());
-    max = tree1->GetMaximum(vars1[i].type.c_str()) - tree2->GetMinimum(vars2[i].type.c_str());
-    var_name_to_hist_1d_diffs[hist_name] = new TH1F(hist_name.c_str(),
-                                          (hist_name + " between optics").c_str(),
-                                          1000,
-                                          min,
-                                          max);
+  const std::vector<std::string> types = {"x", "sx", "y", "sy", "px", "py", "pz"};
+  const size_t n_vars = types.size();
+
+  // the needed branches are read whole into arrays, see BulkTreeReader
+  std::vector<std::vector<float>> values1(n_vars), values2(n_vars);
+  std::vector<int> ev_id1, ev_id2;
+  std::vector<unsigned char> is_lost1, is_lost2;
+  BulkTreeReader reader1(tree1), reader2(tree2);
+  for (size_t j = 0; j < n_vars; j++) {
+    reader1.Add(types[j], &values1[j]);
+    reader2.Add(types[j], &values2[j]);
+  }
+  reader1.Add("ev_id", &ev_id1);
+  reader2.Add("ev_id", &ev_id2);
+  reader1.Add("is_lost", &is_lost1);
+  reader2.Add("is_lost", &is_lost2);
+  reader1.Read();
+  reader2.Read();
+
+  file1->Close();
+  file2->Close();
+  delete file1;
+  delete file2;
+
+  EventJoin join = JoinByEventId(ev_id1, ev_id2);
+  n_unmatched[0] = join.only1.size();
+  n_unmatched[1] = join.only2.size();
+  if (lost_pairs == LostPairs::kDrop) {
+    lost_pair_counts = DropLostPairs(join, is_lost1, is_lost2);
+  } else {
+    lost_pair_counts = CountLostPairs(join, is_lost1, is_lost2);
+  }
+  n_pairs = join.Size();
+
+  std::vector<RunningStatistics> stats1(n_vars), stats2(n_vars), stats_diffs(n_vars);
+  std::vector<float> diffs(n_pairs), joined;
+  for (size_t j = 0; j < n_vars && n_pairs > 0; j++) {
+    // both samples in the order of the join
+    GatherJoined(values1[j], join.index1, joined);
+    values1[j].swap(joined);
+    GatherJoined(values2[j], join.index2, joined);
+    values2[j].swap(joined);
+
+    const float* v1 = values1[j].data();
+    const float* v2 = values2[j].data();
+    float* d = diffs.data();
+    for (size_t i = 0; i < n_pairs; i++) d[i] = v1[i] - v2[i];
+
+    stats1[j].Fill(v1, n_pairs);
+    stats2[j].Fill(v2, n_pairs);
+    stats_diffs[j].Fill(d, n_pairs);
+    if (!with_histograms) {
+      std::vector<float>().swap(values1[j]);
+      std::vector<float>().swap(values2[j]);
+    }
+  }
+
+  for (size_t j = 0; j < n_vars; j++) {
+    const std::string& type = types[j];
+    set_name_to_stats["histos1"][type] = stats1[j];
+    set_name_to_stats["histos2"][type] = stats2[j];
+    set_name_to_stats["histos_1d_diffs"]["d_" + type] = stats_diffs[j];
   }
 
-  Long64_t nentries = tree1->GetEntriesFast();
-  for (int i = 0; i < nentries; i++) {
-    tree1->GetEntry(i);
-    tree2->GetEntry(i);
+  if (!with_histograms) return;
 
-    for (int j = 0; j < vars1.size(); j++) {
-      var_name_to_hist1.at(vars1[j].type)->Fill(vars1[j].value);
-      var_name_to_hist2.at(vars2[j].type)->Fill(vars2[j].value);
-      var_name_to_hist_1d_diffs.at("d_" + vars1[j].type)->Fill(vars1[j].value - vars2[j].value);
+  VarNameToHist var_name_to_hist1, 
+                var_name_to_hist2, 
+                var_name_to_hist_1d_diffs;
+
+  for (size_t j = 0; j < n_vars; j++) {
+    const std::string& type = types[j];
+    std::string hist_name = "d_" + type;
+
+    TH1F* hist1 = new TH1F((type + "1").c_str(), type.c_str(), 100, stats1[j].GetMin(), stats1[j].GetMax());
+    TH1F* hist2 = new TH1F((type + "2").c_str(), type.c_str(), 100, stats2[j].GetMin(), stats2[j].GetMax());
+    TH1F* hist_diff = new TH1F(hist_name.c_str(), (hist_name + " between optics").c_str(), 1000, 
+                               stats1[j].GetMin() - stats2[j].GetMax(), 
+                               stats1[j].GetMax() - stats2[j].GetMin());
+    hist1->SetDirectory(0);
+    hist2->SetDirectory(0);
+    hist_diff->SetDirectory(0);
+
+    for (size_t i = 0; i < n_pairs; i++) {
+      hist1->Fill(values1[j][i]);
+      hist2->Fill(values2[j][i]);
+      hist_diff->Fill(values1[j][i] - values2[j][i]);
     }
+
+    var_name_to_hist1[type] = hist1;
+    var_name_to_hist2[type] = hist2;
+    var_name_to_hist_1d_diffs[hist_name] = hist_diff;
   }
   set_name_to_histos["histos1"] = var_name_to_hist1;
   set_name_to_histos["histos2"] = var_name_to_hist2;
   set_name_to_histos["histos_1d_diffs"] = var_name_to_hist_1d_diffs;
 }
 
+DistributionsDifference::~DistributionsDifference() {
+  for (const auto& [set_name, var_name_to_hist] : set_name_to_histos) {
+    for (const auto& [var_name, hist] : var_name_to_hist) delete hist;
+  }
+}
+
+/**
+\brief Exact (unbinned) RMS of every variable of set_name.
+*/
 std::map<std::string, double> DistributionsDifference::GetRMSs(const std::string& set_name) const {
   std::map<std::string, double> var_name_to_rms;
-  VarNameToHist var_name_to_hist = set_name_to_histos.at(set_name);
 
-  for (const auto& [var_name, hist] : var_name_to_hist) {
-    var_name_to_rms[var_name] = hist->GetRMS();
+  for (const auto& [var_name, stats] : set_name_to_stats.at(set_name)) {
+    var_name_to_rms[var_name] = stats.GetRMS();
   }
   return var_name_to_rms;
 }
 
+/**
+\brief Exact (unbinned) mean of every variable of set_name.
+*/
 std::map<std::string, double> DistributionsDifference::GetMeans(const std::string& set_name) const {
   std::map<std::string, double> var_name_to_mean;
-  VarNameToHist var_name_to_hist = set_name_to_histos.at(set_name);
 
-  for (const auto& [var_name, hist] : var_name_to_hist) {
-    var_name_to_mean[var_name] = hist->GetMean();
+  for (const auto& [var_name, stats] : set_name_to_stats.at(set_name)) {
+    var_name_to_mean[var_name] = stats.GetMean();
   }
   return var_name_to_mean;
 }
+
+const VarNameToStatistics& DistributionsDifference::GetStatistics(const std::string& set_name) const {
+  return set_name_to_stats.at(set_name);
+}
+
+/**
+\brief Histograms of set_name; empty unless the object was built with_histograms.
+*/
+const VarNameToHist& DistributionsDifference::GetHistograms(const std::string& set_name) const {
+  static const VarNameToHist empty;
+  auto it = set_name_to_histos.find(set_name);
+  return it == set_name_to_histos.end() ? empty : it->second;
+}
+
+/**
+\brief Number of compared events (matched by ev_id, without the dropped lost pairs).
+*/
+size_t DistributionsDifference::GetNumberOfPairs() const {
+  return n_pairs;
+}
+
+/**
+\brief Events of file sample (1 or 2) whose ev_id is not in the other file.
+*/
+size_t DistributionsDifference::GetNumberOfUnmatched(int sample) const {
+  return n_unmatched[sample == 1 ? 0 : 1];
+}
+
+/**
+\brief Matched events with a lost proton, whether they were compared (LostPairs::kKeep) or not.
+*/
+const LostPairCounts& DistributionsDifference::GetLostPairCounts() const {
+  return lost_pair_counts;
+}
@@ -13,18 +13,42 @@
 #include "TLegend.h"
 #include "TStyle.h"
 #include <TROOT.h>
+#include "running_statistics.h"
+#include "event_join.h"
 
 using VarNameToHist = std::map<std::string, TH1F*>;
+using VarNameToStatistics = std::map<std::string, RunningStatistics>;
 
 class DistributionsDifference {
 public:
-  DistributionsDifference(const std::string&, const std::string&);
+  DistributionsDifference(const std::string&, const std::string&, bool with_histograms = false, 
+                          LostPairs lost_pairs = LostPairs::kKeep);
+
+  ~DistributionsDifference();
 
   std::map<std::string, double> GetRMSs(const std::string&) const;
 
   std::map<std::string, double> GetMeans(const std::string&) const;
 
+  const VarNameToStatistics& GetStatistics(const std::string&) const;
+
+  const VarNameToHist& GetHistograms(const std::string&) const;
+
+  size_t GetNumberOfPairs() const;
+
+  size_t GetNumberOfUnmatched(int sample) const;
+
+  const LostPairCounts& GetLostPairCounts() const;
+
 private:
+  // owns the histograms
+  DistributionsDifference(const DistributionsDifference&) = delete;
+  DistributionsDifference& operator=(const DistributionsDifference&) = delete;
+
+  size_t n_pairs;
+  size_t n_unmatched[2];
+  LostPairCounts lost_pair_counts;
+  std::map<std::string, VarNameToStatistics> set_name_to_stats;
   std::map<std::string, VarNameToHist> set_name_to_histos;
 };
 
@@ -0,0 +1,120 @@
+#ifndef dual_h
+#define dual_h
+
+#include <math.h>
+#include <ostream>
+#include <vector>
+
+/**
+\brief Forward-mode automatic differentiation scalar: a value and its gradient.
+
+The gradient has one component per independent variable; an empty gradient stands
+for a constant. Binary operations take their left operand by value, so chains of
+temporaries reuse one gradient buffer.
+
+Comparisons with a plain number look at the value only, except == and != which treat
+a Dual as the constant only if its gradient vanishes. This keeps guards such as
+"if (strength_ratio != 1)" in the transport kernels from dropping the derivative of
+a variable that sits at its nominal value.
+*/
+class Dual {
+public:
+  Dual(double v = 0) : value(v) {}
+
+  static Dual Variable(double v, size_t index, size_t n_variables) {
+    Dual d(v);
+    d.grad.assign(n_variables, 0.);
+    d.grad[index] = 1.;
+    return d;
+  }
+
+  bool IsConstant() const {
+    for (double g : grad) if (g != 0) return false;
+    return true;
+  }
+
+  double value;
+  std::vector<double> grad;
+
+  Dual& operator+=(const Dual& b) {
+    value += b.value;
+    Axpy(1., b.grad);
+    return *this;
+  }
+
+  Dual& operator-=(const Dual& b) {
+    value -= b.value;
+    Axpy(-1., b.grad);
+    return *this;
+  }
+
+  Dual& operator*=(const Dual& b) {
+    // (a b)' = a' b + a b'
+    Scale(b.value);
+    Axpy(value, b.grad);
+    value *= b.value;
+    return *this;
+  }
+
+  Dual& operator/=(const Dual& b) {
+    // (a / b)' = (a' - (a / b) b') / b
+    double q = value / b.value;
+    Axpy(-q, b.grad);
+    Scale(1. / b.value);
+    value = q;
+    return *this;
+  }
+
+  // d(f(u)) = f'(u) du
+  Dual& Chain(double f, double df) {
+    value = f;
+    Scale(df);
+    return *this;
+  }
+
+private:
+  void Scale(double s) {
+    for (double& g : grad) g *= s;
+  }
+
+  void Axpy(double s, const std::vector<double>& other) {
+    if (other.empty() || s == 0) return;
+    if (grad.empty()) grad.assign(other.size(), 0.);
+    for (size_t i = 0; i < other.size(); i++) grad[i] += s * other[i];
+  }
+};
+
+inline Dual operator+(Dual a, const Dual& b) { return a += b; }
+inline Dual operator-(Dual a, const Dual& b) { return a -= b; }
+inline Dual operator*(Dual a, const Dual& b) { return a *= b; }
+inline Dual operator/(Dual a, const Dual& b) { return a /= b; }
+inline Dual operator+(Dual a, double b) { a.value += b; return a; }
+inline Dual operator-(Dual a, double b) { a.value -= b; return a; }
+inline Dual operator*(Dual a, double b) { return a.Chain(a.value * b, b); }
+inline Dual operator/(Dual a, double b) { return a.Chain(a.value / b, 1. / b); }
+inline Dual operator+(double a, Dual b) { return b + a; }
+inline Dual operator-(double a, Dual b) { return b.Chain(a - b.value, -1.); }
+inline Dual operator*(double a, Dual b) { return b * a; }
+inline Dual operator/(double a, const Dual& b) { return Dual(a) /= b; }
+inline Dual operator-(Dual a) { return a.Chain(-a.value, -1.); }
+
+inline bool operator<(const Dual& a, double b) { return a.value < b; }
+inline bool operator>(const Dual& a, double b) { return a.value > b; }
+inline bool operator<=(const Dual& a, double b) { return a.value <= b; }
+inline bool operator>=(const Dual& a, double b) { return a.value >= b; }
+inline bool operator==(const Dual& a, double b) { return a.value == b && a.IsConstant(); }
+inline bool operator!=(const Dual& a, double b) { return !(a == b); }
+
+inline Dual sqrt(Dual a) { double s = ::sqrt(a.value); return a.Chain(s, 0.5 / s); }
+inline Dual sin(Dual a) { double v = a.value; return a.Chain(::sin(v), ::cos(v)); }
+inline Dual cos(Dual a) { double v = a.value; return a.Chain(::cos(v), -::sin(v)); }
+inline Dual sinh(Dual a) { double v = a.value; return a.Chain(::sinh(v), ::cosh(v)); }
+inline Dual cosh(Dual a) { double v = a.value; return a.Chain(::cosh(v), ::sinh(v)); }
+inline Dual fabs(Dual a) { double v = a.value; return a.Chain(::fabs(v), v < 0 ? -1. : 1.); }
+
+inline double Value(double v) { return v; }
+inline double Value(const Dual& d) { return d.value; }
+
+inline std::ostream& operator<<(std::ostream& out, const Dual& d) { return out << d.value; }
+
+#endif
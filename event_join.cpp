@@ -0,0 +1,118 @@
+#include "event_join.h"
+
+#include <algorithm>
+
+namespace {
+
+bool IsOrdered(const std::vector<int>& ev_id) {
+  for (size_t i = 1; i < ev_id.size(); i++) if (ev_id[i] < ev_id[i - 1]) return false;
+  return true;
+}
+
+// Entries of ev_id in increasing ev_id (stable). The ids of a sample are nearly dense,
+// so a counting sort over their range is used unless the range is much larger than the
+// sample; a comparison sort otherwise.
+std::vector<int> OrderByEventId(const std::vector<int>& ev_id) {
+  std::vector<int> order(ev_id.size());
+  if (ev_id.empty()) return order;
+  auto range = std::minmax_element(ev_id.begin(), ev_id.end());
+  long long min_id = *range.first;
+  long long span = (long long)*range.second - min_id + 1;
+
+  if (span <= 2 * (long long)ev_id.size() + 1024) {
+    std::vector<int> start(span + 1, 0);
+    for (int id : ev_id) start[id - min_id + 1]++;
+    for (long long b = 0; b < span; b++) start[b + 1] += start[b];
+    for (size_t i = 0; i < ev_id.size(); i++) order[start[ev_id[i] - min_id]++] = i;
+    return order;
+  }
+  for (size_t i = 0; i < order.size(); i++) order[i] = i;
+  std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return ev_id[a] < ev_id[b]; });
+  return order;
+}
+
+// Merge join of two samples visited in increasing ev_id: entry order1[i] of sample 1
+// (entry i if order1 is empty) against entry order2[j] of sample 2.
+void MergeJoin(const std::vector<int>& ev_id1, const std::vector<int>& order1,
+               const std::vector<int>& ev_id2, const std::vector<int>& order2, EventJoin& join) {
+  size_t n1 = ev_id1.size(), n2 = ev_id2.size();
+  auto entry1 = [&](size_t i) { return order1.empty() ? (int)i : order1[i]; };
+  auto entry2 = [&](size_t j) { return order2.empty() ? (int)j : order2[j]; };
+  join.index1.reserve(std::min(n1, n2));
+  join.index2.reserve(std::min(n1, n2));
+
+  size_t i = 0, j = 0;
+  while (i < n1 || j < n2) {
+    int a = i < n1 ? entry1(i) : -1;
+    int b = j < n2 ? entry2(j) : -1;
+    // repeats of the ev_id just visited
+    if (a >= 0 && i > 0 && ev_id1[a] == ev_id1[entry1(i - 1)]) {join.duplicates1++; i++; continue;}
+    if (b >= 0 && j > 0 && ev_id2[b] == ev_id2[entry2(j - 1)]) {join.duplicates2++; j++; continue;}
+
+    if (b < 0 || (a >= 0 && ev_id1[a] < ev_id2[b])) {
+      join.only1.push_back(a);
+      i++;
+    } else if (a < 0 || ev_id2[b] < ev_id1[a]) {
+      join.only2.push_back(b);
+      j++;
+    } else {
+      join.index1.push_back(a);
+      join.index2.push_back(b);
+      i++;
+      j++;
+    }
+  }
+}
+
+} // namespace
+
+/**
+\brief Match the entries of two samples by ev_id.
+
+Samples written in ev_id order (the output of simple_tracking) are merged in a single
+sequential pass. Otherwise each unordered sample gets a compact index, the order of its
+entries by ev_id, and the merge runs over it. Only the ev_id columns are needed; the other
+columns are then taken with GatherJoined.
+*/
+EventJoin JoinByEventId(const std::vector<int>& ev_id1, const std::vector<int>& ev_id2) {
+  EventJoin join;
+  bool ordered1 = IsOrdered(ev_id1);
+  bool ordered2 = IsOrdered(ev_id2);
+  join.merged = ordered1 && ordered2;
+  std::vector<int> order1, order2;
+  if (!ordered1) order1 = OrderByEventId(ev_id1);
+  if (!ordered2) order2 = OrderByEventId(ev_id2);
+  MergeJoin(ev_id1, order1, ev_id2, order2, join);
+  return join;
+}
+
+/**
+\brief Remove the matched events lost in either sample from join and count them.
+*/
+LostPairCounts DropLostPairs(EventJoin& join, const std::vector<unsigned char>& is_lost1,
+                             const std::vector<unsigned char>& is_lost2) {
+  LostPairCounts counts = CountLostPairs(join, is_lost1, is_lost2);
+  size_t kept = 0;
+  for (size_t k = 0; k < join.Size(); k++) {
+    if (is_lost1[join.index1[k]] || is_lost2[join.index2[k]]) continue;
+    join.index1[kept] = join.index1[k];
+    join.index2[kept] = join.index2[k];
+    kept++;
+  }
+  join.index1.resize(kept);
+  join.index2.resize(kept);
+  return counts;
+}
+
+LostPairCounts CountLostPairs(const EventJoin& join, const std::vector<unsigned char>& is_lost1,
+                              const std::vector<unsigned char>& is_lost2) {
+  LostPairCounts counts;
+  for (size_t k = 0; k < join.Size(); k++) {
+    bool lost1 = is_lost1[join.index1[k]];
+    bool lost2 = is_lost2[join.index2[k]];
+    if (lost1 && lost2) counts.lost_both++;
+    else if (lost1) counts.lost1++;
+    else if (lost2) counts.lost2++;
+  }
+  return counts;
+}
@@ -0,0 +1,59 @@
+#ifndef event_join_h
+#define event_join_h
+
+#include <cstddef>
+#include <vector>
+
+/**
+\brief Entries of two transported samples matched by ev_id.
+
+index1[k] and index2[k] are the entries of the same event in sample 1 and 2, in
+increasing ev_id. Events present in one sample only are listed in only1 / only2. An
+ev_id repeated within a sample is joined once, with its first entry; the repeats are
+counted in duplicates1 / duplicates2.
+*/
+struct EventJoin {
+  std::vector<int> index1, index2;
+  std::vector<int> only1, only2;
+  size_t duplicates1 = 0;
+  size_t duplicates2 = 0;
+  bool merged = false; //!< both samples were ordered by ev_id and were merged without an index
+
+  size_t Size() const { return index1.size(); }
+};
+
+/**
+\brief Matched events by their is_lost flags, see DropLostPairs.
+*/
+struct LostPairCounts {
+  size_t lost1 = 0; //!< lost in sample 1 only
+  size_t lost2 = 0; //!< lost in sample 2 only
+  size_t lost_both = 0;
+};
+
+/**
+\brief What a comparison does with matched events whose proton is lost in either sample.
+*/
+enum class LostPairs {
+  kKeep, //!< compare them like the others (the positions are where the proton was stopped)
+  kDrop  //!< leave them out, see DropLostPairs
+};
+
+EventJoin JoinByEventId(const std::vector<int>& ev_id1, const std::vector<int>& ev_id2);
+
+LostPairCounts DropLostPairs(EventJoin&, const std::vector<unsigned char>& is_lost1,
+                             const std::vector<unsigned char>& is_lost2);
+
+LostPairCounts CountLostPairs(const EventJoin&, const std::vector<unsigned char>& is_lost1,
+                              const std::vector<unsigned char>& is_lost2);
+
+/**
+\brief out[k] = values[index[k]], the values of one sample in the order of the join.
+*/
+template <class T>
+void GatherJoined(const std::vector<T>& values, const std::vector<int>& index, std::vector<T>& out) {
+  out.resize(index.size());
+  for (size_t k = 0; k < index.size(); k++) out[k] = values[index[k]];
+}
+
+#endif
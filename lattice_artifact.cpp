@@ -0,0 +1,186 @@
+#include "lattice_artifact.h"
+
+#include <cstring>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <type_traits>
+#include <unistd.h>
+
+namespace {
+
+const char kArtifactMagic[8] = {'P', 'P', 'S', 'S', 'L', 'A', 'T', 'T'};
+const uint32_t kArtifactVersion = 2;
+
+static_assert(std::is_trivially_copyable<BeamElement>::value, "BeamElement is stored as raw bytes");
+
+// Artifact layout: this header, then n_elements BeamElement records at elements_offset
+// and n_magnets MagnetRecord records at magnets_offset.
+struct ArtifactHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t element_size;  // sizeof(BeamElement) of the writer, guards against layout changes
+  uint64_t source_hash;
+  uint64_t n_elements;
+  uint64_t elements_offset;
+  uint64_t n_magnets;
+  uint64_t magnets_offset;
+};
+
+struct MagnetRecord {
+  char type[16];
+  int32_t id;
+  int32_t reserved;
+  double position;
+};
+
+size_t Align8(size_t n) {
+  return (n + 7) & ~size_t(7);
+}
+
+} // namespace
+
+/**
+\brief FNV-1a 64-bit hash of the content of file_name.
+
+\return false if the file cannot be read
+*/
+bool HashFileContent(const std::string& file_name, uint64_t& hash) {
+  FILE* f = fopen(file_name.c_str(), "rb");
+  if (!f) return false;
+  hash = 0xcbf29ce484222325ULL;
+  unsigned char buffer[1 << 16];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+    for (size_t i = 0; i < n; i++) {
+      hash ^= buffer[i];
+      hash *= 0x100000001b3ULL;
+    }
+  }
+  bool ok = !ferror(f);
+  fclose(f);
+  return ok;
+}
+
+/**
+\brief Write the artifact of a Twiss file with content hash source_hash.
+
+The file is written under a temporary name and renamed, so concurrent builders and
+readers never see a partial artifact.
+*/
+bool WriteLatticeArtifact(const std::string& artifact_name, uint64_t source_hash, 
+                          const std::vector<BeamElement>& elements, const std::vector<Magnet>& magnets) {
+  ArtifactHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kArtifactMagic, sizeof(kArtifactMagic));
+  header.version = kArtifactVersion;
+  header.element_size = sizeof(BeamElement);
+  header.source_hash = source_hash;
+  header.n_elements = elements.size();
+  header.elements_offset = Align8(sizeof(header));
+  header.n_magnets = magnets.size();
+  header.magnets_offset = Align8(header.elements_offset + elements.size() * sizeof(BeamElement));
+
+  std::vector<char> buffer(header.magnets_offset + magnets.size() * sizeof(MagnetRecord), 0);
+  memcpy(buffer.data(), &header, sizeof(header));
+  if (!elements.empty()) memcpy(buffer.data() + header.elements_offset, elements.data(), elements.size() * sizeof(BeamElement));
+  for (size_t i = 0; i < magnets.size(); i++) {
+    MagnetRecord record;
+    memset(&record, 0, sizeof(record));
+    strncpy(record.type, magnets[i].GetType().c_str(), sizeof(record.type) - 1);
+    record.id = magnets[i].GetId();
+    record.position = magnets[i].GetPosition();
+    memcpy(buffer.data() + header.magnets_offset + i * sizeof(MagnetRecord), &record, sizeof(record));
+  }
+
+  std::string tmp_name = artifact_name + ".tmp" + std::to_string(getpid());
+  FILE* f = fopen(tmp_name.c_str(), "wb");
+  if (!f) return false;
+  bool ok = fwrite(buffer.data(), 1, buffer.size(), f) == buffer.size();
+  ok = fclose(f) == 0 && ok;
+  if (ok) ok = rename(tmp_name.c_str(), artifact_name.c_str()) == 0;
+  if (!ok) remove(tmp_name.c_str());
+  return ok;
+}
+
+MappedLattice::MappedLattice()
+  : data(0), size(0), elements(0), n_elements(0), magnets(0), n_magnets(0)
+{
+}
+
+MappedLattice::~MappedLattice() {
+  Close();
+}
+
+/**
+\brief Map artifact_name.
+
+\return false if the artifact is missing, malformed, of another version or element layout,
+or was built from a Twiss file with a different content hash (i.e. it is stale)
+*/
+bool MappedLattice::Open(const std::string& artifact_name, uint64_t source_hash) {
+  Close();
+  int fd = open(artifact_name.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ArtifactHeader)) {
+    close(fd);
+    return false;
+  }
+  void* mapping = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) return false;
+  data = mapping;
+  size = st.st_size;
+
+  const ArtifactHeader* header = static_cast<const ArtifactHeader*>(data);
+  bool ok = memcmp(header->magic, kArtifactMagic, sizeof(kArtifactMagic)) == 0 &&
+            header->version == kArtifactVersion &&
+            header->element_size == sizeof(BeamElement) &&
+            header->source_hash == source_hash &&
+            header->elements_offset % 8 == 0 && header->magnets_offset % 8 == 0 &&
+            header->elements_offset + header->n_elements * sizeof(BeamElement) <= size &&
+            header->magnets_offset + header->n_magnets * sizeof(MagnetRecord) <= size;
+  if (!ok) {
+    Close();
+    return false;
+  }
+  const char* base = static_cast<const char*>(data);
+  elements = reinterpret_cast<const BeamElement*>(base + header->elements_offset);
+  n_elements = header->n_elements;
+  magnets = base + header->magnets_offset;
+  n_magnets = header->n_magnets;
+  return true;
+}
+
+void MappedLattice::Close() {
+  if (data) munmap(data, size);
+  data = 0;
+  size = 0;
+  elements = 0;
+  n_elements = 0;
+  magnets = 0;
+  n_magnets = 0;
+}
+
+const BeamElement* MappedLattice::GetElements() const {
+  return elements;
+}
+
+size_t MappedLattice::GetNumberOfElements() const {
+  return n_elements;
+}
+
+/**
+\brief Magnets as produced by ProtonTransport::SetPositions for the source Twiss file.
+*/
+std::vector<Magnet> MappedLattice::GetMagnets() const {
+  std::vector<Magnet> result;
+  result.reserve(n_magnets);
+  const MagnetRecord* records = static_cast<const MagnetRecord*>(magnets);
+  for (size_t i = 0; i < n_magnets; i++) {
+    result.push_back(Magnet(records[i].type, records[i].id, records[i].position));
+  }
+  return result;
+}
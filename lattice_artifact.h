@@ -0,0 +1,51 @@
+#ifndef lattice_artifact_h
+#define lattice_artifact_h
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "beamline.h"
+#include "magnet.h"
+
+bool HashFileContent(const std::string&, uint64_t&);
+
+bool WriteLatticeArtifact(const std::string&, uint64_t, const std::vector<BeamElement>&, const std::vector<Magnet>&);
+
+/**
+\brief Read-only memory mapping of a compiled lattice artifact.
+
+The artifact holds the typed element table (with apertures) and the magnet index of one
+Twiss file, keyed by the FNV-1a hash of the Twiss file content. Processes mapping the
+same artifact share its pages in the page cache.
+*/
+class MappedLattice {
+public:
+  MappedLattice();
+
+  ~MappedLattice();
+
+  MappedLattice(const MappedLattice&) = delete;
+
+  MappedLattice& operator=(const MappedLattice&) = delete;
+
+  bool Open(const std::string&, uint64_t);
+
+  void Close();
+
+  const BeamElement* GetElements() const;
+
+  size_t GetNumberOfElements() const;
+
+  std::vector<Magnet> GetMagnets() const;
+
+private:
+  void* data;
+  size_t size;
+  const BeamElement* elements;
+  size_t n_elements;
+  const void* magnets;
+  size_t n_magnets;
+};
+
+#endif
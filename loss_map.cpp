@@ -0,0 +1,200 @@
+#include "loss_map.h"
+
+#include <cstring>
+#include <iostream>
+#include <stdio.h>
+#include <unistd.h>
+
+namespace {
+
+const char kLossMapMagic[8] = {'P', 'P', 'S', 'S', 'L', 'O', 'S', 'S'};
+const uint32_t kLossMapVersion = 1;
+
+// Loss map file: this header, then n_elements uint64 counts.
+struct LossMapHeader {
+  char magic[8];
+  uint32_t version;
+  int32_t run_id;
+  uint64_t n_tracked;
+  uint64_t n_runs;
+  uint64_t n_elements;
+};
+
+} // namespace
+
+void LossRecords::Add(int ev_id_, int element_, double z_, double x_, double y_, double px_, double py_, double pz_) {
+  ev_id.push_back(ev_id_);
+  element.push_back(element_);
+  z.push_back(z_);
+  x.push_back(x_);
+  y.push_back(y_);
+  px.push_back(px_);
+  py.push_back(py_);
+  pz.push_back(pz_);
+}
+
+void LossRecords::Append(const LossRecords& other) {
+  ev_id.insert(ev_id.end(), other.ev_id.begin(), other.ev_id.end());
+  element.insert(element.end(), other.element.begin(), other.element.end());
+  z.insert(z.end(), other.z.begin(), other.z.end());
+  x.insert(x.end(), other.x.begin(), other.x.end());
+  y.insert(y.end(), other.y.begin(), other.y.end());
+  px.insert(px.end(), other.px.begin(), other.px.end());
+  py.insert(py.end(), other.py.begin(), other.py.end());
+  pz.insert(pz.end(), other.pz.begin(), other.pz.end());
+}
+
+void LossRecords::Clear() {
+  ev_id.clear();
+  element.clear();
+  z.clear();
+  x.clear();
+  y.clear();
+  px.clear();
+  py.clear();
+  pz.clear();
+}
+
+LossMap::LossMap() : n_tracked(0), n_runs(0) {}
+
+LossMap::LossMap(size_t n_elements) : counts(n_elements, 0), n_tracked(0), n_runs(1) {}
+
+void LossMap::Fill(int element, uint64_t n) {
+  if (element < 0) return;
+  if ((size_t)element >= counts.size()) counts.resize(element + 1, 0);
+  counts[element] += n;
+}
+
+void LossMap::Fill(const LossRecords& records) {
+  for (int element : records.element) Fill(element);
+}
+
+void LossMap::AddTracked(uint64_t n) {
+  n_tracked += n;
+}
+
+void LossMap::SetNumberOfRuns(uint64_t n) {
+  n_runs = n;
+}
+
+/**
+\brief Add the counts of another run (or aggregate) of the same beamline.
+*/
+void LossMap::Merge(const LossMap& other) {
+  if (other.counts.size() > counts.size()) counts.resize(other.counts.size(), 0);
+  for (size_t i = 0; i < other.counts.size(); i++) counts[i] += other.counts[i];
+  n_tracked += other.n_tracked;
+  n_runs += other.n_runs;
+}
+
+size_t LossMap::GetNumberOfElements() const {
+  return counts.size();
+}
+
+uint64_t LossMap::GetCount(size_t element) const {
+  return element < counts.size() ? counts[element] : 0;
+}
+
+uint64_t LossMap::GetTotal() const {
+  uint64_t total = 0;
+  for (uint64_t count : counts) total += count;
+  return total;
+}
+
+uint64_t LossMap::GetNumberOfTracked() const {
+  return n_tracked;
+}
+
+uint64_t LossMap::GetNumberOfRuns() const {
+  return n_runs;
+}
+
+/**
+\brief Write the per-element counts of one run as a small binary summary.
+
+The file is written under a temporary name and renamed, so an aggregator never reads
+a partial map.
+*/
+bool WriteLossMap(const std::string& file_name, const LossMap& map, int run_id) {
+  LossMapHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kLossMapMagic, sizeof(kLossMapMagic));
+  header.version = kLossMapVersion;
+  header.run_id = run_id;
+  header.n_tracked = map.GetNumberOfTracked();
+  header.n_runs = map.GetNumberOfRuns();
+  header.n_elements = map.GetNumberOfElements();
+  std::vector<uint64_t> counts(header.n_elements);
+  for (size_t i = 0; i < counts.size(); i++) counts[i] = map.GetCount(i);
+
+  std::string tmp_name = file_name + ".tmp" + std::to_string(getpid());
+  FILE* f = fopen(tmp_name.c_str(), "wb");
+  if (!f) return false;
+  bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+  if (ok && !counts.empty()) ok = fwrite(counts.data(), sizeof(uint64_t), counts.size(), f) == counts.size();
+  ok = fclose(f) == 0 && ok;
+  if (ok) ok = rename(tmp_name.c_str(), file_name.c_str()) == 0;
+  if (!ok) remove(tmp_name.c_str());
+  return ok;
+}
+
+/**
+\return false if the file is missing, malformed or of another version
+*/
+bool ReadLossMap(const std::string& file_name, LossMap& map, int& run_id) {
+  FILE* f = fopen(file_name.c_str(), "rb");
+  if (!f) return false;
+  LossMapHeader header;
+  bool ok = fread(&header, sizeof(header), 1, f) == 1 &&
+            memcmp(header.magic, kLossMapMagic, sizeof(kLossMapMagic)) == 0 &&
+            header.version == kLossMapVersion;
+  std::vector<uint64_t> counts;
+  if (ok) {
+    counts.resize(header.n_elements);
+    ok = counts.empty() || fread(counts.data(), sizeof(uint64_t), counts.size(), f) == counts.size();
+  }
+  fclose(f);
+  if (!ok) return false;
+
+  map = LossMap(counts.size());
+  for (size_t i = 0; i < counts.size(); i++) if (counts[i]) map.Fill(i, counts[i]);
+  map.AddTracked(header.n_tracked);
+  map.SetNumberOfRuns(header.n_runs);
+  run_id = header.run_id;
+  return true;
+}
+
+/**
+\brief Sum of the loss maps in files; unreadable files are reported and skipped.
+*/
+LossMap AggregateLossMaps(const std::vector<std::string>& files) {
+  LossMap total;
+  for (const auto& file_name : files) {
+    LossMap map;
+    int run_id;
+    if (!ReadLossMap(file_name, map, run_id)) {
+      std::cout << "WARNING! Cannot read loss map " << file_name << std::endl;
+      continue;
+    }
+    total.Merge(map);
+  }
+  return total;
+}
+
+/**
+\brief One row per element with losses: index, position, kind, aperture type, count and fraction of tracked protons.
+*/
+void WriteLossMapCsv(std::ostream& f, const LossMap& map, const std::vector<BeamElement>& elements) {
+  f << "element,position,kind,apertype,lost,fraction\n";
+  for (size_t i = 0; i < map.GetNumberOfElements(); i++) {
+    if (map.GetCount(i) == 0) continue;
+    f << i << ",";
+    if (i < elements.size()) {
+      f << elements[i].position << "," << ElementKindName(elements[i].kind) << "," << ApertureTypeName(elements[i].aperture.type);
+    } else {
+      f << ",,";
+    }
+    double fraction = map.GetNumberOfTracked() ? (double)map.GetCount(i) / map.GetNumberOfTracked() : 0.;
+    f << "," << map.GetCount(i) << "," << fraction << "\n";
+  }
+}
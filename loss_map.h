@@ -0,0 +1,78 @@
+#ifndef loss_map_h
+#define loss_map_h
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "beamline.h"
+
+/**
+\brief Lost protons in structure-of-arrays layout, one entry per lost proton.
+
+element is the index in the compiled beamline of the element whose aperture stopped the
+proton; z, x, y are where it was left, in front of that element. px, py, pz are the
+initial kinematics (crossing angle included).
+*/
+struct LossRecords {
+  std::vector<int> ev_id;
+  std::vector<int> element;
+  std::vector<float> z, x, y;
+  std::vector<float> px, py, pz;
+
+  void Add(int ev_id_, int element_, double z_, double x_, double y_, double px_, double py_, double pz_);
+
+  void Append(const LossRecords&);
+
+  void Clear();
+
+  size_t Size() const { return ev_id.size(); }
+};
+
+/**
+\brief Number of protons lost at each element of the beamline, out of GetNumberOfTracked.
+
+Maps of different runs of the same beamline are combined with Merge.
+*/
+class LossMap {
+public:
+  LossMap();
+
+  explicit LossMap(size_t n_elements);
+
+  void Fill(int element, uint64_t n = 1);
+
+  void Fill(const LossRecords&);
+
+  void AddTracked(uint64_t);
+
+  void SetNumberOfRuns(uint64_t);
+
+  void Merge(const LossMap&);
+
+  size_t GetNumberOfElements() const;
+
+  uint64_t GetCount(size_t element) const;
+
+  uint64_t GetTotal() const;
+
+  uint64_t GetNumberOfTracked() const;
+
+  uint64_t GetNumberOfRuns() const;
+
+private:
+  std::vector<uint64_t> counts;
+  uint64_t n_tracked;
+  uint64_t n_runs;
+};
+
+bool WriteLossMap(const std::string&, const LossMap&, int run_id);
+
+bool ReadLossMap(const std::string&, LossMap&, int& run_id);
+
+LossMap AggregateLossMaps(const std::vector<std::string>&);
+
+void WriteLossMapCsv(std::ostream&, const LossMap&, const std::vector<BeamElement>&);
+
+#endif
@@ -22,10 +22,18 @@ double Magnet::GetPosition() const {
   return position;
 }
 
-std::string Magnet::GetName() const {
+const std::string& Magnet::GetName() const {
   return name;
 }
 
+bool operator < (const Magnet& lhs, const Magnet& rhs) {
+  return lhs.GetName() < rhs.GetName();
+}
+
+bool operator == (const Magnet& lhs, const Magnet& rhs) {
+  return lhs.GetName() == rhs.GetName();
+}
+
 Dipole::Dipole(int id, double pos) 
   : Magnet("RBEND", id, pos) {}
 
@@ -17,7 +17,7 @@ public:
 
   double GetPosition() const;
 
-  std::string GetName() const;
+  const std::string& GetName() const;
 
 private:
   std::string type;
@@ -26,6 +26,10 @@ private:
   std::string name;
 };
 
+bool operator < (const Magnet&, const Magnet&);
+
+bool operator == (const Magnet&, const Magnet&);
+
 class Dipole : public Magnet {
 public:
   Dipole(int, double);
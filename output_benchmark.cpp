@@ -0,0 +1,103 @@
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include "TFile.h"
+#include "TTree.h"
+#include <TROOT.h>
+#include "output_writer.h"
+
+using namespace std;
+
+// Writes the ntuple of one transported sample with every output format and compression,
+// and reports the write throughput and the file size, to pick the output settings of
+// simple_tracking. Usage: ./output_benchmark [transported.root] [repetitions]
+
+namespace {
+
+bool ReadNtuple(const string& file_name, TrackedColumns& columns) {
+  TFile* file = new TFile(file_name.c_str());
+  if (file->IsZombie()) return false;
+  TTree* tree = 0;
+  file->GetObject("ntuple", tree);
+  if (!tree) {
+    delete file;
+    return false;
+  }
+  int process_code, ev_id;
+  float px, py, pz, e, x, y, sx, sy;
+  bool is_lost;
+  tree->SetBranchAddress("process_code", &process_code);
+  tree->SetBranchAddress("px", &px);
+  tree->SetBranchAddress("py", &py);
+  tree->SetBranchAddress("pz", &pz);
+  tree->SetBranchAddress("e", &e);
+  tree->SetBranchAddress("x", &x);
+  tree->SetBranchAddress("y", &y);
+  tree->SetBranchAddress("sx", &sx);
+  tree->SetBranchAddress("sy", &sy);
+  tree->SetBranchAddress("ev_id", &ev_id);
+  tree->SetBranchAddress("is_lost", &is_lost);
+
+  vector<TrackedProton> rows(tree->GetEntries());
+  for (Long64_t i = 0; i < tree->GetEntries(); i++) {
+    tree->GetEntry(i);
+    rows[i] = TrackedProton{process_code, px, py, pz, e, x, y, sx, sy, ev_id, is_lost};
+  }
+  columns.Append(rows);
+  file->Close();
+  delete file;
+  return true;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  gROOT->ProcessLine("gErrorIgnoreLevel = 1001;");
+  string input = argc > 1 ? argv[1]
+                          : "def_shifted__changed_strength_pythia8_13TeV_protons_100k_transported_205m_beta40cm_6500GeV_y-185murad.root";
+  int repetitions = argc > 2 ? stoi(argv[2]) : 5;
+
+  TrackedColumns columns;
+  if (!ReadNtuple(input, columns)) {
+    cout << "ERROR! Cannot read the ntuple of " << input << endl;
+    return 1;
+  }
+  double payload_mb = columns.GetPayloadBytes() / 1.e6;
+  cout << columns.Size() << " events, " << payload_mb << " MB of columns, best of " << repetitions << " writes\n";
+  cout << left << setw(10) << "format" << setw(13) << "compression" << right << setw(10) << "MB/s" << setw(14) << "events/s"
+       << setw(12) << "size [MB]" << setw(8) << "ratio" << '\n';
+
+  const OutputFormat formats[] = {OutputFormat::kTTree, OutputFormat::kRNTuple, OutputFormat::kColumnar};
+  const OutputCompression compressions[] = {OutputCompression::kNone, OutputCompression::kLZ4, OutputCompression::kZSTD};
+  for (OutputFormat format : formats) {
+    for (OutputCompression compression : compressions) {
+      OutputOptions options;
+      options.format = format;
+      options.compression = compression;
+      string file_name = OutputWriter::OutputFileName("output_benchmark.root", format);
+
+      double best = 1.e30;
+      uint64_t size = 0;
+      for (int r = 0; r < repetitions; r++) {
+        chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+        unique_ptr<OutputWriter> writer = OutputWriter::Create(options);
+        writer->Open(file_name);
+        writer->WriteSample("ntuple", "ntuple", columns);
+        writer->WriteSummary(0, 0);
+        writer->Close();
+        chrono::steady_clock::time_point end = chrono::steady_clock::now();
+        best = min(best, chrono::duration<double>(end - begin).count());
+        size = writer->GetFileSize();
+      }
+      remove(file_name.c_str());
+
+      cout << left << setw(10) << OutputFormatName(format) << setw(13) << OutputCompressionName(compression) << right << fixed
+           << setprecision(1) << setw(10) << payload_mb / best << setw(14) << setprecision(0) << columns.Size() / best
+           << setprecision(2) << setw(12) << size / 1.e6 << setw(8) << (size ? columns.GetPayloadBytes() / (double)size : 0.)
+           << '\n' << defaultfloat;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,631 @@
+#include "output_writer.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <Compression.h>
+#include <RZip.h>
+#include <TFile.h>
+#include <TH1F.h>
+#include <TTree.h>
+
+#if __has_include(<ROOT/RNTupleWriter.hxx>)
+#define PPSS_HAVE_RNTUPLE 1
+#include <ROOT/RNTupleModel.hxx>
+#include <ROOT/RNTupleWriteOptions.hxx>
+#include <ROOT/RNTupleWriter.hxx>
+#endif
+
+namespace {
+
+const char kColumnarMagic[8] = {'P', 'P', 'S', 'S', 'C', 'O', 'L', 'S'};
+const uint32_t kColumnarVersion = 1;
+const size_t kMaxBlockBytes = 0xffffff; // largest buffer R__zip compresses in one go
+
+// Columnar file layout, all little endian as written by this machine:
+//   ColumnarHeader
+//   per sample: u32 name length, name, u64 n_rows, u32 n_columns, then per column
+//     u32 name length, name, u8 type, u32 n_blocks, then per block
+//     u32 raw bytes, u32 stored bytes, u8 compressed, stored bytes of data
+// Blocks hold cluster_size rows of one column, compressed with ROOT's R__zip.
+struct ColumnarHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t n_samples;
+  double cross_section;
+  double efficiency;
+};
+
+enum ColumnType : uint8_t { kInt32 = 0, kFloat32 = 1, kUInt8 = 2 };
+
+uint64_t FileSize(const std::string& file_name) {
+  struct stat st;
+  return stat(file_name.c_str(), &st) == 0 ? st.st_size : 0;
+}
+
+bool CompressionSetting(OutputCompression compression, int level,
+                        ROOT::RCompressionSetting::EAlgorithm::EValues& algorithm, int& cx_level) {
+  switch (compression) {
+    case OutputCompression::kLZ4:
+      algorithm = ROOT::RCompressionSetting::EAlgorithm::kLZ4;
+      cx_level = level > 0 ? level : 4;
+      return true;
+    case OutputCompression::kZSTD:
+      algorithm = ROOT::RCompressionSetting::EAlgorithm::kZSTD;
+      cx_level = level > 0 ? level : 5;
+      return true;
+    default:
+      return false;
+  }
+}
+
+// ROOT compression settings integer (algorithm * 100 + level); -1 for ROOT's default
+int RootCompressionSettings(const OutputOptions& options) {
+  if (options.compression == OutputCompression::kDefault) return -1;
+  ROOT::RCompressionSetting::EAlgorithm::EValues algorithm;
+  int level;
+  if (!CompressionSetting(options.compression, options.compression_level, algorithm, level)) return 0;
+  return ROOT::CompressionSettings(algorithm, level);
+}
+
+TFile* OpenRootFile(const std::string& file_name, const OutputOptions& options) {
+  int settings = RootCompressionSettings(options);
+  TFile* file = settings < 0 ? new TFile(file_name.c_str(), "recreate")
+                             : new TFile(file_name.c_str(), "recreate", "", settings);
+  if (file->IsZombie()) {
+    std::cout << "ERROR! Cannot create " << file_name << std::endl;
+    delete file;
+    return 0;
+  }
+  return file;
+}
+
+// Close and delete file; false, after printing the reason, if any write to it failed.
+bool CloseRootFile(TFile* file, const std::string& file_name) {
+  file->Close();
+  bool ok = !file->TestBit(TFile::kWriteError);
+  if (!ok) std::cout << "ERROR! Cannot write " << file_name << std::endl;
+  delete file;
+  return ok;
+}
+
+void WriteRootSummary(TFile* file, double cross_section, double efficiency) {
+  file->cd();
+  TH1F * cs = new TH1F("sigma", "cross-section [mb]", 1, 0., 1.);
+  TH1F * eff = new TH1F("efficiency", "efficiency", 1, 0., 1.);
+  cs->Fill(0.5, cross_section);
+  cs->Write();
+  eff->Fill(0.5, efficiency);
+  eff->Write();
+}
+
+// One output tree and the variables its branches are bound to.
+struct TreeSample {
+  TreeSample(TFile* file, const std::string& name, const std::string& title, int basket, long long cluster) {
+    file->cd();
+    tree = new TTree(name.c_str(), title.c_str());
+    tree->Branch("process_code", &process_code, basket);
+    tree->Branch("px", &px, basket);
+    tree->Branch("py", &py, basket);
+    tree->Branch("pz", &pz, basket);
+    tree->Branch("e", &e, basket);
+    tree->Branch("x", &x, basket);
+    tree->Branch("y", &y, basket);
+    tree->Branch("sx", &sx, basket);
+    tree->Branch("sy", &sy, basket);
+    tree->Branch("ev_id", &ev_id, basket);
+    tree->Branch("is_lost", &is_lost, basket);
+    if (cluster > 0) tree->SetAutoFlush(cluster);
+  }
+
+  TTree* tree; //!< owned by the file
+  int process_code, ev_id;
+  float px, py, pz, e, x, y, sx, sy;
+  bool is_lost;
+};
+
+/**
+TTree backend. Every branch gets a basket holding a whole cluster, so a cluster is
+flushed as one basket per branch instead of many small ones.
+*/
+class TTreeWriter : public OutputWriter {
+public:
+  explicit TTreeWriter(const OutputOptions& options) : options(options), file(0), ok(true) {}
+
+  ~TTreeWriter() { Close(); }
+
+  bool Open(const std::string& name) override {
+    file_name = name;
+    file = OpenRootFile(file_name, options);
+    ok = file != 0;
+    return ok;
+  }
+
+  void WriteSample(const std::string& name, const std::string& title, const TrackedColumns& columns) override {
+    if (!file) return;
+    TreeSample tree(file, name, title, BasketSize(columns.Size()), options.cluster_size);
+    for (size_t i = 0; i < columns.Size(); i++) {
+      tree.process_code = columns.process_code[i];
+      tree.px = columns.px[i];
+      tree.py = columns.py[i];
+      tree.pz = columns.pz[i];
+      tree.e = columns.e[i];
+      tree.x = columns.x[i];
+      tree.y = columns.y[i];
+      tree.sx = columns.sx[i];
+      tree.sy = columns.sy[i];
+      tree.ev_id = columns.ev_id[i];
+      tree.is_lost = columns.is_lost[i];
+      tree.tree->Fill();
+    }
+    if (tree.tree->Write() <= 0) {
+      std::cout << "ERROR! Cannot write " << name << " to " << file_name << std::endl;
+      ok = false;
+    }
+  }
+
+  void BeginSamples(const std::vector<std::string>& names, const std::vector<std::string>& titles) override {
+    if (!file) return;
+    streamed.clear();
+    for (size_t k = 0; k < names.size(); k++) {
+      streamed.emplace_back(new TreeSample(file, names[k], titles[k], BasketSize(options.cluster_size), options.cluster_size));
+    }
+  }
+
+  void AppendRows(size_t sample, const std::vector<TrackedProton>& rows) override {
+    if (sample >= streamed.size()) return;
+    TreeSample& tree = *streamed[sample];
+    for (const auto& row : rows) {
+      tree.process_code = row.process_code;
+      tree.px = row.px;
+      tree.py = row.py;
+      tree.pz = row.pz;
+      tree.e = row.e;
+      tree.x = row.x;
+      tree.y = row.y;
+      tree.sx = row.sx;
+      tree.sy = row.sy;
+      tree.ev_id = row.ev_id;
+      tree.is_lost = row.is_lost;
+      tree.tree->Fill();
+    }
+  }
+
+  void EndSamples() override {
+    for (auto& tree : streamed) {
+      file->cd();
+      if (tree->tree->Write() <= 0) {
+        std::cout << "ERROR! Cannot write " << tree->tree->GetName() << " to " << file_name << std::endl;
+        ok = false;
+      }
+    }
+    streamed.clear();
+  }
+
+  void WriteSummary(double cross_section, double efficiency) override {
+    if (file) WriteRootSummary(file, cross_section, efficiency);
+  }
+
+  bool Close() override {
+    if (!file) return ok;
+    ok = CloseRootFile(file, file_name) && ok;
+    file = 0;
+    return ok;
+  }
+
+  uint64_t GetFileSize() const override { return FileSize(file_name); }
+
+private:
+  // every branch gets a basket holding a whole cluster of rows (at least ROOT's default 32000 bytes)
+  int BasketSize(long long rows) const {
+    long long cluster = options.cluster_size > 0 ? std::min(options.cluster_size, rows) : rows;
+    return std::max<long long>(cluster * sizeof(float), 32000);
+  }
+
+  OutputOptions options;
+  std::string file_name;
+  TFile* file;
+  std::vector<std::unique_ptr<TreeSample>> streamed;
+  bool ok;
+};
+
+#ifdef PPSS_HAVE_RNTUPLE
+/**
+RNTuple backend: one RNTuple per sample, in the same ROOT file as the summary histograms.
+*/
+class RNTupleWriterBackend : public OutputWriter {
+public:
+  explicit RNTupleWriterBackend(const OutputOptions& options) : options(options), file(0), ok(true) {}
+
+  ~RNTupleWriterBackend() { Close(); }
+
+  bool Open(const std::string& name) override {
+    file_name = name;
+    file = OpenRootFile(file_name, options);
+    ok = file != 0;
+    return ok;
+  }
+
+  void WriteSample(const std::string& name, const std::string&, const TrackedColumns& columns) override {
+    if (!file) return;
+    using namespace ROOT::Experimental;
+    auto model = RNTupleModel::Create();
+    auto process_code = model->MakeField<int>("process_code");
+    auto px = model->MakeField<float>("px");
+    auto py = model->MakeField<float>("py");
+    auto pz = model->MakeField<float>("pz");
+    auto e = model->MakeField<float>("e");
+    auto x = model->MakeField<float>("x");
+    auto y = model->MakeField<float>("y");
+    auto sx = model->MakeField<float>("sx");
+    auto sy = model->MakeField<float>("sy");
+    auto ev_id = model->MakeField<int>("ev_id");
+    auto is_lost = model->MakeField<bool>("is_lost");
+
+    RNTupleWriteOptions write_options;
+    int settings = RootCompressionSettings(options);
+    if (settings >= 0) write_options.SetCompression(settings);
+    auto writer = RNTupleWriter::Append(std::move(model), name, *file, write_options);
+    for (size_t i = 0; i < columns.Size(); i++) {
+      *process_code = columns.process_code[i];
+      *px = columns.px[i];
+      *py = columns.py[i];
+      *pz = columns.pz[i];
+      *e = columns.e[i];
+      *x = columns.x[i];
+      *y = columns.y[i];
+      *sx = columns.sx[i];
+      *sy = columns.sy[i];
+      *ev_id = columns.ev_id[i];
+      *is_lost = columns.is_lost[i];
+      writer->Fill();
+    }
+  }
+
+  void WriteSummary(double cross_section, double efficiency) override {
+    if (file) WriteRootSummary(file, cross_section, efficiency);
+  }
+
+  bool Close() override {
+    if (!file) return ok;
+    ok = CloseRootFile(file, file_name) && ok;
+    file = 0;
+    return ok;
+  }
+
+  uint64_t GetFileSize() const override { return FileSize(file_name); }
+
+private:
+  OutputOptions options;
+  std::string file_name;
+  TFile* file;
+  bool ok;
+};
+#endif
+
+/**
+Raw columnar backend: every column is written in blocks of cluster_size rows straight
+from the column buffer, compressed block by block.
+*/
+class ColumnarWriter : public OutputWriter {
+public:
+  explicit ColumnarWriter(const OutputOptions& options) : options(options), f(0), ok(true) {
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kColumnarMagic, sizeof(kColumnarMagic));
+    header.version = kColumnarVersion;
+  }
+
+  ~ColumnarWriter() { Close(); }
+
+  bool Open(const std::string& name) override {
+    file_name = name;
+    f = fopen(file_name.c_str(), "wb");
+    if (!f) {
+      std::cout << "ERROR! Cannot create " << file_name << std::endl;
+      ok = false;
+      return false;
+    }
+    // rewritten with the sample count and the summary on Close
+    ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    return ok;
+  }
+
+  void WriteSample(const std::string& name, const std::string&, const TrackedColumns& columns) override {
+    if (!f) return;
+    uint64_t n_rows = columns.Size();
+    uint32_t n_columns = 11;
+    WriteString(name);
+    Put(&n_rows, sizeof(n_rows));
+    Put(&n_columns, sizeof(n_columns));
+    WriteColumn("process_code", kInt32, columns.process_code.data(), sizeof(int), n_rows);
+    WriteColumn("px", kFloat32, columns.px.data(), sizeof(float), n_rows);
+    WriteColumn("py", kFloat32, columns.py.data(), sizeof(float), n_rows);
+    WriteColumn("pz", kFloat32, columns.pz.data(), sizeof(float), n_rows);
+    WriteColumn("e", kFloat32, columns.e.data(), sizeof(float), n_rows);
+    WriteColumn("x", kFloat32, columns.x.data(), sizeof(float), n_rows);
+    WriteColumn("y", kFloat32, columns.y.data(), sizeof(float), n_rows);
+    WriteColumn("sx", kFloat32, columns.sx.data(), sizeof(float), n_rows);
+    WriteColumn("sy", kFloat32, columns.sy.data(), sizeof(float), n_rows);
+    WriteColumn("ev_id", kInt32, columns.ev_id.data(), sizeof(int), n_rows);
+    WriteColumn("is_lost", kUInt8, columns.is_lost.data(), 1, n_rows);
+    header.n_samples++;
+  }
+
+  void WriteSummary(double cross_section, double efficiency) override {
+    header.cross_section = cross_section;
+    header.efficiency = efficiency;
+  }
+
+  bool Close() override {
+    if (!f) return ok;
+    if (ok) ok = fseek(f, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, f) == 1;
+    ok = fclose(f) == 0 && ok;
+    f = 0;
+    if (!ok) std::cout << "ERROR! Writing " << file_name << " failed" << std::endl;
+    return ok;
+  }
+
+  uint64_t GetFileSize() const override { return FileSize(file_name); }
+
+private:
+  void Put(const void* data, size_t n) {
+    if (ok && n > 0) ok = fwrite(data, 1, n, f) == n;
+  }
+
+  void WriteString(const std::string& s) {
+    uint32_t n = s.size();
+    Put(&n, sizeof(n));
+    Put(s.data(), n);
+  }
+
+  void WriteColumn(const char* name, uint8_t type, const void* data, size_t width, uint64_t n_rows) {
+    uint64_t rows_per_block = options.cluster_size > 0 ? options.cluster_size : n_rows;
+    rows_per_block = std::max<uint64_t>(1, std::min<uint64_t>(rows_per_block, kMaxBlockBytes / width));
+    uint32_t n_blocks = (n_rows + rows_per_block - 1) / rows_per_block;
+    WriteString(name);
+    Put(&type, sizeof(type));
+    Put(&n_blocks, sizeof(n_blocks));
+
+    ROOT::RCompressionSetting::EAlgorithm::EValues algorithm;
+    int level;
+    bool compress = CompressionSetting(options.compression, options.compression_level, algorithm, level);
+    const char* bytes = static_cast<const char*>(data);
+    for (uint64_t first = 0; first < n_rows; first += rows_per_block) {
+      uint32_t raw_size = std::min(rows_per_block, n_rows - first) * width;
+      const char* block = bytes + first * width;
+      int stored_size = 0;
+      if (compress) {
+        buffer.resize(raw_size);
+        int src_size = raw_size, tgt_size = raw_size;
+        R__zipMultipleAlgorithm(level, &src_size, const_cast<char*>(block), &tgt_size, buffer.data(), &stored_size, algorithm);
+      }
+      // incompressible blocks (stored_size 0) are kept raw
+      uint8_t compressed = stored_size > 0;
+      uint32_t size = compressed ? stored_size : raw_size;
+      Put(&raw_size, sizeof(raw_size));
+      Put(&size, sizeof(size));
+      Put(&compressed, sizeof(compressed));
+      Put(compressed ? buffer.data() : block, size);
+    }
+  }
+
+  OutputOptions options;
+  std::string file_name;
+  FILE* f;
+  ColumnarHeader header;
+  std::vector<char> buffer;
+  bool ok;
+};
+
+class NullWriter : public OutputWriter {
+public:
+  bool Open(const std::string&) override { return true; }
+  void WriteSample(const std::string&, const std::string&, const TrackedColumns&) override {}
+  void WriteSummary(double, double) override {}
+  bool Close() override { return true; }
+  uint64_t GetFileSize() const override { return 0; }
+};
+
+bool Get(FILE* f, void* data, size_t n) {
+  return n == 0 || fread(data, 1, n, f) == n;
+}
+
+bool GetString(FILE* f, std::string& s) {
+  uint32_t n;
+  if (!Get(f, &n, sizeof(n))) return false;
+  s.resize(n);
+  return Get(f, &s[0], n);
+}
+
+// Read (or skip, for data == 0) one column of n_rows values of the given width.
+bool ReadColumn(FILE* f, size_t width, uint64_t n_rows, void* data) {
+  uint8_t type;
+  uint32_t n_blocks;
+  if (!Get(f, &type, sizeof(type)) || !Get(f, &n_blocks, sizeof(n_blocks))) return false;
+  char* out = static_cast<char*>(data);
+  uint64_t offset = 0;
+  std::vector<unsigned char> stored;
+  for (uint32_t b = 0; b < n_blocks; b++) {
+    uint32_t raw_size, size;
+    uint8_t compressed;
+    if (!Get(f, &raw_size, sizeof(raw_size)) || !Get(f, &size, sizeof(size)) || !Get(f, &compressed, 1)) return false;
+    if (!out) {
+      if (fseek(f, size, SEEK_CUR) != 0) return false;
+      continue;
+    }
+    if (offset + raw_size > n_rows * width) return false;
+    // a stored block is copied as it is, so its size must be the raw size
+    if (!compressed && size != raw_size) return false;
+    if (!compressed) {
+      if (!Get(f, out + offset, size)) return false;
+    } else {
+      stored.resize(size);
+      if (!Get(f, stored.data(), size)) return false;
+      int src_size = size, tgt_size = raw_size, irep = 0;
+      R__unzip(&src_size, stored.data(), &tgt_size, reinterpret_cast<unsigned char*>(out + offset), &irep);
+      if ((uint32_t)irep != raw_size) return false;
+    }
+    offset += raw_size;
+  }
+  return !out || offset == n_rows * width;
+}
+
+} // namespace
+
+const char* OutputFormatName(OutputFormat format) {
+  switch (format) {
+    case OutputFormat::kTTree: return "TTree";
+    case OutputFormat::kRNTuple: return "RNTuple";
+    case OutputFormat::kColumnar: return "columnar";
+    default: return "none";
+  }
+}
+
+const char* OutputCompressionName(OutputCompression compression) {
+  switch (compression) {
+    case OutputCompression::kNone: return "none";
+    case OutputCompression::kLZ4: return "LZ4";
+    case OutputCompression::kZSTD: return "ZSTD";
+    default: return "default";
+  }
+}
+
+void TrackedColumns::Append(const std::vector<TrackedProton>& rows) {
+  for (const auto& row : rows) {
+    process_code.push_back(row.process_code);
+    px.push_back(row.px);
+    py.push_back(row.py);
+    pz.push_back(row.pz);
+    e.push_back(row.e);
+    x.push_back(row.x);
+    y.push_back(row.y);
+    sx.push_back(row.sx);
+    sy.push_back(row.sy);
+    ev_id.push_back(row.ev_id);
+    is_lost.push_back(row.is_lost);
+  }
+}
+
+void TrackedColumns::Clear() {
+  *this = TrackedColumns();
+}
+
+uint64_t TrackedColumns::GetPayloadBytes() const {
+  return Size() * (2 * sizeof(int) + 8 * sizeof(float) + 1);
+}
+
+/**
+\brief Backend for options.format; an RNTuple request without RNTuple support falls back to kTTree.
+*/
+std::unique_ptr<OutputWriter> OutputWriter::Create(const OutputOptions& options) {
+  switch (options.format) {
+    case OutputFormat::kRNTuple:
+#ifdef PPSS_HAVE_RNTUPLE
+      return std::unique_ptr<OutputWriter>(new RNTupleWriterBackend(options));
+#else
+      std::cout << "WARNING! This ROOT has no RNTuple, writing a TTree instead." << std::endl;
+      return std::unique_ptr<OutputWriter>(new TTreeWriter(options));
+#endif
+    case OutputFormat::kColumnar:
+      return std::unique_ptr<OutputWriter>(new ColumnarWriter(options));
+    case OutputFormat::kNone:
+      return std::unique_ptr<OutputWriter>(new NullWriter);
+    default:
+      return std::unique_ptr<OutputWriter>(new TTreeWriter(options));
+  }
+}
+
+void OutputWriter::BeginSamples(const std::vector<std::string>& names, const std::vector<std::string>& titles) {
+  sample_names = names;
+  sample_titles = titles;
+  pending.assign(names.size(), TrackedColumns());
+}
+
+void OutputWriter::AppendRows(size_t sample, const std::vector<TrackedProton>& rows) {
+  if (sample < pending.size()) pending[sample].Append(rows);
+}
+
+void OutputWriter::EndSamples() {
+  for (size_t k = 0; k < pending.size(); k++) {
+    WriteSample(sample_names[k], sample_titles[k], pending[k]);
+    pending[k].Clear();
+  }
+  pending.clear();
+}
+
+std::string OutputWriter::OutputFileName(const std::string& root_file_name, OutputFormat format) {
+  if (format != OutputFormat::kColumnar) return root_file_name;
+  return root_file_name.substr(0, root_file_name.rfind(".root")) + ".columns";
+}
+
+/**
+\brief Read sample name of a columnar file into columns.
+
+\return false if the file is missing, malformed, or has no such sample
+*/
+bool ReadColumnarSample(const std::string& file_name, const std::string& name, TrackedColumns& columns) {
+  FILE* f = fopen(file_name.c_str(), "rb");
+  if (!f) return false;
+  ColumnarHeader header;
+  bool ok = Get(f, &header, sizeof(header)) && memcmp(header.magic, kColumnarMagic, sizeof(kColumnarMagic)) == 0 &&
+            header.version == kColumnarVersion;
+  bool found = false;
+  for (uint32_t s = 0; ok && !found && s < header.n_samples; s++) {
+    std::string sample_name;
+    uint64_t n_rows;
+    uint32_t n_columns;
+    ok = GetString(f, sample_name) && Get(f, &n_rows, sizeof(n_rows)) && Get(f, &n_columns, sizeof(n_columns));
+    found = ok && sample_name == name;
+    if (found) {
+      columns.process_code.resize(n_rows);
+      columns.px.resize(n_rows);
+      columns.py.resize(n_rows);
+      columns.pz.resize(n_rows);
+      columns.e.resize(n_rows);
+      columns.x.resize(n_rows);
+      columns.y.resize(n_rows);
+      columns.sx.resize(n_rows);
+      columns.sy.resize(n_rows);
+      columns.ev_id.resize(n_rows);
+      columns.is_lost.resize(n_rows);
+    }
+    for (uint32_t c = 0; ok && c < n_columns; c++) {
+      std::string column;
+      ok = GetString(f, column);
+      if (!ok) break;
+      void* data = 0;
+      size_t width = 4;
+      if (found) {
+        if (column == "process_code") data = columns.process_code.data();
+        else if (column == "px") data = columns.px.data();
+        else if (column == "py") data = columns.py.data();
+        else if (column == "pz") data = columns.pz.data();
+        else if (column == "e") data = columns.e.data();
+        else if (column == "x") data = columns.x.data();
+        else if (column == "y") data = columns.y.data();
+        else if (column == "sx") data = columns.sx.data();
+        else if (column == "sy") data = columns.sy.data();
+        else if (column == "ev_id") data = columns.ev_id.data();
+        else if (column == "is_lost") {data = columns.is_lost.data(); width = 1;}
+      }
+      ok = ReadColumn(f, width, n_rows, data);
+    }
+  }
+  fclose(f);
+  return ok && found;
+}
+
+bool ReadColumnarSummary(const std::string& file_name, double& cross_section, double& efficiency) {
+  FILE* f = fopen(file_name.c_str(), "rb");
+  if (!f) return false;
+  ColumnarHeader header;
+  bool ok = Get(f, &header, sizeof(header)) && memcmp(header.magic, kColumnarMagic, sizeof(kColumnarMagic)) == 0 &&
+            header.version == kColumnarVersion;
+  fclose(f);
+  if (!ok) return false;
+  cross_section = header.cross_section;
+  efficiency = header.efficiency;
+  return true;
+}
@@ -0,0 +1,120 @@
+#ifndef output_writer_h
+#define output_writer_h
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "proton_state.h"
+
+/**
+\brief Storage of the transported samples written by simple_tracking.
+
+kTTree: the "ntuple" trees as before, with baskets sized to hold one cluster. kRNTuple:
+one RNTuple per sample in the ROOT file (needs ROOT >= 6.28). kColumnar: a raw binary
+file of compressed column blocks, see ReadColumnarSample. kNone writes nothing, for runs
+where only summary statistics are used.
+*/
+enum class OutputFormat {
+  kTTree,
+  kRNTuple,
+  kColumnar,
+  kNone
+};
+
+/**
+\brief Compression of the output; kDefault is ROOT's default setting for ROOT files and none for kColumnar.
+*/
+enum class OutputCompression {
+  kDefault,
+  kNone,
+  kLZ4,
+  kZSTD
+};
+
+struct OutputOptions {
+  OutputFormat format = OutputFormat::kTTree;
+  OutputCompression compression = OutputCompression::kDefault;
+  int compression_level = 0; //!< 0 takes the level recommended for the algorithm (LZ4 4, ZSTD 5)
+  long long cluster_size = 100000; //!< entries per TTree cluster and per RNTuple/columnar block
+};
+
+const char* OutputFormatName(OutputFormat);
+
+const char* OutputCompressionName(OutputCompression);
+
+/**
+\brief Output rows of one sample (observation plane) as columns, in the order they are written.
+*/
+struct TrackedColumns {
+  std::vector<int> process_code;
+  std::vector<float> px, py, pz, e;
+  std::vector<float> x, y, sx, sy;
+  std::vector<int> ev_id;
+  std::vector<unsigned char> is_lost;
+
+  void Append(const std::vector<TrackedProton>&);
+
+  void Clear();
+
+  size_t Size() const { return ev_id.size(); }
+
+  /**
+  \brief Uncompressed size of the columns in bytes.
+  */
+  uint64_t GetPayloadBytes() const;
+};
+
+/**
+\brief Writer of one output file: samples are written whole, from column buffers.
+
+Create picks the backend. Open, then any number of WriteSample, WriteSummary once, and
+Close. Errors are reported on stdout and make Close return false.
+
+Samples may instead be streamed: BeginSamples, AppendRows of each sample in row order,
+EndSamples. By default the rows are buffered and every sample is written whole at
+EndSamples; the TTree backend fills (and compresses) its trees as the rows come in.
+*/
+class OutputWriter {
+public:
+  static std::unique_ptr<OutputWriter> Create(const OutputOptions&);
+
+  virtual ~OutputWriter() {}
+
+  virtual bool Open(const std::string& file_name) = 0;
+
+  virtual void WriteSample(const std::string& name, const std::string& title, const TrackedColumns&) = 0;
+
+  virtual void BeginSamples(const std::vector<std::string>& names, const std::vector<std::string>& titles);
+
+  virtual void AppendRows(size_t sample, const std::vector<TrackedProton>&);
+
+  virtual void EndSamples();
+
+  /**
+  \brief Cross-section [mb] and efficiency of the input, the "sigma" and "efficiency" histograms of the ROOT formats.
+  */
+  virtual void WriteSummary(double cross_section, double efficiency) = 0;
+
+  virtual bool Close() = 0;
+
+  /**
+  \brief Size of the closed file in bytes.
+  */
+  virtual uint64_t GetFileSize() const = 0;
+
+  /**
+  \brief File name with the extension of the format (".root" or ".columns") instead of ".root".
+  */
+  static std::string OutputFileName(const std::string& root_file_name, OutputFormat);
+
+protected:
+  std::vector<std::string> sample_names, sample_titles;
+  std::vector<TrackedColumns> pending; //!< streamed rows not written yet
+};
+
+bool ReadColumnarSample(const std::string& file_name, const std::string& name, TrackedColumns&);
+
+bool ReadColumnarSummary(const std::string& file_name, double& cross_section, double& efficiency);
+
+#endif
@@ -0,0 +1,43 @@
+#include "parallel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+void ParallelFor(size_t n_tasks, unsigned n_threads, const std::function<void(size_t)>& task) {
+  if (n_threads <= 1 || n_tasks <= 1) {
+    for (size_t i = 0; i < n_tasks; i++) task(i);
+    return;
+  }
+
+  std::atomic<size_t> next(0);
+  std::exception_ptr error;
+  std::mutex error_mutex;
+
+  auto worker = [&]() {
+    for (size_t i = next++; i < n_tasks; i = next++) {
+      try {
+        task(i);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!error) error = std::current_exception();
+        next = n_tasks;
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  size_t n_workers = std::min<size_t>(n_threads, n_tasks);
+  for (size_t t = 1; t < n_workers; t++) threads.emplace_back(worker);
+  worker();
+  for (auto& thread : threads) thread.join();
+
+  if (error) std::rethrow_exception(error);
+}
+
+unsigned HardwareThreads() {
+  return std::max(1u, std::thread::hardware_concurrency());
+}
@@ -0,0 +1,76 @@
+#ifndef parallel_h
+#define parallel_h
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+
+/**
+\brief Run task(0) ... task(n_tasks - 1) on up to n_threads threads.
+
+Tasks are handed out in increasing order from a shared counter. With n_threads <= 1
+everything runs on the calling thread. The first exception thrown by a task is
+rethrown after all threads have finished.
+*/
+void ParallelFor(size_t n_tasks, unsigned n_threads, const std::function<void(size_t)>& task);
+
+/**
+\brief Number of hardware threads, at least 1.
+*/
+unsigned HardwareThreads();
+
+/**
+\brief Queue between two pipeline stages holding at most capacity items.
+
+Push blocks while the queue is full, so a fast producer waits for its consumer instead
+of buffering without limit. After Close, Push refuses new items and Pop returns the
+remaining ones, then false.
+*/
+template <class T>
+class BoundedQueue {
+public:
+  explicit BoundedQueue(size_t capacity) : capacity(capacity > 0 ? capacity : 1), closed(false) {}
+
+  /**
+  \return false if the queue was closed, the item is dropped then
+  */
+  bool Push(T item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    not_full.wait(lock, [this] { return closed || items.size() < capacity; });
+    if (closed) return false;
+    items.push_back(std::move(item));
+    not_empty.notify_one();
+    return true;
+  }
+
+  /**
+  \return false once the queue is closed and empty
+  */
+  bool Pop(T& item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    not_empty.wait(lock, [this] { return closed || !items.empty(); });
+    if (items.empty()) return false;
+    item = std::move(items.front());
+    items.pop_front();
+    not_full.notify_one();
+    return true;
+  }
+
+  void Close() {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    not_full.notify_all();
+    not_empty.notify_all();
+  }
+
+private:
+  std::mutex mutex;
+  std::condition_variable not_full, not_empty;
+  std::deque<T> items;
+  size_t capacity;
+  bool closed;
+};
+
+#endif
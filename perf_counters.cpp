@@ -0,0 +1,126 @@
+#include "perf_counters.h"
+
+#if __has_include(<linux/perf_event.h>)
+#define PPSS_HAVE_PERF_EVENT 1
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+#ifdef PPSS_HAVE_PERF_EVENT
+// perf_event_attr type and config of every PerfEvent, in enum order
+struct EventCode {
+  uint32_t type;
+  uint64_t config;
+};
+
+const EventCode kEventCodes[kNumberOfPerfEvents] = {
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+  {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES}
+};
+
+int OpenEvent(const EventCode& code) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = code.type;
+  attr.config = code.config;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  // this thread, any CPU
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+} // namespace
+
+const char* PerfEventName(PerfEvent event) {
+  switch (event) {
+    case PerfEvent::kCycles: return "cycles";
+    case PerfEvent::kInstructions: return "instructions";
+    case PerfEvent::kBranchMisses: return "branch_misses";
+    case PerfEvent::kL1dMisses: return "l1d_misses";
+    case PerfEvent::kLlcMisses: return "llc_misses";
+  }
+  return "";
+}
+
+void PerfTotals::Add(const PerfSample& begin, const PerfSample& end) {
+  for (int e = 0; e < kNumberOfPerfEvents; e++) {
+    if (!begin.valid[e] || !end.valid[e]) continue;
+    uint64_t running = end.running[e] - begin.running[e];
+    uint64_t enabled = end.enabled[e] - begin.enabled[e];
+    double value = end.value[e] - begin.value[e];
+    if (running > 0 && running < enabled) value *= (double)enabled / running;
+    count[e] += value;
+    available[e] = true;
+  }
+}
+
+void PerfTotals::Merge(const PerfTotals& other) {
+  for (int e = 0; e < kNumberOfPerfEvents; e++) {
+    count[e] += other.count[e];
+    available[e] = available[e] || other.available[e];
+  }
+}
+
+double PerfTotals::GetIPC() const {
+  if (!IsAvailable(PerfEvent::kCycles) || !IsAvailable(PerfEvent::kInstructions)) return 0;
+  double cycles = Get(PerfEvent::kCycles);
+  return cycles > 0 ? Get(PerfEvent::kInstructions) / cycles : 0;
+}
+
+PerfCounters::PerfCounters() {
+  for (int e = 0; e < kNumberOfPerfEvents; e++) {
+#ifdef PPSS_HAVE_PERF_EVENT
+    fd[e] = OpenEvent(kEventCodes[e]);
+#else
+    fd[e] = -1;
+#endif
+  }
+}
+
+PerfCounters::~PerfCounters() {
+#ifdef PPSS_HAVE_PERF_EVENT
+  for (int e = 0; e < kNumberOfPerfEvents; e++) if (fd[e] >= 0) close(fd[e]);
+#endif
+}
+
+bool PerfCounters::IsAvailable(PerfEvent event) const {
+  return fd[(int)event] >= 0;
+}
+
+bool PerfCounters::IsAnyAvailable() const {
+  for (int e = 0; e < kNumberOfPerfEvents; e++) if (fd[e] >= 0) return true;
+  return false;
+}
+
+void PerfCounters::Read(PerfSample& sample) const {
+  for (int e = 0; e < kNumberOfPerfEvents; e++) {
+    sample.valid[e] = false;
+#ifdef PPSS_HAVE_PERF_EVENT
+    if (fd[e] < 0) continue;
+    uint64_t buffer[3];
+    if (read(fd[e], buffer, sizeof(buffer)) != (ssize_t)sizeof(buffer)) continue;
+    sample.value[e] = buffer[0];
+    sample.enabled[e] = buffer[1];
+    sample.running[e] = buffer[2];
+    sample.valid[e] = true;
+#endif
+  }
+}
+
+/**
+\brief Counters of the calling thread, opened on its first call and closed when the thread ends.
+*/
+PerfCounters& PerfCounters::ForThisThread() {
+  thread_local PerfCounters counters;
+  return counters;
+}
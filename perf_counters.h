@@ -0,0 +1,81 @@
+#ifndef perf_counters_h
+#define perf_counters_h
+
+#include <cstdint>
+
+/**
+\brief Hardware events counted by PerfCounters.
+*/
+enum class PerfEvent {
+  kCycles,
+  kInstructions,
+  kBranchMisses,
+  kL1dMisses,  //!< L1 data cache read misses
+  kLlcMisses   //!< last level cache misses
+};
+
+const int kNumberOfPerfEvents = 5;
+
+const char* PerfEventName(PerfEvent);
+
+/**
+\brief Raw readings of the counters of one thread at one moment.
+*/
+struct PerfSample {
+  uint64_t value[kNumberOfPerfEvents] = {};
+  uint64_t enabled[kNumberOfPerfEvents] = {}; //!< [ns] the event was enabled
+  uint64_t running[kNumberOfPerfEvents] = {}; //!< [ns] the event was on a hardware counter
+  bool valid[kNumberOfPerfEvents] = {};
+};
+
+/**
+\brief Event counts between pairs of samples, summed.
+
+When the kernel multiplexes the counters, every difference is scaled by its enabled over
+running time. An event counts as available once a difference of it was added.
+*/
+struct PerfTotals {
+  double count[kNumberOfPerfEvents] = {};
+  bool available[kNumberOfPerfEvents] = {};
+
+  void Add(const PerfSample& begin, const PerfSample& end);
+
+  void Merge(const PerfTotals&);
+
+  bool IsAvailable(PerfEvent event) const { return available[(int)event]; }
+
+  double Get(PerfEvent event) const { return count[(int)event]; }
+
+  double GetIPC() const; //!< instructions per cycle, 0 if not available
+};
+
+/**
+\brief Linux perf_event_open counters of the calling thread, user space only.
+
+Every event is opened on its own, so an event the CPU or the kernel does not offer
+(common in virtual machines, or with kernel.perf_event_paranoid > 2) leaves the others
+working. Without perf_event_open at all (other systems, or no linux/perf_event.h at
+compile time) nothing is available and Read returns samples without valid events.
+*/
+class PerfCounters {
+public:
+  PerfCounters();
+
+  ~PerfCounters();
+
+  bool IsAvailable(PerfEvent) const;
+
+  bool IsAnyAvailable() const;
+
+  void Read(PerfSample&) const;
+
+  static PerfCounters& ForThisThread();
+
+private:
+  PerfCounters(const PerfCounters&) = delete;
+  PerfCounters& operator=(const PerfCounters&) = delete;
+
+  int fd[kNumberOfPerfEvents];
+};
+
+#endif
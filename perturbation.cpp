@@ -0,0 +1,27 @@
+#include "perturbation.h"
+
+std::vector<ElementPerturbation> ResolvePerturbations(const std::vector<BeamElement>& beamline, 
+                                                      const std::map<Magnet, Shift>& magnet_to_shift, 
+                                                      const std::map<Magnet, double>& magnet_to_ratio) 
+{
+  std::vector<ElementPerturbation> table(beamline.size());
+  if (magnet_to_shift.empty() && magnet_to_ratio.empty()) return table;
+
+  for (size_t a = 0; a < beamline.size(); a++) {
+    std::string type = MagnetType(beamline[a].kind);
+    if (type.empty()) continue;
+
+    Magnet m(type, beamline[a].magnet_id, 0);
+    auto shift = magnet_to_shift.find(m);
+    if (shift != magnet_to_shift.end()) {
+      table[a].dx = shift->second.GetXShift();
+      table[a].dy = shift->second.GetYShift();
+      table[a].dz = shift->second.GetZShift();
+    }
+    auto ratio = magnet_to_ratio.find(m);
+    if (ratio != magnet_to_ratio.end()) {
+      table[a].strength_ratio = ratio->second;
+    }
+  }
+  return table;
+}
@@ -0,0 +1,35 @@
+#ifndef perturbation_h
+#define perturbation_h
+
+#include <map>
+#include <vector>
+#include "beamline.h"
+#include "magnet.h"
+#include "shift.h"
+
+/**
+\brief Misalignment and strength change of one beam element.
+
+Default values leave the element untouched. T is Dual when derivatives with
+respect to the perturbation are wanted.
+*/
+template <class T>
+struct BasicElementPerturbation {
+  T dx = 0;
+  T dy = 0;
+  T dz = 0;
+  T strength_ratio = 1;
+};
+
+using ElementPerturbation = BasicElementPerturbation<double>;
+
+/**
+\brief Resolve per-magnet shifts and strength ratios into a table indexed like the beamline.
+
+Done once per run, so tracking reads the perturbation of element a as table[a].
+*/
+std::vector<ElementPerturbation> ResolvePerturbations(const std::vector<BeamElement>&, 
+                                                      const std::map<Magnet, Shift>&, 
+                                                      const std::map<Magnet, double>&);
+
+#endif
@@ -12,6 +12,11 @@
 #include <string>
 #include "TSystem.h"
 #include "TSystemDirectory.h"
+#include <vector>
+#include <algorithm>
+#include "bulk_tree_reader.h"
+#include "event_join.h"
+#include "quantile_sketch.h"
 
 using namespace std;
 
@@ -32,121 +37,97 @@ int main() {
   TTree* tree_optics1 = (TTree*)file_optics1->Get("ntuple");
   TTree* tree_optics2 = (TTree*)file_optics2->Get("ntuple");
 
-  tree_optics1->SetMakeClass(1);
-  tree_optics2->SetMakeClass(1);
-
-  Float_t x1, x2, y1, y2, sx1, sx2, sy1, sy2, px, py, pz,px1,px2,ev1,ev2;
-  bool is_lost_1,is_lost_2;
-
-  tree_optics1->SetBranchAddress("ev_id", &ev1);
-  tree_optics2->SetBranchAddress("ev_id", &ev2);
-
-  tree_optics1->SetBranchAddress("is_lost", &is_lost_1);
-  tree_optics2->SetBranchAddress("is_lost", &is_lost_2);
-
-  tree_optics1->SetBranchAddress("x", &x1);
-  tree_optics2->SetBranchAddress("x", &x2);
-
-  tree_optics1->SetBranchAddress("y", &y1);
-  tree_optics2->SetBranchAddress("y", &y2);
-
-  tree_optics1->SetBranchAddress("sx", &sx1);
-  tree_optics2->SetBranchAddress("sx", &sx2);
-
-  tree_optics1->SetBranchAddress("sy", &sy1);
-  tree_optics2->SetBranchAddress("sy", &sy2);
-
-  tree_optics1->SetBranchAddress("px", &px1);
-  tree_optics1->SetBranchAddress("py", &py);
-  tree_optics1->SetBranchAddress("pz", &pz);
-
-  tree_optics2->SetBranchAddress("px", &px2);
-  Long64_t nentries = tree_optics1->GetEntriesFast();
-  Long64_t nentries2 = tree_optics2->GetEntriesFast();
+  // Only the compared branches are read, whole baskets at a time, into plain arrays.
+  std::vector<float> x1, x2, y1, y2, sx1, sx2, sy1, sy2;
+  std::vector<int> ev1, ev2;
+  std::vector<unsigned char> is_lost_1, is_lost_2;
+  BulkTreeReader reader1(tree_optics1), reader2(tree_optics2);
+  reader1.Add("ev_id", &ev1);
+  reader1.Add("x", &x1);
+  reader1.Add("y", &y1);
+  reader1.Add("sx", &sx1);
+  reader1.Add("sy", &sy1);
+  reader1.Add("is_lost", &is_lost_1);
+  reader2.Add("ev_id", &ev2);
+  reader2.Add("x", &x2);
+  reader2.Add("y", &y2);
+  reader2.Add("sx", &sx2);
+  reader2.Add("sy", &sy2);
+  reader2.Add("is_lost", &is_lost_2);
+  reader1.Read();
+  reader2.Read();
   //std::cout<< std::endl << "Number of entries: " << nentries << std::endl<< std::endl;
 
-
-  // Here I calcluate means and StdDev for differences, which are later used to set axis limits for 2D histos, those 4 histograms below are not plotted
-
-  TH1F* x_diff_binset = new TH1F("x_diff_binset", "", 100, 1.1*(tree_optics1->GetMinimum("x")-tree_optics2->GetMaximum("x")), 1.1*(tree_optics1->GetMaximum("x")-tree_optics2->GetMinimum("x")) );
-  TH1F* y_diff_binset = new TH1F("y_diff_binset", "", 100, 1.1*(tree_optics1->GetMinimum("y")-tree_optics2->GetMaximum("y")), 1.1*(tree_optics1->GetMaximum("y")-tree_optics2->GetMinimum("y")) );
-  TH1F* sx_diff_binset = new TH1F("sx_diff_binset", "", 100, 1.1*(tree_optics1->GetMinimum("sx")-tree_optics2->GetMaximum("sx")), 1.1*(tree_optics1->GetMaximum("sx")-tree_optics2->GetMinimum("sx")) );
-  TH1F* sy_diff_binset = new TH1F("sy_diff_binset", "", 100, 1.1*(tree_optics1->GetMinimum("sy")-tree_optics2->GetMaximum("sy")), 1.1*(tree_optics1->GetMaximum("sy")-tree_optics2->GetMinimum("sy")) );
-
-
-  for (Int_t i = 0; i < nentries; i++) {
-    tree_optics1->GetEntry(i);
-    tree_optics2->GetEntry(i);
-    if (is_lost_1||is_lost_2){
-      continue;
-    }
-    else
-    {
-    x_diff_binset->Fill(x1-x2);
-    y_diff_binset->Fill(y1-y2);
-    sx_diff_binset->Fill(sx1-sx2);
-    sy_diff_binset->Fill(sy1-sy2);
-    }
+  // Protons are paired by ev_id, not by entry number. Events missing in one of the files
+  // are only counted; pairs with a lost proton give the x of the lost one(s) and no difference.
+  EventJoin join = JoinByEventId(ev1, ev2);
+  cout << "Events in both files: " << join.Size() << ", only in default: " << join.only1.size()
+       << ", only in shifted: " << join.only2.size() << '\n';
+  std::vector<float> x_lost_values;
+  for (size_t k = 0; k < join.Size(); k++) {
+    if (is_lost_1[join.index1[k]]) x_lost_values.push_back(x1[join.index1[k]]);
+    if (is_lost_2[join.index2[k]]) x_lost_values.push_back(x2[join.index2[k]]);
   }
- double num_of_Stdev= 7;
-
- ///brb
-
-
-
-
-  TH1F* x_diff = new TH1F("x_diff", "x_diff [m]", 100, (x_diff_binset->GetMean()-num_of_Stdev*x_diff_binset->GetStdDev()),(x_diff_binset->GetMean()+num_of_Stdev*x_diff_binset->GetStdDev()) );
-  TH1F* y_diff = new TH1F("y_diff", "y_diff [m]", 100, (y_diff_binset->GetMean()-num_of_Stdev*y_diff_binset->GetStdDev()),(y_diff_binset->GetMean()+num_of_Stdev*y_diff_binset->GetStdDev()) );
-  TH1F* sx_diff = new TH1F("sx_diff", "sx_diff [rad]", 100, (sx_diff_binset->GetMean()-num_of_Stdev*sx_diff_binset->GetStdDev()),(sx_diff_binset->GetMean()+num_of_Stdev*sx_diff_binset->GetStdDev()) );
-  TH1F* sy_diff = new TH1F("sy_diff", "sy_diff[rad]", 100, (sy_diff_binset->GetMean()-num_of_Stdev*sy_diff_binset->GetStdDev()),(sy_diff_binset->GetMean()+num_of_Stdev*sy_diff_binset->GetStdDev()) );
-
-  TH1F* x_lost = new TH1F("x_lost", "lost protons", 100, (x_diff_binset->GetMean()-num_of_Stdev*x_diff_binset->GetStdDev()),(x_diff_binset->GetMean()+num_of_Stdev*x_diff_binset->GetStdDev()) );
-  TH1F* y_lost = new TH1F("y_lost", "lost protons", 100, (y_diff_binset->GetMean()-num_of_Stdev*y_diff_binset->GetStdDev()),(y_diff_binset->GetMean()+num_of_Stdev*y_diff_binset->GetStdDev()) );
-  TH1F* sx_lost = new TH1F("sx_lost", "lost protons", 100, (sx_diff_binset->GetMean()-num_of_Stdev*sx_diff_binset->GetStdDev()),(sx_diff_binset->GetMean()+num_of_Stdev*sx_diff_binset->GetStdDev()) );
-  TH1F* sy_lost = new TH1F("sy_lost", "lost protons", 100, (sy_diff_binset->GetMean()-num_of_Stdev*sy_diff_binset->GetStdDev()),(sy_diff_binset->GetMean()+num_of_Stdev*sy_diff_binset->GetStdDev()) );
-
-
-
-  for (Int_t i = 0; i < nentries; i++) {
-    tree_optics1->GetEntry(i);
-    tree_optics2->GetEntry(i);
-    if (is_lost_1||is_lost_2){
-      if(is_lost_1)x_lost->Fill(x1);
-      if(is_lost_2)x_lost->Fill(x2);
-      continue;
-    }
-    else
-    {
-    x_diff->Fill(x1-x2);
-    y_diff->Fill(y1-y2);
-    sx_diff->Fill(sx1-sx2);
-    sy_diff->Fill(sy1-sy2);
-    }
+  LostPairCounts lost = DropLostPairs(join, is_lost_1, is_lost_2);
+  cout << "Lost in default only: " << lost.lost1 << ", in shifted only: " << lost.lost2 
+       << ", in both: " << lost.lost_both << '\n';
+  size_t n_pairs = join.Size();
+
+
+  // One pass over the joined pairs fills a quantile sketch per difference, whose robust ranges
+  // (0.1 - 99.9 percentile) are then used to book all histograms; a second pass fills them.
+  // The differences are not buffered. Unlike a mean +- 7 sigma window these ranges are not
+  // blown up by a few outliers.
+  QuantileSketch x_sketch, y_sketch, sx_sketch, sy_sketch;
+  auto difference = [&](const std::vector<float>& v1, const std::vector<float>& v2, size_t k) {
+    return v1[join.index1[k]] - v2[join.index2[k]];
+  };
+  for (size_t k = 0; k < n_pairs; k++) {
+    x_sketch.Fill(difference(x1, x2, k));
+    y_sketch.Fill(difference(y1, y2, k));
+    sx_sketch.Fill(difference(sx1, sx2, k));
+    sy_sketch.Fill(difference(sy1, sy2, k));
   }
+  double q_low = 0.001, q_high = 0.999;
+  double x_min, x_max, y_min, y_max, sx_min, sx_max, sy_min, sy_max;
+  x_sketch.GetRange(q_low, q_high, x_min, x_max);
+  y_sketch.GetRange(q_low, q_high, y_min, y_max);
+  sx_sketch.GetRange(q_low, q_high, sx_min, sx_max);
+  sy_sketch.GetRange(q_low, q_high, sy_min, sy_max);
+
+  cout << "median / MAD of x_diff: " << x_sketch.GetMedian() << " / " << x_sketch.GetMAD() << '\n';
+  cout << "median / MAD of y_diff: " << y_sketch.GetMedian() << " / " << y_sketch.GetMAD() << '\n';
+  cout << "median / MAD of sx_diff: " << sx_sketch.GetMedian() << " / " << sx_sketch.GetMAD() << '\n';
+  cout << "median / MAD of sy_diff: " << sy_sketch.GetMedian() << " / " << sy_sketch.GetMAD() << '\n';
 
+ ///brb
 
 
 
 
+  TH1F* x_diff = new TH1F("x_diff", "x_diff [m]", 100, x_min, x_max);
+  TH1F* y_diff = new TH1F("y_diff", "y_diff [m]", 100, y_min, y_max);
+  TH1F* sx_diff = new TH1F("sx_diff", "sx_diff [rad]", 100, sx_min, sx_max);
+  TH1F* sy_diff = new TH1F("sy_diff", "sy_diff[rad]", 100, sy_min, sy_max);
 
-
-
-
- 
+  TH1F* x_lost = new TH1F("x_lost", "lost protons", 100, x_min, x_max);
+  TH1F* y_lost = new TH1F("y_lost", "lost protons", 100, y_min, y_max);
+  TH1F* sx_lost = new TH1F("sx_lost", "lost protons", 100, sx_min, sx_max);
+  TH1F* sy_lost = new TH1F("sy_lost", "lost protons", 100, sy_min, sy_max);
 
 
   // 2D histos for the x, y, sx and sy vs px/py/pz difference between optics1_default(-185murad) and optics2_shifted(-185murad)
   TH2F* x_diff_vs_y_diff = new TH2F("x_diff_vs_y_diff", "x_diff_vs_y_diff;x_diff [m];y_diff [m];nOfEvents",
-   		100,(x_diff_binset->GetMean()-num_of_Stdev*x_diff_binset->GetStdDev()),(x_diff_binset->GetMean()+num_of_Stdev*x_diff_binset->GetStdDev()),
-      100,(y_diff_binset->GetMean()-num_of_Stdev*y_diff_binset->GetStdDev()),(y_diff_binset->GetMean()+num_of_Stdev*y_diff_binset->GetStdDev()));
+   		100, x_min, x_max,
+      100, y_min, y_max);
 
   TH2F* x_diff_vs_sx_diff = new TH2F("x_diff_vs_sx_diff", "x_diff_vs_sx_diff;x_diff [m];sx_diff [rad];nOfEvents",
-      100,(x_diff_binset->GetMean()-num_of_Stdev*x_diff_binset->GetStdDev()),(x_diff_binset->GetMean()+num_of_Stdev*x_diff_binset->GetStdDev()),
-      100,(sx_diff_binset->GetMean()-num_of_Stdev*sx_diff_binset->GetStdDev()),(sx_diff_binset->GetMean()+num_of_Stdev*sx_diff_binset->GetStdDev()));
+      100, x_min, x_max,
+      100, sx_min, sx_max);
 
   TH2F* y_diff_vs_sy_diff = new TH2F("y_diff_vs_sy_diff", "y_diff_vs_sy_diff;y_diff [m];sy_diff [rad];nOfEvents",
-      100,(y_diff_binset->GetMean()-num_of_Stdev*y_diff_binset->GetStdDev()),(y_diff_binset->GetMean()+num_of_Stdev*y_diff_binset->GetStdDev()),
-      100,(sy_diff_binset->GetMean()-num_of_Stdev*sy_diff_binset->GetStdDev()),(sy_diff_binset->GetMean()+num_of_Stdev*sy_diff_binset->GetStdDev()));
+      100, y_min, y_max,
+      100, sy_min, sy_max);
 
 
 
@@ -178,32 +159,20 @@ int main() {
   // TH2F* sy_diff_vs_pz = new TH2F("sy_diff_vs_pz", "sy difference between default and shifted opics vs pz;sy_diff;pz;nOfEvents",
   //  				100,(sy_diff_binset->GetMean()-num_of_Stdev*sy_diff_binset->GetStdDev()),(sy_diff_binset->GetMean()+num_of_Stdev*sy_diff_binset->GetStdDev()), 100, tree_optics1->GetMinimum("pz"), tree_optics1->GetMaximum("pz"));
 
-   for (Int_t i = 0; i < nentries; i++) {
-    tree_optics1->GetEntry(i);
-    tree_optics2->GetEntry(i);
-
-    if (is_lost_1||is_lost_2){
-      continue;
-    }
-    else
-    {
-    x_diff_vs_y_diff->Fill(x1-x2, y1-y2);
-    x_diff_vs_sx_diff->Fill(x1-x2, sx1-sx2);
-    y_diff_vs_sy_diff->Fill(y1-y2, sy1-sy2);
-
-    // y_diff_vs_px->Fill(y1-y2, px);
-    // y_diff_vs_py->Fill(y1-y2, py);
-    // y_diff_vs_pz->Fill(y1-y2, pz);
-
-    // sx_diff_vs_px->Fill(sx1-sx2, px);
-    // sx_diff_vs_py->Fill(sx1-sx2, py);
-    // sx_diff_vs_pz->Fill(sx1-sx2, pz);
+   // the histograms are filled from the columns already read, the trees are not read again
+   for (size_t i = 0; i < x_lost_values.size(); i++) x_lost->Fill(x_lost_values[i]);
 
-    // sy_diff_vs_px->Fill(sy1-sy2, px);
-    // sy_diff_vs_py->Fill(sy1-sy2, py);
-    // sy_diff_vs_pz->Fill(sy1-sy2, pz);
-    }
+   for (size_t k = 0; k < n_pairs; k++) {
+    float dx = difference(x1, x2, k), dy = difference(y1, y2, k);
+    float dsx = difference(sx1, sx2, k), dsy = difference(sy1, sy2, k);
+    x_diff->Fill(dx);
+    y_diff->Fill(dy);
+    sx_diff->Fill(dsx);
+    sy_diff->Fill(dsy);
 
+    x_diff_vs_y_diff->Fill(dx, dy);
+    x_diff_vs_sx_diff->Fill(dx, dsx);
+    y_diff_vs_sy_diff->Fill(dy, dsy);
   }
   delete tree_optics1, tree_optics2, file_optics1, file_optics2;
 
@@ -0,0 +1,34 @@
+#ifndef proton_state_h
+#define proton_state_h
+
+/**
+\brief Phase-space of one proton while it is tracked.
+
+Kept outside of ProtonTransport so that one configured transport can track
+many protons at the same time. T is double for tracking and Dual for
+sensitivity studies.
+*/
+template <class T>
+struct BasicProtonState {
+  T x = 0, y = 0, z = 0;
+  T px = 0, py = 0, pz = 0;
+  T sx = 0, sy = 0;
+  bool is_lost = false;
+  bool beampipes_are_separated = false;
+  int lost_element = -1; //!< beamline index of the element that stopped the proton
+};
+
+using ProtonState = BasicProtonState<double>;
+
+/**
+\brief One entry of the output ntuple, buffered until it is written in ev_id order.
+*/
+struct TrackedProton {
+  int process_code;
+  float px, py, pz, e;
+  float x, y, sx, sy;
+  int ev_id;
+  bool is_lost;
+};
+
+#endif
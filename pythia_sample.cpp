@@ -0,0 +1,380 @@
+#include "pythia_sample.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <TFile.h>
+#include <TH1F.h>
+#include <TROOT.h>
+#include <TTree.h>
+
+namespace {
+
+const char kSidecarMagic[8] = {'P', 'P', 'S', 'S', 'P', 'Y', 'T', 'H'};
+const uint32_t kSidecarVersion = 1;
+
+// Sidecar layout: this header, then process_code, px, py, pz and e as n_events values each.
+struct SidecarHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t n_events;
+  int64_t source_size;
+  int64_t source_mtime;
+  double cross_section;
+  double efficiency;
+};
+
+bool SourceStamp(const std::string& file_name, int64_t& size, int64_t& mtime) {
+  struct stat st;
+  if (stat(file_name.c_str(), &st) != 0) return false;
+  size = st.st_size;
+  mtime = st.st_mtime;
+  return true;
+}
+
+// Bytes of the sidecar of sample.
+uint64_t SidecarSize(const PythiaSample& sample) {
+  return sizeof(SidecarHeader) + sample.Size() * (sizeof(int) + 4 * sizeof(float));
+}
+
+// A sample being loaded stays in the cache without sample until its loader finishes;
+// failed and stopped loads are removed again. The mutex is never held while reading.
+struct CacheEntry {
+  std::shared_ptr<const PythiaSample> sample;
+  bool streaming = false; //!< loaded by StreamPythiaSample, whose consumers may load samples themselves
+};
+
+std::mutex cache_mutex;
+std::condition_variable cache_changed;
+std::map<std::string, CacheEntry> cache;
+
+// Cached sample of file_name, after waiting for a LoadPythiaSample in flight. Otherwise null, and
+// owner tells whether the caller now loads the sample for the cache (false while it is streamed).
+std::shared_ptr<const PythiaSample> FindOrClaim(const std::string& file_name, bool streaming, bool& owner) {
+  std::unique_lock<std::mutex> lock(cache_mutex);
+  cache_changed.wait(lock, [&]() {
+    auto it = cache.find(file_name);
+    return it == cache.end() || it->second.sample || it->second.streaming;
+  });
+  auto it = cache.find(file_name);
+  owner = it == cache.end();
+  if (owner) cache[file_name].streaming = streaming;
+  return it != cache.end() ? it->second.sample : nullptr;
+}
+
+// End the load claimed by FindOrClaim: cache sample, or drop the claim if it is null.
+void Release(const std::string& file_name, const std::shared_ptr<const PythiaSample>& sample) {
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  if (sample) cache[file_name].sample = sample;
+  else cache.erase(file_name);
+  cache_changed.notify_all();
+}
+
+// Decode file_name; null if it cannot be read.
+std::shared_ptr<const PythiaSample> Decode(const std::string& file_name, uint64_t* bytes_read) {
+  auto sample = std::make_shared<PythiaSample>();
+  PythiaSampleReader reader(file_name);
+  if (!reader.IsOpen()) return nullptr;
+  reader.Prepare(*sample);
+  reader.ReadRange(0, sample->Size(), *sample);
+  if (bytes_read) *bytes_read = reader.GetBytesRead();
+  return sample;
+}
+
+} // namespace
+
+/**
+\brief Sample of file_name, loaded once per process and then shared read-only by every caller.
+
+With use_sidecar the columns are taken from file_name + ".cache" if it exists and was made
+from the current file_name (same size and modification time); otherwise the ROOT file is
+read and the sidecar is (re)written for the next process. bytes_read, if given, is set
+to the bytes this call read from disk (0 for a cached sample).
+
+Concurrent calls for one file wait for the first one to load it; calls for other files
+are not held up. While the file is streamed (StreamPythiaSample) a call reads it on its own
+instead of waiting for the stream. A file that cannot be read gives an empty sample, which
+is not cached.
+*/
+std::shared_ptr<const PythiaSample> LoadPythiaSample(const std::string& file_name, bool use_sidecar, uint64_t* bytes_read) {
+  if (bytes_read) *bytes_read = 0;
+  bool owner;
+  std::shared_ptr<const PythiaSample> sample = FindOrClaim(file_name, false, owner);
+  if (sample) return sample;
+
+  std::string sidecar_name = file_name + ".cache";
+  if (use_sidecar) {
+    auto from_sidecar = std::make_shared<PythiaSample>();
+    if (ReadPythiaSampleSidecar(sidecar_name, file_name, *from_sidecar)) {
+      sample = from_sidecar;
+      if (bytes_read) *bytes_read = SidecarSize(*from_sidecar);
+    }
+  }
+  if (!sample) {
+    sample = Decode(file_name, bytes_read);
+    if (sample && use_sidecar && owner && !WritePythiaSampleSidecar(sidecar_name, file_name, *sample)) {
+      std::cout << "WARNING! Cannot write " << sidecar_name << std::endl;
+    }
+  }
+
+  if (owner) Release(file_name, sample);
+  return sample ? sample : std::make_shared<const PythiaSample>();
+}
+
+/**
+\brief LoadPythiaSample that hands the events out in ranges of chunk_size as they are decoded.
+
+on_chunk(sample, first, last) is called for consecutive ranges from the calling thread. The
+columns are sized before the first call, so events [0, last) of sample stay valid and
+unchanged while later ranges are decoded. A sample that is cached or read from the sidecar
+is handed out at once. on_chunk returning false stops the decoding; the partial sample is
+returned but not cached. bytes_read is set as by LoadPythiaSample. No lock is held while
+on_chunk runs, so it may block and load other samples.
+*/
+std::shared_ptr<const PythiaSample> StreamPythiaSample(const std::string& file_name, bool use_sidecar, size_t chunk_size,
+                                                       const std::function<bool(const PythiaSample&, size_t, size_t)>& on_chunk,
+                                                       uint64_t* bytes_read) {
+  if (chunk_size == 0) chunk_size = 1;
+  if (bytes_read) *bytes_read = 0;
+  bool owner;
+  std::shared_ptr<const PythiaSample> sample = FindOrClaim(file_name, true, owner);
+
+  std::string sidecar_name = file_name + ".cache";
+  if (!sample && use_sidecar) {
+    auto from_sidecar = std::make_shared<PythiaSample>();
+    if (ReadPythiaSampleSidecar(sidecar_name, file_name, *from_sidecar)) {
+      sample = from_sidecar;
+      if (owner) Release(file_name, sample);
+      owner = false;
+      if (bytes_read) *bytes_read = SidecarSize(*from_sidecar);
+    }
+  }
+  if (sample) {
+    for (size_t first = 0; first < sample->Size(); first += chunk_size) {
+      if (!on_chunk(*sample, first, std::min(sample->Size(), first + chunk_size))) break;
+    }
+    return sample;
+  }
+
+  auto decoded = std::make_shared<PythiaSample>();
+  PythiaSampleReader reader(file_name);
+  if (!reader.IsOpen()) {
+    if (owner) Release(file_name, nullptr);
+    return decoded;
+  }
+  reader.Prepare(*decoded);
+  size_t nevents = decoded->Size();
+  for (size_t first = 0; first < nevents; first += chunk_size) {
+    size_t last = std::min(nevents, first + chunk_size);
+    reader.ReadRange(first, last, *decoded);
+    if (bytes_read) *bytes_read = reader.GetBytesRead();
+    if (!on_chunk(*decoded, first, last)) {
+      if (owner) Release(file_name, nullptr);
+      return decoded;
+    }
+  }
+  if (use_sidecar && owner && !WritePythiaSampleSidecar(sidecar_name, file_name, *decoded)) {
+    std::cout << "WARNING! Cannot write " << sidecar_name << std::endl;
+  }
+  if (owner) Release(file_name, decoded);
+  return decoded;
+}
+
+/**
+\brief Decode the "ntuple" tree and the "sigma"/"efficiency" histograms of a Pythia ROOT file.
+*/
+std::shared_ptr<const PythiaSample> ReadPythiaSample(const std::string& file_name, uint64_t* bytes_read) {
+  if (bytes_read) *bytes_read = 0;
+  std::shared_ptr<const PythiaSample> sample = Decode(file_name, bytes_read);
+  return sample ? sample : std::make_shared<const PythiaSample>();
+}
+
+PythiaSampleReader::PythiaSampleReader(const std::string& file_name) :
+  file(0), ntuple(0), cross_section(0), efficiency(0), 
+  m_process_code(0), flat(false), f_px(0), f_py(0), f_pz(0), f_e(0), m_px(0), m_py(0), m_pz(0), m_e(0)
+{
+  file = new TFile(file_name.c_str(), "READ");
+  if (file->IsZombie()) {
+    std::cout << "ERROR! Cannot open " << file_name << std::endl;
+    return;
+  }
+  file->GetObject("ntuple",ntuple);
+
+  TH1F * h_sigma;
+  file->GetObject("sigma",h_sigma);
+  TH1F * h_eff;
+  file->GetObject("efficiency",h_eff);
+  if (h_sigma) cross_section = h_sigma->GetBinContent(1);
+  if (h_eff) efficiency = h_eff->GetBinContent(1);
+  if (!ntuple) return;
+
+  TBranch        *b_process_code;   //!
+  TBranch        *b_px;   //!
+  TBranch        *b_py;   //!
+  TBranch        *b_pz;   //!
+  TBranch        *b_e;   //!
+
+  gROOT->ProcessLine("#include <vector>");
+
+  ntuple->SetMakeClass(1);
+
+  ntuple->SetBranchAddress("process_code", &m_process_code, &b_process_code);
+  TBranch* px_branch = ntuple->GetBranch("px");
+  flat = px_branch && !*px_branch->GetClassName();
+  if (flat) {
+    ntuple->SetBranchAddress("px", &f_px, &b_px);
+    ntuple->SetBranchAddress("py", &f_py, &b_py);
+    ntuple->SetBranchAddress("pz", &f_pz, &b_pz);
+    ntuple->SetBranchAddress("e", &f_e, &b_e);
+    return;
+  }
+  ntuple->SetBranchAddress("px", &m_px, &b_px);
+  ntuple->SetBranchAddress("py", &m_py, &b_py);
+  ntuple->SetBranchAddress("pz", &m_pz, &b_pz);
+  ntuple->SetBranchAddress("e", &m_e, &b_e);
+}
+
+PythiaSampleReader::~PythiaSampleReader() {
+  file->Close();
+  delete file;
+}
+
+/**
+\brief Whether the file was opened and holds an "ntuple" tree.
+*/
+bool PythiaSampleReader::IsOpen() const {
+  return ntuple != 0;
+}
+
+size_t PythiaSampleReader::GetEntries() const {
+  return ntuple ? ntuple->GetEntries() : 0;
+}
+
+/**
+\brief Bytes read from the file so far, compressed as stored.
+*/
+uint64_t PythiaSampleReader::GetBytesRead() const {
+  return file->GetBytesRead();
+}
+
+/**
+\brief Set the cross-section and efficiency of sample and size its columns for GetEntries() events.
+*/
+void PythiaSampleReader::Prepare(PythiaSample& sample) const {
+  size_t nevents = GetEntries();
+  sample.cross_section = cross_section;
+  sample.efficiency = efficiency;
+  sample.process_code.resize(nevents);
+  sample.px.resize(nevents);
+  sample.py.resize(nevents);
+  sample.pz.resize(nevents);
+  sample.e.resize(nevents);
+}
+
+/**
+\brief Decode the first proton of events [first, last) into the prepared columns of sample.
+*/
+void PythiaSampleReader::ReadRange(size_t first, size_t last, PythiaSample& sample) {
+  for (size_t evt=first; evt<last; evt++)
+  {
+    ntuple->GetEntry(evt);
+    sample.process_code[evt] = m_process_code;
+    if (flat) {
+      sample.px[evt] = f_px;
+      sample.py[evt] = f_py;
+      sample.pz[evt] = f_pz;
+      sample.e[evt] = f_e;
+      continue;
+    }
+    sample.px[evt] = m_px->at(0);
+    sample.py[evt] = m_py->at(0);
+    sample.pz[evt] = m_pz->at(0);
+    sample.e[evt] = m_e->at(0);
+  }
+}
+
+/**
+\brief Load sample from sidecar_name with a single read.
+
+\return false if the sidecar is missing, malformed, of another version or older than source_name
+*/
+bool ReadPythiaSampleSidecar(const std::string& sidecar_name, const std::string& source_name, PythiaSample& sample) {
+  int64_t source_size, source_mtime;
+  if (!SourceStamp(source_name, source_size, source_mtime)) return false;
+
+  FILE* f = fopen(sidecar_name.c_str(), "rb");
+  if (!f) return false;
+  std::vector<char> buffer;
+  if (fseek(f, 0, SEEK_END) == 0) {
+    long size = ftell(f);
+    if (size > 0) {
+      buffer.resize(size);
+      rewind(f);
+      if (fread(buffer.data(), 1, size, f) != (size_t)size) buffer.clear();
+    }
+  }
+  fclose(f);
+
+  SidecarHeader header;
+  if (buffer.size() < sizeof(header)) return false;
+  memcpy(&header, buffer.data(), sizeof(header));
+  if (memcmp(header.magic, kSidecarMagic, sizeof(kSidecarMagic)) != 0 || header.version != kSidecarVersion) return false;
+  if (header.source_size != source_size || header.source_mtime != source_mtime) return false;
+  uint64_t n = header.n_events;
+  if (buffer.size() != sizeof(header) + n * (sizeof(int) + 4 * sizeof(float))) return false;
+
+  const char* p = buffer.data() + sizeof(header);
+  auto column = [&](auto& v) {
+    v.resize(n);
+    memcpy(v.data(), p, n * sizeof(v[0]));
+    p += n * sizeof(v[0]);
+  };
+  column(sample.process_code);
+  column(sample.px);
+  column(sample.py);
+  column(sample.pz);
+  column(sample.e);
+  sample.cross_section = header.cross_section;
+  sample.efficiency = header.efficiency;
+  return true;
+}
+
+/**
+\brief Write sample to sidecar_name, stamped with the size and modification time of source_name.
+
+The file is written under a temporary name of this process and renamed, so concurrent
+writers do not mix their data and readers never see a partial sidecar.
+*/
+bool WritePythiaSampleSidecar(const std::string& sidecar_name, const std::string& source_name, const PythiaSample& sample) {
+  SidecarHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kSidecarMagic, sizeof(kSidecarMagic));
+  header.version = kSidecarVersion;
+  header.n_events = sample.Size();
+  if (!SourceStamp(source_name, header.source_size, header.source_mtime)) return false;
+  header.cross_section = sample.cross_section;
+  header.efficiency = sample.efficiency;
+
+  std::string tmp_name = sidecar_name + ".tmp" + std::to_string(getpid());
+  FILE* f = fopen(tmp_name.c_str(), "wb");
+  if (!f) return false;
+  size_t n = sample.Size();
+  bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+            fwrite(sample.process_code.data(), sizeof(int), n, f) == n &&
+            fwrite(sample.px.data(), sizeof(float), n, f) == n &&
+            fwrite(sample.py.data(), sizeof(float), n, f) == n &&
+            fwrite(sample.pz.data(), sizeof(float), n, f) == n &&
+            fwrite(sample.e.data(), sizeof(float), n, f) == n;
+  ok = fclose(f) == 0 && ok;
+  if (ok) ok = rename(tmp_name.c_str(), sidecar_name.c_str()) == 0;
+  if (!ok) remove(tmp_name.c_str());
+  return ok;
+}
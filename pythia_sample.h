@@ -0,0 +1,81 @@
+#ifndef pythia_sample_h
+#define pythia_sample_h
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+\brief First-proton kinematics of every event of a Pythia sample, in flat columns.
+
+Together with the contents of the sample's "sigma" and "efficiency" histograms this
+is everything simple_tracking needs from the input file.
+*/
+struct PythiaSample {
+  std::vector<int> process_code;
+  std::vector<float> px, py, pz, e;
+  double cross_section = 0; //!< [mb]
+  double efficiency = 0;
+
+  size_t Size() const { return px.size(); }
+};
+
+std::shared_ptr<const PythiaSample> LoadPythiaSample(const std::string&, bool use_sidecar = false, 
+                                                     uint64_t* bytes_read = 0);
+
+std::shared_ptr<const PythiaSample> StreamPythiaSample(const std::string&, bool use_sidecar, size_t chunk_size, 
+                                                       const std::function<bool(const PythiaSample&, size_t, size_t)>&,
+                                                       uint64_t* bytes_read = 0);
+
+std::shared_ptr<const PythiaSample> ReadPythiaSample(const std::string&, uint64_t* bytes_read = 0);
+
+bool ReadPythiaSampleSidecar(const std::string&, const std::string&, PythiaSample&);
+
+bool WritePythiaSampleSidecar(const std::string&, const std::string&, const PythiaSample&);
+
+class TFile;
+class TTree;
+
+/**
+\brief Decoder of the events of a Pythia ROOT file range by range, for tracking them while the rest is read.
+
+Besides Pythia files, whose px, py, pz and e are vectors over the particles of the event,
+the output of simple_tracking (one proton per entry, flat branches) is accepted, so a
+transported sample can be tracked again.
+*/
+class PythiaSampleReader {
+public:
+  explicit PythiaSampleReader(const std::string&);
+
+  ~PythiaSampleReader();
+
+  bool IsOpen() const;
+
+  size_t GetEntries() const;
+
+  uint64_t GetBytesRead() const;
+
+  void Prepare(PythiaSample&) const;
+
+  void ReadRange(size_t first, size_t last, PythiaSample&);
+
+private:
+  PythiaSampleReader(const PythiaSampleReader&) = delete;
+  PythiaSampleReader& operator=(const PythiaSampleReader&) = delete;
+
+  TFile* file;
+  TTree* ntuple;
+  double cross_section;
+  double efficiency;
+  int m_process_code;
+  bool flat; //!< one proton per entry, px, py, pz, e are Float_t branches
+  float f_px, f_py, f_pz, f_e;
+  std::vector<float> *m_px;
+  std::vector<float> *m_py;
+  std::vector<float> *m_pz;
+  std::vector<float> *m_e;
+};
+
+#endif
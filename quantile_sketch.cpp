@@ -0,0 +1,148 @@
+#include "quantile_sketch.h"
+
+#include <algorithm>
+#include <math.h>
+
+QuantileSketch::QuantileSketch(int k_, uint64_t seed)
+  : k(std::max(8, k_)), n(0), min(0), max(0), levels(1), coin(seed, 0), sorted_valid(false)
+{
+}
+
+/**
+\brief Capacity of compactor level h; the top level holds k items, lower ones shrink by 2/3 per level.
+*/
+size_t QuantileSketch::Capacity(size_t h) const {
+  size_t depth = levels.size() - 1 - h;
+  return std::max<size_t>(2, (size_t)ceil(k * pow(2. / 3., depth)));
+}
+
+void QuantileSketch::Fill(double value) {
+  if (n == 0 || value < min) min = value;
+  if (n == 0 || value > max) max = value;
+  ++n;
+  sorted_valid = false;
+  levels[0].push_back(value);
+  if (levels[0].size() >= Capacity(0)) Compress();
+}
+
+/**
+\brief Compact every level that is over capacity: sort it and promote every other item.
+*/
+void QuantileSketch::Compress() {
+  for (size_t h = 0; h < levels.size(); h++) {
+    if (levels[h].size() < Capacity(h)) continue;
+    if (h + 1 == levels.size()) levels.emplace_back();
+    std::vector<double>& level = levels[h];
+    std::sort(level.begin(), level.end());
+    // an odd item out, the smallest or the largest at random, stays at this level
+    size_t first = 0, last = level.size();
+    bool keep_one = level.size() % 2 == 1;
+    bool keep_smallest = keep_one && coin.Uniform() < 0.5;
+    if (keep_one) {
+      if (keep_smallest) first++;
+      else last--;
+    }
+    size_t offset = coin.Uniform() < 0.5 ? 0 : 1;
+    for (size_t i = first + offset; i < last; i += 2) levels[h + 1].push_back(level[i]);
+    double kept = keep_smallest ? level.front() : level.back();
+    level.clear();
+    if (keep_one) level.push_back(kept);
+  }
+}
+
+void QuantileSketch::Merge(const QuantileSketch& other) {
+  if (other.n == 0) return;
+  if (n == 0 || other.min < min) min = other.min;
+  if (n == 0 || other.max > max) max = other.max;
+  n += other.n;
+  sorted_valid = false;
+  while (levels.size() < other.levels.size()) levels.emplace_back();
+  for (size_t h = 0; h < other.levels.size(); h++) {
+    levels[h].insert(levels[h].end(), other.levels[h].begin(), other.levels[h].end());
+  }
+  Compress();
+}
+
+long long QuantileSketch::GetN() const {
+  return n;
+}
+
+double QuantileSketch::GetMin() const {
+  return min;
+}
+
+double QuantileSketch::GetMax() const {
+  return max;
+}
+
+void QuantileSketch::Sort() const {
+  if (sorted_valid) return;
+  sorted.clear();
+  for (size_t h = 0; h < levels.size(); h++) {
+    for (double v : levels[h]) sorted.push_back(WeightedValue{v, uint64_t(1) << h});
+  }
+  std::sort(sorted.begin(), sorted.end(), 
+            [](const WeightedValue& a, const WeightedValue& b) { return a.value < b.value; });
+  cumulative.resize(sorted.size());
+  uint64_t total = 0;
+  for (size_t i = 0; i < sorted.size(); i++) cumulative[i] = total += sorted[i].weight;
+  sorted_valid = true;
+}
+
+/**
+\brief Approximate q-quantile, q in [0, 1]; 0 and 1 give the exact minimum and maximum.
+*/
+double QuantileSketch::GetQuantile(double q) const {
+  if (n == 0) return 0;
+  if (q <= 0) return min;
+  if (q >= 1) return max;
+  Sort();
+  double target = q * cumulative.back();
+  auto it = std::lower_bound(cumulative.begin(), cumulative.end(), target, 
+                             [](uint64_t c, double t) { return c < t; });
+  return it != cumulative.end() ? sorted[it - cumulative.begin()].value : max;
+}
+
+double QuantileSketch::GetMedian() const {
+  return GetQuantile(0.5);
+}
+
+/**
+\brief Approximate median absolute deviation from the median (unscaled).
+
+The deviations are walked in increasing order outwards from the median through the
+sorted values, without sorting them again.
+*/
+double QuantileSketch::GetMAD() const {
+  if (n == 0) return 0;
+  double median = GetMedian();
+  uint64_t total = cumulative.back();
+  size_t right = std::lower_bound(sorted.begin(), sorted.end(), median, 
+                                  [](const WeightedValue& a, double m) { return a.value < m; }) - sorted.begin();
+  size_t left = right;
+  uint64_t sum = 0;
+  double deviation = 0;
+  while (left > 0 || right < sorted.size()) {
+    bool take_right = left == 0 || (right < sorted.size() && 
+                                    sorted[right].value - median <= median - sorted[left - 1].value);
+    const WeightedValue& v = take_right ? sorted[right++] : sorted[--left];
+    deviation = fabs(v.value - median);
+    sum += v.weight;
+    if (2 * sum >= total) break;
+  }
+  return deviation;
+}
+
+/**
+\brief Axis range [GetQuantile(q_low), GetQuantile(q_high)], widened by 5% on each side.
+
+A degenerate range (all values equal) is opened to +-1e-9 around the value.
+*/
+void QuantileSketch::GetRange(double q_low, double q_high, double& low, double& high) const {
+  low = GetQuantile(q_low);
+  high = GetQuantile(q_high);
+  double margin = 0.05 * (high - low);
+  if (margin <= 0) margin = std::max(1.e-9, 1.e-6 * fabs(low));
+  low -= margin;
+  high += margin;
+}
@@ -0,0 +1,52 @@
+#include "run_random.h"
+
+#include <math.h>
+
+namespace {
+
+const uint64_t kGolden = 0x9E3779B97F4A7C15ULL;
+
+// SplitMix64 finalizer
+uint64_t Mix(uint64_t z) {
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+} // namespace
+
+RunRandom::RunRandom(uint64_t seed, uint64_t run_id)
+  : key(Mix(Mix(seed) ^ Mix(run_id + kGolden))),
+    counter(0)
+{
+}
+
+/**
+\brief n-th 64-bit word of the stream: SplitMix64 evaluated at position n of the run key.
+*/
+uint64_t RunRandom::Bits(uint64_t n) const {
+  return Mix(key + (n + 1) * kGolden);
+}
+
+/**
+\brief Uniform number in the open interval (0, 1).
+*/
+double RunRandom::Uniform() {
+  return ((Bits(counter++) >> 11) + 0.5) * (1.0 / 9007199254740992.0);
+}
+
+/**
+\brief Gaussian number (Box-Muller); every call consumes exactly two words of the stream.
+*/
+double RunRandom::Gaus(double mean, double sigma) {
+  double u1 = Uniform();
+  double u2 = Uniform();
+  return mean + sigma * sqrt(-2. * log(u1)) * cos(2. * M_PI * u2);
+}
+
+/**
+\brief Number of words drawn so far.
+*/
+uint64_t RunRandom::GetCounter() const {
+  return counter;
+}
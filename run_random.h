@@ -0,0 +1,29 @@
+#ifndef run_random_h
+#define run_random_h
+
+#include <cstdint>
+
+/**
+\brief Counter-based random stream of one scan run.
+
+The n-th number drawn in run run_id is a pure function of (seed, run_id, n), so
+runs can be executed in any order, on any worker, and always see the same numbers.
+*/
+class RunRandom {
+public:
+  RunRandom(uint64_t seed, uint64_t run_id);
+
+  double Uniform();
+
+  double Gaus(double mean, double sigma);
+
+  uint64_t GetCounter() const;
+
+private:
+  uint64_t Bits(uint64_t n) const;
+
+  uint64_t key;
+  uint64_t counter;
+};
+
+#endif
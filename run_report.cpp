@@ -0,0 +1,297 @@
+#include "run_report.h"
+
+#include <fstream>
+#include <iomanip>
+#include <math.h>
+#include <time.h>
+
+namespace {
+
+const Stage kStages[kNumberOfStages] = {Stage::kPrepareBeamline, Stage::kReadInput, Stage::kTracking, Stage::kCompare,
+                                        Stage::kWriteOutput, Stage::kCloseOutput, Stage::kRun, Stage::kScan};
+
+const ElementKind kElementKinds[kNumberOfElementKinds] = {ElementKind::kMarker, ElementKind::kDrift,
+                                                          ElementKind::kRectangularDipole, ElementKind::kHorizontalKicker,
+                                                          ElementKind::kVerticalKicker, ElementKind::kQuadrupole,
+                                                          ElementKind::kCollimator};
+
+// Whether the element-by-element kernel of el tests the aperture: magnets with an
+// aperture (a quadrupole without strength is a plain drift) and the collimators.
+bool ChecksAperture(const BeamElement& el) {
+  switch (el.kind) {
+    case ElementKind::kCollimator:
+      return true;
+    case ElementKind::kQuadrupole:
+      return el.aperture.IsChecked() && fabs(el.strength) >= 1.e-15;
+    case ElementKind::kRectangularDipole:
+    case ElementKind::kHorizontalKicker:
+    case ElementKind::kVerticalKicker:
+      return el.aperture.IsChecked();
+    default:
+      return false;
+  }
+}
+
+double Seconds(const std::atomic<uint64_t>& ns) {
+  return ns.load(std::memory_order_relaxed) * 1.e-9;
+}
+
+} // namespace
+
+const char* StageName(Stage stage) {
+  switch (stage) {
+    case Stage::kPrepareBeamline: return "prepare_beamline";
+    case Stage::kReadInput: return "read_input";
+    case Stage::kTracking: return "tracking";
+    case Stage::kCompare: return "compare";
+    case Stage::kWriteOutput: return "write_output";
+    case Stage::kCloseOutput: return "close_output";
+    case Stage::kRun: return "run";
+    case Stage::kScan: return "scan";
+  }
+  return "";
+}
+
+/**
+\brief CPU time consumed so far by the calling thread [ns].
+*/
+uint64_t ThreadCpuNanoseconds() {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) return 0;
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+RunReport::RunReport() : loss_checks(0), bytes_read(0), bytes_written(0), protons(0), use_perf_counters(false) {
+  for (int s = 0; s < kNumberOfStages; s++) {
+    calls[s] = 0;
+    wall_ns[s] = 0;
+    cpu_ns[s] = 0;
+  }
+  for (int k = 0; k < kNumberOfElementKinds; k++) {
+    applications[k] = 0;
+    lost[k] = 0;
+  }
+}
+
+void RunReport::AddStage(Stage stage, uint64_t wall, uint64_t cpu) {
+  int s = (int)stage;
+  calls[s].fetch_add(1, std::memory_order_relaxed);
+  wall_ns[s].fetch_add(wall, std::memory_order_relaxed);
+  cpu_ns[s].fetch_add(cpu, std::memory_order_relaxed);
+}
+
+void RunReport::AddStagePerf(Stage stage, const PerfSample& begin, const PerfSample& end) {
+  std::lock_guard<std::mutex> lock(perf_mutex);
+  perf[(int)stage].Add(begin, end);
+}
+
+/**
+\brief Read the hardware counters around every timed stage (profiling mode).
+
+Costs a few system calls per timed interval. Counters that cannot be opened are
+reported as unavailable.
+*/
+void RunReport::SetUsePerfCounters(bool use) {
+  use_perf_counters = use;
+}
+
+bool RunReport::UsesPerfCounters() const {
+  return kInstrumentation && use_perf_counters.load(std::memory_order_relaxed);
+}
+
+void RunReport::AddBytesRead(uint64_t n) {
+  bytes_read.fetch_add(n, std::memory_order_relaxed);
+}
+
+void RunReport::AddBytesWritten(uint64_t n) {
+  bytes_written.fetch_add(n, std::memory_order_relaxed);
+}
+
+/**
+\brief Count the element applications and aperture checks of n_tracked protons and the losses among them.
+
+The counts are those of element-by-element tracking, whatever mode tracked the protons:
+a proton lost at element a went through elements 0..a; the others stopped after the
+element that took them past last_obs_point, which is the same element for all of them.
+This needs one pass over the beamline and one over the lost protons per call, instead
+of a counter in the per-element loop.
+*/
+void RunReport::AddElementCounts(const std::vector<BeamElement>& elements, double last_obs_point,
+                                 uint64_t n_tracked, const LossRecords& lost_protons) {
+  if (!kInstrumentation || elements.empty()) return;
+
+  // prefix[a][k]: elements of kind k among 0..a-1; prefix_checks[a] likewise for aperture checks
+  size_t n = elements.size();
+  std::vector<std::vector<uint64_t>> prefix(n + 1, std::vector<uint64_t>(kNumberOfElementKinds, 0));
+  std::vector<uint64_t> prefix_checks(n + 1, 0);
+  size_t last = n - 1;
+  double z = 0;
+  bool past = false;
+  for (size_t a = 0; a < n; a++) {
+    prefix[a + 1] = prefix[a];
+    prefix[a + 1][(int)elements[a].kind]++;
+    prefix_checks[a + 1] = prefix_checks[a] + ChecksAperture(elements[a]);
+    z += elements[a].length;
+    if (!past && z > last_obs_point) {
+      last = a;
+      past = true;
+    }
+  }
+
+  std::vector<uint64_t> kind_counts(kNumberOfElementKinds, 0), lost_counts(kNumberOfElementKinds, 0);
+  uint64_t n_survived = n_tracked >= lost_protons.Size() ? n_tracked - lost_protons.Size() : 0;
+  uint64_t checks = n_survived * prefix_checks[last + 1];
+  for (int k = 0; k < kNumberOfElementKinds; k++) kind_counts[k] = n_survived * prefix[last + 1][k];
+  for (size_t i = 0; i < lost_protons.Size(); i++) {
+    size_t a = lost_protons.element[i];
+    if (a >= n) continue;
+    for (int k = 0; k < kNumberOfElementKinds; k++) kind_counts[k] += prefix[a + 1][k];
+    checks += prefix_checks[a + 1];
+    lost_counts[(int)elements[a].kind]++;
+  }
+
+  for (int k = 0; k < kNumberOfElementKinds; k++) {
+    applications[k].fetch_add(kind_counts[k], std::memory_order_relaxed);
+    lost[k].fetch_add(lost_counts[k], std::memory_order_relaxed);
+  }
+  loss_checks.fetch_add(checks, std::memory_order_relaxed);
+  protons.fetch_add(n_tracked, std::memory_order_relaxed);
+}
+
+/**
+\brief Add the times and counts of another report, e.g. of one run to that of its scan.
+*/
+void RunReport::Merge(const RunReport& other) {
+  for (int s = 0; s < kNumberOfStages; s++) {
+    calls[s].fetch_add(other.calls[s].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    wall_ns[s].fetch_add(other.wall_ns[s].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    cpu_ns[s].fetch_add(other.cpu_ns[s].load(std::memory_order_relaxed), std::memory_order_relaxed);
+  }
+  for (int k = 0; k < kNumberOfElementKinds; k++) {
+    applications[k].fetch_add(other.applications[k].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    lost[k].fetch_add(other.lost[k].load(std::memory_order_relaxed), std::memory_order_relaxed);
+  }
+  loss_checks.fetch_add(other.loss_checks.load(std::memory_order_relaxed), std::memory_order_relaxed);
+  bytes_read.fetch_add(other.bytes_read.load(std::memory_order_relaxed), std::memory_order_relaxed);
+  bytes_written.fetch_add(other.bytes_written.load(std::memory_order_relaxed), std::memory_order_relaxed);
+  protons.fetch_add(other.protons.load(std::memory_order_relaxed), std::memory_order_relaxed);
+  if (other.UsesPerfCounters()) use_perf_counters = true;
+  for (int s = 0; s < kNumberOfStages; s++) {
+    PerfTotals totals = other.GetPerf(kStages[s]);
+    std::lock_guard<std::mutex> lock(perf_mutex);
+    perf[s].Merge(totals);
+  }
+}
+
+uint64_t RunReport::GetCalls(Stage stage) const {
+  return calls[(int)stage].load(std::memory_order_relaxed);
+}
+
+double RunReport::GetWallTime(Stage stage) const {
+  return Seconds(wall_ns[(int)stage]);
+}
+
+double RunReport::GetCpuTime(Stage stage) const {
+  return Seconds(cpu_ns[(int)stage]);
+}
+
+uint64_t RunReport::GetElementApplications(ElementKind kind) const {
+  return applications[(int)kind].load(std::memory_order_relaxed);
+}
+
+uint64_t RunReport::GetLost(ElementKind kind) const {
+  return lost[(int)kind].load(std::memory_order_relaxed);
+}
+
+uint64_t RunReport::GetLossChecks() const {
+  return loss_checks.load(std::memory_order_relaxed);
+}
+
+uint64_t RunReport::GetBytesRead() const {
+  return bytes_read.load(std::memory_order_relaxed);
+}
+
+uint64_t RunReport::GetBytesWritten() const {
+  return bytes_written.load(std::memory_order_relaxed);
+}
+
+uint64_t RunReport::GetProtons() const {
+  return protons.load(std::memory_order_relaxed);
+}
+
+PerfTotals RunReport::GetPerf(Stage stage) const {
+  std::lock_guard<std::mutex> lock(perf_mutex);
+  return perf[(int)stage];
+}
+
+namespace {
+
+// Counts of one stage, with IPC and counts per proton; null for events not available.
+void WritePerfJson(std::ostream& f, const PerfTotals& totals, uint64_t n_protons) {
+  f << ", \"perf\": {";
+  for (int e = 0; e < kNumberOfPerfEvents; e++) {
+    f << (e ? ", " : "") << "\"" << PerfEventName((PerfEvent)e) << "\": ";
+    if (totals.available[e]) f << totals.count[e];
+    else f << "null";
+  }
+  f << ", \"ipc\": ";
+  if (totals.GetIPC() > 0) f << totals.GetIPC();
+  else f << "null";
+  if (n_protons > 0) {
+    f << ", \"per_proton\": {";
+    for (int e = 0; e < kNumberOfPerfEvents; e++) {
+      f << (e ? ", " : "") << "\"" << PerfEventName((PerfEvent)e) << "\": ";
+      if (totals.available[e]) f << totals.count[e] / n_protons;
+      else f << "null";
+    }
+    f << "}";
+  }
+  f << "}";
+}
+
+} // namespace
+
+/**
+\brief Write report as JSON: label, then calls, wall and CPU seconds per stage that ran,
+then the counters, per element kind where they apply.
+
+In profiling mode every stage also gets its hardware event counts, IPC and counts per
+tracked proton, and "perf_counters" tells whether any counter could be read
+("available", "unavailable"); otherwise it is "off".
+*/
+bool WriteRunReportJson(const std::string& file_name, const RunReport& report, const std::string& label) {
+  std::ofstream f(file_name, std::fstream::trunc);
+  if (!f) return false;
+  f << std::setprecision(9);
+
+  bool perf_available = false;
+  for (Stage stage : kStages) {
+    PerfTotals totals = report.GetPerf(stage);
+    for (int e = 0; e < kNumberOfPerfEvents; e++) perf_available = perf_available || totals.available[e];
+  }
+  const char* perf_state = !report.UsesPerfCounters() ? "off" : (perf_available ? "available" : "unavailable");
+
+  f << "{\n  \"report\": \"" << label << "\",\n  \"perf_counters\": \"" << perf_state << "\",\n  \"stages\": {";
+  bool first = true;
+  for (Stage stage : kStages) {
+    if (report.GetCalls(stage) == 0) continue;
+    f << (first ? "\n" : ",\n") << "    \"" << StageName(stage) << "\": {\"calls\": " << report.GetCalls(stage)
+      << ", \"wall_s\": " << report.GetWallTime(stage) << ", \"cpu_s\": " << report.GetCpuTime(stage);
+    if (perf_available) WritePerfJson(f, report.GetPerf(stage), report.GetProtons());
+    f << "}";
+    first = false;
+  }
+  f << "\n  },\n  \"protons\": " << report.GetProtons() << ",\n  \"element_applications\": {";
+  for (int k = 0; k < kNumberOfElementKinds; k++) {
+    f << (k ? ", " : "") << "\"" << ElementKindName(kElementKinds[k]) << "\": " << report.GetElementApplications(kElementKinds[k]);
+  }
+  f << "},\n  \"lost\": {";
+  for (int k = 0; k < kNumberOfElementKinds; k++) {
+    f << (k ? ", " : "") << "\"" << ElementKindName(kElementKinds[k]) << "\": " << report.GetLost(kElementKinds[k]);
+  }
+  f << "},\n  \"loss_checks\": " << report.GetLossChecks()
+    << ",\n  \"bytes_read\": " << report.GetBytesRead()
+    << ",\n  \"bytes_written\": " << report.GetBytesWritten() << "\n}\n";
+  f.close();
+  return bool(f);
+}
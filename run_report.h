@@ -0,0 +1,170 @@
+#ifndef run_report_h
+#define run_report_h
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "beamline.h"
+#include "loss_map.h"
+#include "perf_counters.h"
+
+/**
+Instrumentation is compiled in unless PPSS_NO_INSTRUMENTATION is defined. Compiled in,
+a transport without a report costs one pointer test per timed stage; compiled out, the
+timers and counters fold away entirely. Nothing is counted inside the per-element loop:
+element applications are derived once per run from where the protons stopped.
+*/
+#ifdef PPSS_NO_INSTRUMENTATION
+const bool kInstrumentation = false;
+#else
+const bool kInstrumentation = true;
+#endif
+
+/**
+\brief Stages of a run timed by StageTimer.
+*/
+enum class Stage {
+  kPrepareBeamline, //!< Twiss parsing or lattice artifact mapping
+  kReadInput,       //!< decoding the Pythia sample (or loading its sidecar)
+  kTracking,
+  kCompare,         //!< pairing default and perturbed protons in CompareWithDefault
+  kWriteOutput,     //!< filling the output and writing the loss map
+  kCloseOutput,     //!< summary histograms and closing (flushing) the output file
+  kRun,             //!< a whole simple_tracking or CompareWithDefault call
+  kScan             //!< a whole scan, timed by its driver
+};
+
+const int kNumberOfStages = 8;
+
+const int kNumberOfElementKinds = 7;
+
+const char* StageName(Stage);
+
+uint64_t ThreadCpuNanoseconds();
+
+/**
+\brief Wall and CPU time per stage and tracking counters of a run, or of a whole scan with Merge.
+
+All additions are atomic, so the workers of a run (and the runs of a scan) can add
+concurrently. Times of scopes on several threads add up: wall time of the tracking
+stage is the busy time of the workers, not the elapsed time. CPU time is that of the
+thread running the scope, so the run and scan stages exclude their workers. The calls of
+a stage are its timed intervals (one per chunk for tracking, for instance).
+
+With SetUsePerfCounters the timers also read the hardware counters of their thread (see
+PerfCounters), summed per stage like the CPU time.
+*/
+class RunReport {
+public:
+  RunReport();
+
+  void AddStage(Stage, uint64_t wall_ns, uint64_t cpu_ns);
+
+  void AddStagePerf(Stage, const PerfSample& begin, const PerfSample& end);
+
+  void SetUsePerfCounters(bool);
+
+  bool UsesPerfCounters() const;
+
+  void AddBytesRead(uint64_t);
+
+  void AddBytesWritten(uint64_t);
+
+  void AddElementCounts(const std::vector<BeamElement>&, double last_obs_point, uint64_t n_tracked,
+                        const LossRecords& lost);
+
+  void Merge(const RunReport&);
+
+  uint64_t GetCalls(Stage) const;
+
+  double GetWallTime(Stage) const; //!< [s]
+
+  double GetCpuTime(Stage) const; //!< [s]
+
+  uint64_t GetElementApplications(ElementKind) const;
+
+  uint64_t GetLost(ElementKind) const;
+
+  uint64_t GetLossChecks() const;
+
+  uint64_t GetBytesRead() const;
+
+  uint64_t GetBytesWritten() const;
+
+  uint64_t GetProtons() const; //!< protons tracked, as counted by AddElementCounts
+
+  PerfTotals GetPerf(Stage) const;
+
+private:
+  RunReport(const RunReport&) = delete;
+  RunReport& operator=(const RunReport&) = delete;
+
+  std::atomic<uint64_t> calls[kNumberOfStages];
+  std::atomic<uint64_t> wall_ns[kNumberOfStages];
+  std::atomic<uint64_t> cpu_ns[kNumberOfStages];
+  std::atomic<uint64_t> applications[kNumberOfElementKinds];
+  std::atomic<uint64_t> lost[kNumberOfElementKinds];
+  std::atomic<uint64_t> loss_checks;
+  std::atomic<uint64_t> bytes_read;
+  std::atomic<uint64_t> bytes_written;
+  std::atomic<uint64_t> protons;
+  std::atomic<bool> use_perf_counters;
+  mutable std::mutex perf_mutex;
+  PerfTotals perf[kNumberOfStages];
+};
+
+/**
+\brief Adds the wall and CPU time between Start (or construction) and Stop (or destruction) to a stage.
+
+Does nothing for a null report.
+*/
+class StageTimer {
+public:
+  StageTimer(RunReport* report, Stage stage) : 
+    report(report), stage(stage), running(false), count_events(false), cpu_begin(0) {
+    Start();
+  }
+
+  ~StageTimer() { Stop(); }
+
+  void Start() {
+    if (!kInstrumentation || !report || running) return;
+    running = true;
+    wall_begin = std::chrono::steady_clock::now();
+    cpu_begin = ThreadCpuNanoseconds();
+    count_events = report->UsesPerfCounters();
+    if (count_events) PerfCounters::ForThisThread().Read(perf_begin);
+  }
+
+  void Stop() {
+    if (!kInstrumentation || !report || !running) return;
+    running = false;
+    if (count_events) {
+      PerfSample perf_end;
+      PerfCounters::ForThisThread().Read(perf_end);
+      report->AddStagePerf(stage, perf_begin, perf_end);
+    }
+    uint64_t cpu = ThreadCpuNanoseconds() - cpu_begin;
+    uint64_t wall = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - wall_begin).count();
+    report->AddStage(stage, wall, cpu);
+  }
+
+private:
+  StageTimer(const StageTimer&) = delete;
+  StageTimer& operator=(const StageTimer&) = delete;
+
+  RunReport* report;
+  Stage stage;
+  bool running;
+  bool count_events;
+  std::chrono::steady_clock::time_point wall_begin;
+  uint64_t cpu_begin;
+  PerfSample perf_begin;
+};
+
+bool WriteRunReportJson(const std::string&, const RunReport&, const std::string& label);
+
+#endif
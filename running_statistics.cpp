@@ -0,0 +1,115 @@
+#include "running_statistics.h"
+
+#include <algorithm>
+#include <math.h>
+
+RunningStatistics::RunningStatistics()
+  : n(0), mean(0), m2(0), min(0), max(0)
+{
+}
+
+void RunningStatistics::Fill(double value) {
+  if (n == 0 || value < min) min = value;
+  if (n == 0 || value > max) max = value;
+  ++n;
+  double delta = value - mean;
+  mean += delta / n;
+  m2 += delta * (value - mean);
+}
+
+/**
+\brief Fill count values of an array.
+
+Blocks of the array are summarised with two vectorisable passes (sum, minimum and maximum,
+then squared deviations from the block mean) in independent lanes and merged with Merge.
+The result equals filling the values one by one up to rounding.
+*/
+void RunningStatistics::Fill(const float* values, size_t count) {
+  const size_t block_size = 4096;
+  const int lanes = 8;
+  for (size_t first = 0; first < count; first += block_size) {
+    const float* v = values + first;
+    size_t m = std::min(block_size, count - first);
+    size_t m_lanes = m - m % lanes;
+
+    double sum[lanes] = {};
+    float lo[lanes], hi[lanes];
+    for (int l = 0; l < lanes; l++) lo[l] = hi[l] = v[0];
+    for (size_t i = 0; i < m_lanes; i += lanes) {
+      for (int l = 0; l < lanes; l++) {
+        sum[l] += v[i + l];
+        lo[l] = v[i + l] < lo[l] ? v[i + l] : lo[l];
+        hi[l] = v[i + l] > hi[l] ? v[i + l] : hi[l];
+      }
+    }
+    RunningStatistics block;
+    block.n = m;
+    block.min = block.max = v[0];
+    double total = 0;
+    for (int l = 0; l < lanes; l++) {
+      total += sum[l];
+      block.min = std::min<double>(block.min, lo[l]);
+      block.max = std::max<double>(block.max, hi[l]);
+    }
+    for (size_t i = m_lanes; i < m; i++) {
+      total += v[i];
+      block.min = std::min<double>(block.min, v[i]);
+      block.max = std::max<double>(block.max, v[i]);
+    }
+    block.mean = total / m;
+
+    double m2[lanes] = {};
+    for (size_t i = 0; i < m_lanes; i += lanes) {
+      for (int l = 0; l < lanes; l++) {
+        double d = v[i + l] - block.mean;
+        m2[l] += d * d;
+      }
+    }
+    block.m2 = 0;
+    for (int l = 0; l < lanes; l++) block.m2 += m2[l];
+    for (size_t i = m_lanes; i < m; i++) block.m2 += (v[i] - block.mean) * (v[i] - block.mean);
+
+    Merge(block);
+  }
+}
+
+/**
+\brief Add the values accumulated in other (Chan et al. pairwise update).
+*/
+void RunningStatistics::Merge(const RunningStatistics& other) {
+  if (other.n == 0) return;
+  if (n == 0) {
+    *this = other;
+    return;
+  }
+  long long n_total = n + other.n;
+  double delta = other.mean - mean;
+  mean += delta * other.n / n_total;
+  m2 += other.m2 + delta * delta * ((double)n * other.n / n_total);
+  if (other.min < min) min = other.min;
+  if (other.max > max) max = other.max;
+  n = n_total;
+}
+
+long long RunningStatistics::GetN() const {
+  return n;
+}
+
+double RunningStatistics::GetMean() const {
+  return mean;
+}
+
+/**
+\brief Standard deviation with 1/N normalisation, as TH1::GetRMS.
+*/
+double RunningStatistics::GetRMS() const {
+  return n > 0 ? sqrt(m2 / n) : 0.;
+}
+
+double RunningStatistics::GetMin() const {
+  return min;
+}
+
+double RunningStatistics::GetMax() const {
+  return max;
+}
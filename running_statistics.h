@@ -0,0 +1,40 @@
+#ifndef running_statistics_h
+#define running_statistics_h
+
+#include <cstddef>
+
+/**
+\brief Streaming mean, RMS, minimum and maximum of a variable (Welford's algorithm).
+
+Results are exact (unbinned) and numerically stable. Accumulators filled on different
+threads or chunks can be combined with Merge.
+*/
+class RunningStatistics {
+public:
+  RunningStatistics();
+
+  void Fill(double);
+
+  void Fill(const float*, size_t);
+
+  void Merge(const RunningStatistics&);
+
+  long long GetN() const;
+
+  double GetMean() const;
+
+  double GetRMS() const;
+
+  double GetMin() const;
+
+  double GetMax() const;
+
+private:
+  long long n;
+  double mean;
+  double m2;
+  double min;
+  double max;
+};
+
+#endif
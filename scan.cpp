@@ -0,0 +1,33 @@
+#include "scan.h"
+
+#include <mutex>
+#include "parallel.h"
+
+/**
+\brief Execute scan runs concurrently: run(i), i < n_runs, returns its text per stream.
+
+run is called from n_workers threads at once. The texts of run i are written once every
+run before it has been written, so every stream receives its texts in run order
+whatever the number of workers.
+*/
+void RunScan(size_t n_runs, unsigned n_workers, const std::function<std::vector<ScanOutput>(size_t)>& run) {
+  std::vector<std::vector<ScanOutput>> results(n_runs);
+  std::vector<bool> done(n_runs, false);
+  size_t next_to_write = 0;
+  std::mutex out_mutex;
+
+  ParallelFor(n_runs, n_workers, [&](size_t i) {
+    std::vector<ScanOutput> result = run(i);
+
+    std::lock_guard<std::mutex> lock(out_mutex);
+    results[i] = std::move(result);
+    done[i] = true;
+    for (; next_to_write < n_runs && done[next_to_write]; next_to_write++) {
+      for (const ScanOutput& output : results[next_to_write]) {
+        *output.out << output.text;
+        output.out->flush();
+      }
+      std::vector<ScanOutput>().swap(results[next_to_write]);
+    }
+  });
+}
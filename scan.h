@@ -0,0 +1,40 @@
+#ifndef scan_h
+#define scan_h
+
+#include <functional>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "magnet.h"
+#include "shift.h"
+
+/**
+\brief Widths of the Gaussian misalignments drawn for every magnet of a scan run.
+*/
+struct MisalignmentModel {
+  double x_shift_sigma = 0.00025;     //!< [m]
+  double y_shift_sigma = 0.00025;     //!< [m]
+  double z_shift_sigma = 0.001;       //!< [m]
+  double strength_ratio_sigma = 0.0005;
+};
+
+/**
+\brief Shift and strength ratio of one magnet in one scan run.
+*/
+struct MagnetMisalignment {
+  Magnet magnet;
+  Shift shift;
+  double strength_ratio;
+};
+
+/**
+\brief Text of a scan run for one output stream.
+*/
+struct ScanOutput {
+  std::ostream* out;
+  std::string text;
+};
+
+void RunScan(size_t n_runs, unsigned n_workers, const std::function<std::vector<ScanOutput>(size_t)>& run);
+
+#endif
@@ -0,0 +1,198 @@
+#include "scan_checkpoint.h"
+
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <unistd.h>
+
+namespace {
+
+// Journal: header line, then per run "run <run_id> <n_texts>\n", n_texts times
+// "<length>\n<text>", and "end <run_id>\n"; "complete\n" after the last run of a finished scan.
+const char kJournalMagic[] = "PPSS scan checkpoint 1";
+
+std::string Header(uint64_t fingerprint) {
+  std::ostringstream header;
+  header << kJournalMagic << " " << std::hex << fingerprint << "\n";
+  return header.str();
+}
+
+bool WriteAll(int fd, const std::string& data) {
+  for (size_t written = 0; written < data.size(); ) {
+    ssize_t n = write(fd, data.data() + written, data.size() - written);
+    if (n < 0) return false;
+    written += n;
+  }
+  return true;
+}
+
+// the directory entry of a new file must reach the disk too
+void SyncDirectory(const std::string& file_name) {
+  size_t slash = file_name.rfind('/');
+  std::string directory = slash == std::string::npos ? "." : slash == 0 ? "/" : file_name.substr(0, slash);
+  int fd = open(directory.c_str(), O_RDONLY);
+  if (fd < 0) return;
+  fsync(fd);
+  close(fd);
+}
+
+// Complete records of the journal in; end is set to the offset after the last of them.
+// complete is set if the journal is marked as finished.
+bool ReadJournal(std::istream& in, std::map<int, std::vector<std::string>>& done, std::streamoff& end, 
+                 bool& complete) {
+  std::string line;
+  complete = false;
+  for (;;) {
+    end = in.tellg();
+    if (!getline(in, line) || in.eof()) return true;
+    if (line == "complete") {
+      complete = true;
+      return true;
+    }
+    std::istringstream record(line);
+    std::string word;
+    int run_id;
+    size_t n_texts;
+    if (!(record >> word >> run_id >> n_texts) || word != "run") return true;
+
+    std::vector<std::string> texts(n_texts);
+    for (auto& text : texts) {
+      size_t length;
+      if (!getline(in, line) || in.eof() || !(std::istringstream(line) >> length)) return true;
+      text.resize(length);
+      if (length > 0 && !in.read(&text[0], length)) return true;
+    }
+    int end_id;
+    if (!getline(in, line) || in.eof() || !(std::istringstream(line) >> word >> end_id) || 
+        word != "end" || end_id != run_id) return true;
+    done[run_id] = std::move(texts);
+  }
+}
+
+} // namespace
+
+ScanCheckpoint::ScanCheckpoint() : fd(-1) {}
+
+ScanCheckpoint::~ScanCheckpoint() {
+  if (fd >= 0) close(fd);
+}
+
+/**
+\brief Start the journal file_name, or continue it (CheckpointMode::kResume).
+
+Resuming reads the completed runs, drops a torn record (or the completion mark) at the
+end and appends after them; a missing journal starts a new one. A journal of another
+scan (fingerprint) is an error, so a resume never mixes the runs of two configurations.
+Starting a new journal over one that holds the runs of an unfinished scan is an error
+too, unless the mode is kFresh.
+\return false, after printing the reason, if the journal cannot be used
+*/
+bool ScanCheckpoint::Open(const std::string& file_name_, uint64_t fingerprint, CheckpointMode mode) {
+  std::lock_guard<std::mutex> lock(mutex);
+  file_name = file_name_;
+  done.clear();
+  if (fd >= 0) close(fd);
+  fd = -1;
+
+  std::string header = Header(fingerprint);
+  std::streamoff end = 0;
+  std::ifstream in(file_name, std::ios::binary);
+  std::string line;
+  // a journal torn within its header holds no run yet and is started again
+  if (mode != CheckpointMode::kFresh && in && getline(in, line) && !in.eof()) {
+    if (mode == CheckpointMode::kResume && line + "\n" != header) {
+      std::cout << "ERROR! " << file_name << " is not the checkpoint of this scan" << std::endl;
+      return false;
+    }
+    bool complete;
+    ReadJournal(in, done, end, complete);
+    in.close();
+    if (mode == CheckpointMode::kNew) {
+      if (!done.empty() && !complete) {
+        std::cout << "ERROR! " << file_name << " holds " << done.size() 
+                  << " recorded runs; resume them or start afresh" << std::endl;
+        done.clear();
+        return false;
+      }
+      done.clear();
+    } else {
+      fd = open(file_name.c_str(), O_WRONLY);
+      if (fd < 0 || ftruncate(fd, end) != 0 || lseek(fd, 0, SEEK_END) < 0 || fsync(fd) != 0) {
+        std::cout << "ERROR! Cannot continue " << file_name << std::endl;
+        return false;
+      }
+      return true;
+    }
+  }
+
+  in.close();
+  fd = open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || !WriteAll(fd, header) || fsync(fd) != 0) {
+    std::cout << "ERROR! Cannot write " << file_name << std::endl;
+    return false;
+  }
+  SyncDirectory(file_name);
+  return true;
+}
+
+bool ScanCheckpoint::IsDone(int run_id) const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return done.count(run_id) > 0;
+}
+
+std::vector<std::string> ScanCheckpoint::GetTexts(int run_id) const {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = done.find(run_id);
+  return it != done.end() ? it->second : std::vector<std::string>();
+}
+
+size_t ScanCheckpoint::GetNumberOfDone() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return done.size();
+}
+
+/**
+\brief Append the completion record of run run_id and sync it; called from any thread.
+
+Files the run wrote besides its texts must be synced (SyncFile) before, so that a
+recorded run is complete on disk.
+*/
+bool ScanCheckpoint::Record(int run_id, const std::vector<std::string>& texts) {
+  std::ostringstream record;
+  record << "run " << run_id << " " << texts.size() << "\n";
+  for (const auto& text : texts) record << text.size() << "\n" << text;
+  record << "end " << run_id << "\n";
+
+  std::lock_guard<std::mutex> lock(mutex);
+  if (fd < 0 || !WriteAll(fd, record.str()) || fdatasync(fd) != 0) {
+    std::cout << "ERROR! Cannot record run " << run_id << " in " << file_name << std::endl;
+    return false;
+  }
+  done[run_id] = texts;
+  return true;
+}
+
+/**
+\brief Mark the scan as finished, after all its outputs are written.
+*/
+bool ScanCheckpoint::Complete() {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (fd < 0 || !WriteAll(fd, "complete\n") || fdatasync(fd) != 0) {
+    std::cout << "ERROR! Cannot mark " << file_name << " as complete" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+/**
+\brief Flush a written file and its directory entry to disk.
+*/
+bool SyncFile(const std::string& file_name) {
+  int fd = open(file_name.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  bool ok = fsync(fd) == 0;
+  close(fd);
+  SyncDirectory(file_name);
+  return ok;
+}
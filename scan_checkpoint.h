@@ -0,0 +1,60 @@
+#ifndef scan_checkpoint_h
+#define scan_checkpoint_h
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+\brief How ScanCheckpoint::Open treats an existing journal.
+*/
+enum class CheckpointMode {
+  kNew,     //!< start a journal, refusing to discard the runs of an incomplete scan
+  kResume,  //!< continue the journal of the same scan
+  kFresh    //!< start a journal, discarding the recorded runs
+};
+
+/**
+\brief Durable record of the completed runs of a scan, for resuming it after a crash.
+
+The journal file starts with the fingerprint of the scan (ScanSpec::GetFingerprint) and
+holds one record per completed run: its id and its result texts (the csv rows, one text
+per observation point). Every record is appended with a single write and synced to disk
+before Record returns, so after a crash the journal holds every run recorded so far
+plus possibly one torn record at its end, which Open drops. Runs are recorded in the
+order they complete; the csv files are rebuilt from the journal in run order. Complete
+marks the scan as finished, so that the next scan may start the journal again.
+*/
+class ScanCheckpoint {
+public:
+  ScanCheckpoint();
+
+  ~ScanCheckpoint();
+
+  bool Open(const std::string& file_name, uint64_t fingerprint, CheckpointMode mode);
+
+  bool IsDone(int run_id) const;
+
+  std::vector<std::string> GetTexts(int run_id) const;
+
+  size_t GetNumberOfDone() const;
+
+  bool Record(int run_id, const std::vector<std::string>& texts);
+
+  bool Complete();
+
+private:
+  ScanCheckpoint(const ScanCheckpoint&) = delete;
+  ScanCheckpoint& operator=(const ScanCheckpoint&) = delete;
+
+  std::string file_name;
+  int fd;
+  mutable std::mutex mutex;
+  std::map<int, std::vector<std::string>> done;
+};
+
+bool SyncFile(const std::string&);
+
+#endif
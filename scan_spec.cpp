@@ -0,0 +1,388 @@
+#include "scan_spec.h"
+
+#include <fstream>
+#include <iostream>
+#include <math.h>
+#include <sstream>
+#include <stdlib.h>
+#include "lattice_artifact.h"
+
+namespace {
+
+std::string Trim(const std::string& s) {
+  size_t begin = s.find_first_not_of(" \t\r");
+  if (begin == std::string::npos) return "";
+  size_t end = s.find_last_not_of(" \t\r");
+  return s.substr(begin, end - begin + 1);
+}
+
+bool ParseNumber(const std::string& word, double& value) {
+  char* end;
+  value = strtod(word.c_str(), &end);
+  return !word.empty() && *end == 0;
+}
+
+bool ParseBool(const std::string& word, bool& value) {
+  if (word == "true" || word == "yes" || word == "1") {value = true; return true;}
+  if (word == "false" || word == "no" || word == "0") {value = false; return true;}
+  return false;
+}
+
+// "gaus mean sigma", "uniform min max", "grid min max n", "fixed value" or just "value"
+bool ParseDistribution(const std::string& text, ParameterDistribution& d) {
+  std::istringstream ss(text);
+  std::vector<std::string> words;
+  for (std::string word; ss >> word; ) words.push_back(word);
+  if (words.empty()) return false;
+
+  std::vector<double> args;
+  size_t first_arg = ParseNumber(words[0], d.a) ? 0 : 1;
+  for (size_t i = first_arg; i < words.size(); i++) {
+    double value;
+    if (!ParseNumber(words[i], value)) return false;
+    args.push_back(value);
+  }
+  std::string kind = first_arg == 0 ? "fixed" : words[0];
+  if (kind == "fixed" && args.size() == 1) {
+    d.kind = ParameterDistribution::Kind::kFixed;
+    d.a = args[0];
+  } else if (kind == "gaus" && args.size() == 2 && args[1] >= 0) {
+    d.kind = ParameterDistribution::Kind::kGaus;
+    d.a = args[0];
+    d.b = args[1];
+  } else if (kind == "uniform" && args.size() == 2 && args[0] <= args[1]) {
+    d.kind = ParameterDistribution::Kind::kUniform;
+    d.a = args[0];
+    d.b = args[1];
+  } else if (kind == "grid" && args.size() == 3 && args[2] >= 1 && args[2] == (int)args[2]) {
+    d.kind = ParameterDistribution::Kind::kGrid;
+    d.a = args[0];
+    d.b = args[1];
+    d.n = args[2];
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// The parameters of the groups in the order they are drawn (x, y, z shift, strength ratio).
+std::vector<const ParameterDistribution*> Parameters(const MagnetGroup& group) {
+  return {&group.x_shift, &group.y_shift, &group.z_shift, &group.strength_ratio};
+}
+
+} // namespace
+
+/**
+\brief Value of the parameter in a run at grid_point (its index on this parameter's grid).
+
+Gaussian and uniform values take one Gaus or Uniform draw from random; fixed and grid
+values take none.
+*/
+double ParameterDistribution::Draw(RunRandom& random, int grid_point) const {
+  switch (kind) {
+    case Kind::kFixed: return a;
+    case Kind::kGaus: return random.Gaus(a, b);
+    case Kind::kUniform: return a + (b - a) * random.Uniform();
+    case Kind::kGrid: return n > 1 ? a + (b - a) * grid_point / (n - 1) : a;
+  }
+  return a;
+}
+
+double ParameterDistribution::GetSigma() const {
+  switch (kind) {
+    case Kind::kFixed: return 0;
+    case Kind::kGaus: return b;
+    case Kind::kUniform: return (b - a) / sqrt(12.);
+    case Kind::kGrid: return n > 1 ? fabs(b - a) / (n - 1) * sqrt((n * n - 1) / 12.) : 0;
+  }
+  return 0;
+}
+
+bool MagnetSelection::Matches(const Magnet& magnet) const {
+  if (!type.empty() && magnet.GetType() != type) return false;
+  if (magnet.GetPosition() < min_position || magnet.GetPosition() > max_position) return false;
+  if (names.empty()) return true;
+  for (const auto& name : names) if (name == magnet.GetName()) return true;
+  return false;
+}
+
+MagnetGroup::MagnetGroup() {
+  strength_ratio.a = 1;
+}
+
+int ScanSpec::GetNumberOfGridPoints() const {
+  int n = 1;
+  for (const auto& group : groups) {
+    for (const ParameterDistribution* p : Parameters(group)) {
+      if (p->kind == ParameterDistribution::Kind::kGrid) n *= p->n;
+    }
+  }
+  return n;
+}
+
+int ScanSpec::GetNumberOfRuns() const {
+  return runs_per_point * GetNumberOfGridPoints();
+}
+
+/**
+\brief Misalignment of every selected magnet in run run_id.
+
+Magnets are visited in the given order and draw x, y, z shift and strength ratio in turn
+from the run's own RunRandom stream, so the result depends only on (seed, run_id).
+*/
+std::vector<MagnetMisalignment> ScanSpec::DrawRun(const std::vector<Magnet>& magnets, int run_id) const {
+  // index of the run's grid point on every grid parameter, the first one varying fastest
+  std::vector<std::vector<int>> grid_point(groups.size(), std::vector<int>(4, 0));
+  int point = (run_id - 1) / std::max(1, runs_per_point);
+  for (size_t g = 0; g < groups.size(); g++) {
+    std::vector<const ParameterDistribution*> parameters = Parameters(groups[g]);
+    for (size_t p = 0; p < parameters.size(); p++) {
+      if (parameters[p]->kind != ParameterDistribution::Kind::kGrid) continue;
+      grid_point[g][p] = point % parameters[p]->n;
+      point /= parameters[p]->n;
+    }
+  }
+
+  RunRandom random(seed, run_id);
+  std::vector<MagnetMisalignment> misalignment;
+  for (const auto& magnet : magnets) {
+    for (size_t g = 0; g < groups.size(); g++) {
+      const MagnetGroup& group = groups[g];
+      if (!group.selection.Matches(magnet)) continue;
+      double dx = group.x_shift.Draw(random, grid_point[g][0]);
+      double dy = group.y_shift.Draw(random, grid_point[g][1]);
+      double dz = group.z_shift.Draw(random, grid_point[g][2]);
+      double ratio = group.strength_ratio.Draw(random, grid_point[g][3]);
+      misalignment.push_back(MagnetMisalignment{magnet, Shift(dx, dy, dz), ratio});
+      break;
+    }
+  }
+  return misalignment;
+}
+
+/**
+\brief Spread of dx, dy, dz and strength ratio of every magnet over the runs, in the parameter order of SensitivityMatrix.
+*/
+std::vector<double> ScanSpec::GetParameterSigmas(const std::vector<Magnet>& magnets) const {
+  std::vector<double> sigmas;
+  for (const auto& magnet : magnets) {
+    const MagnetGroup* group = 0;
+    for (const auto& g : groups) if (g.selection.Matches(magnet)) {group = &g; break;}
+    if (!group) {
+      sigmas.insert(sigmas.end(), {0., 0., 0., 0.});
+      continue;
+    }
+    for (const ParameterDistribution* p : Parameters(*group)) sigmas.push_back(p->GetSigma());
+  }
+  return sigmas;
+}
+
+/**
+\brief changes_csv for observation point obs_points[obs_index]; with several points the name
+gets "_<obs>m" before its extension.
+*/
+std::string ScanSpec::GetChangesCsv(size_t obs_index) const {
+  if (changes_csv.empty() || obs_points.size() < 2) return changes_csv;
+  std::ostringstream suffix;
+  suffix << "_" << obs_points[obs_index] << "m";
+  return InsertBeforeExtension(changes_csv, suffix.str());
+}
+
+/**
+\brief FNV-1a hash of everything that determines the results of the runs.
+
+The optics and input files enter with their content (HashFileContent), so a resume
+after either was regenerated is refused. Output names and the name of the scan do not
+enter, so a scan resumed from its checkpoint may write elsewhere.
+*/
+uint64_t ScanSpec::GetFingerprint() const {
+  std::ostringstream description;
+  description.precision(17);
+  for (const std::string& file_name : {optics_file_name, input_file_name}) {
+    uint64_t content_hash = 0;
+    description << file_name << " ";
+    if (HashFileContent(file_name, content_hash)) description << std::hex << content_hash << std::dec << "\n";
+    else description << "unreadable\n";
+  }
+  description << seed << " " << runs_per_point;
+  for (double obs_point : obs_points) description << " " << obs_point;
+  for (const auto& group : groups) {
+    const MagnetSelection& selection = group.selection;
+    description << "\n" << selection.type << " " << selection.min_position << " " << selection.max_position;
+    for (const auto& name : selection.names) description << " " << name;
+    for (const ParameterDistribution* p : Parameters(group)) {
+      description << " " << (int)p->kind << " " << p->a << " " << p->b << " " << p->n;
+    }
+  }
+
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (unsigned char c : description.str()) {
+    hash ^= c;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+/**
+\brief "dir/name.ext" to "dir/name" + suffix + ".ext" (to file_name + suffix without extension).
+*/
+std::string InsertBeforeExtension(const std::string& file_name, const std::string& suffix) {
+  size_t dot = file_name.rfind('.');
+  size_t slash = file_name.rfind('/');
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) return file_name + suffix;
+  return file_name.substr(0, dot) + suffix + file_name.substr(dot);
+}
+
+/**
+\brief Read a scan specification.
+
+One "key = value" per line, '#' starts a comment. Scan keys: name, optics (required),
+input, seed, runs (per grid point), obs_points (list), changes_csv, loss_maps (file
+prefix), loss_map_csv, reports (file prefix), scan_report, checkpoint,
+default_tracking, sensitivity. Every "[magnets]" line opens a group with the keys type ("any" or a
+magnet type), names (list), position ("min max" in m) and x_shift, y_shift, z_shift,
+strength_ratio, each "gaus mean sigma", "uniform min max", "grid min max n" or a fixed
+value. Unset parameters stay nominal. See misalignment.scan.
+\return false, after printing the offending line, if the file cannot be read or is invalid
+*/
+bool ReadScanSpec(const std::string& file_name, ScanSpec& spec) {
+  std::ifstream in(file_name);
+  if (!in) {std::cout << "ERROR! No file named: " << file_name << std::endl; return false;}
+
+  spec = ScanSpec();
+  MagnetGroup* group = 0;
+  int line_number = 0;
+  for (std::string line; getline(in, line); ) {
+    line_number++;
+    line = Trim(line.substr(0, line.find('#')));
+    if (line.empty()) continue;
+    auto error = [&](const std::string& what) {
+      std::cout << "ERROR! " << file_name << ":" << line_number << ": " << what << ": " << line << std::endl;
+      return false;
+    };
+
+    if (line == "[magnets]") {
+      spec.groups.push_back(MagnetGroup());
+      group = &spec.groups.back();
+      continue;
+    }
+    size_t equal = line.find('=');
+    if (equal == std::string::npos) return error("expected key = value");
+    std::string key = Trim(line.substr(0, equal));
+    std::string value = Trim(line.substr(equal + 1));
+    std::istringstream words(value);
+    double number;
+
+    if (group) {
+      if (key == "type") {
+        group->selection.type = value == "any" ? "" : value;
+      } else if (key == "names") {
+        for (std::string name; words >> name; ) group->selection.names.push_back(name);
+      } else if (key == "position") {
+        if (!(words >> group->selection.min_position >> group->selection.max_position)) return error("expected min max");
+      } else if (key == "x_shift" || key == "y_shift" || key == "z_shift" || key == "strength_ratio") {
+        ParameterDistribution& d = key == "x_shift" ? group->x_shift : key == "y_shift" ? group->y_shift
+                                 : key == "z_shift" ? group->z_shift : group->strength_ratio;
+        if (!ParseDistribution(value, d)) return error("invalid distribution");
+      } else {
+        return error("unknown magnet group key");
+      }
+      continue;
+    }
+
+    if (key == "name") spec.name = value;
+    else if (key == "optics") spec.optics_file_name = value;
+    else if (key == "input") spec.input_file_name = value;
+    else if (key == "seed") {
+      if (!ParseNumber(value, number) || number < 0) return error("invalid seed");
+      spec.seed = strtoull(value.c_str(), 0, 10);
+    } else if (key == "runs") {
+      if (!ParseNumber(value, number) || number < 1 || number != (int)number) return error("invalid number of runs");
+      spec.runs_per_point = number;
+    } else if (key == "obs_points") {
+      spec.obs_points.clear();
+      for (std::string word; words >> word; ) {
+        if (!ParseNumber(word, number)) return error("invalid observation point");
+        spec.obs_points.push_back(number);
+      }
+      if (spec.obs_points.empty()) return error("no observation point");
+    }
+    else if (key == "changes_csv") spec.changes_csv = value;
+    else if (key == "loss_maps") spec.loss_map_prefix = value;
+    else if (key == "loss_map_csv") spec.loss_map_csv = value;
+    else if (key == "reports") spec.report_prefix = value;
+    else if (key == "scan_report") spec.scan_report = value;
+    else if (key == "checkpoint") spec.checkpoint = value;
+    else if (key == "default_tracking") {
+      if (!ParseBool(value, spec.default_tracking)) return error("expected true or false");
+    } else if (key == "sensitivity") {
+      if (!ParseBool(value, spec.sensitivity)) return error("expected true or false");
+    }
+    else return error("unknown key");
+  }
+
+  if (spec.optics_file_name.empty()) {std::cout << "ERROR! " << file_name << ": no optics given" << std::endl; return false;}
+  if (spec.groups.empty()) {std::cout << "ERROR! " << file_name << ": no [magnets] group" << std::endl; return false;}
+  if (!spec.loss_map_csv.empty() && spec.loss_map_prefix.empty()) {
+    std::cout << "ERROR! " << file_name << ": loss_map_csv needs loss_maps" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+/**
+\brief The misalignment scan formerly hard-coded in main (see misalignment.scan).
+
+100 runs of seed 2020; every magnet gets Gaussian shifts and strength ratio of the
+default MisalignmentModel; compared at 205 m.
+*/
+ScanSpec DefaultScanSpec(const std::string& optics_file_name) {
+  ScanSpec spec;
+  spec.name = "misalignment";
+  spec.optics_file_name = optics_file_name;
+  spec.seed = 2020;
+  spec.runs_per_point = 100;
+  spec.changes_csv = "multiple_changes_inst2.csv";
+  spec.loss_map_prefix = "lossmap_run";
+  spec.loss_map_csv = "loss_map_all_runs.csv";
+  spec.report_prefix = "run_report_run";
+  spec.scan_report = "run_report_scan.json";
+  spec.checkpoint = "misalignment.checkpoint";
+  spec.default_tracking = true;
+  spec.sensitivity = true;
+
+  MisalignmentModel model;
+  MagnetGroup all;
+  all.x_shift = ParameterDistribution{ParameterDistribution::Kind::kGaus, 0, model.x_shift_sigma};
+  all.y_shift = ParameterDistribution{ParameterDistribution::Kind::kGaus, 0, model.y_shift_sigma};
+  all.z_shift = ParameterDistribution{ParameterDistribution::Kind::kGaus, 0, model.z_shift_sigma};
+  all.strength_ratio = ParameterDistribution{ParameterDistribution::Kind::kGaus, 1, model.strength_ratio_sigma};
+  spec.groups.push_back(all);
+  return spec;
+}
+
+/**
+\brief Group the runs of the scans by optics and input file.
+
+The runs of a batch share one compiled beamline, one decoded input and one default
+tracking, and are executed in one pool of workers.
+*/
+std::vector<ScanBatch> PlanScanBatches(const std::vector<ScanSpec>& specs) {
+  std::vector<ScanBatch> batches;
+  for (size_t s = 0; s < specs.size(); s++) {
+    const ScanSpec& spec = specs[s];
+    ScanBatch* batch = 0;
+    for (auto& b : batches) {
+      if (b.optics_file_name == spec.optics_file_name && b.input_file_name == spec.input_file_name) {batch = &b; break;}
+    }
+    if (!batch) {
+      batches.push_back(ScanBatch());
+      batch = &batches.back();
+      batch->optics_file_name = spec.optics_file_name;
+      batch->input_file_name = spec.input_file_name;
+    }
+    batch->specs.push_back(s);
+    for (int run_id = 1; run_id <= spec.GetNumberOfRuns(); run_id++) batch->tasks.push_back(ScanTask{s, run_id});
+  }
+  return batches;
+}
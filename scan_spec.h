@@ -0,0 +1,132 @@
+#ifndef scan_spec_h
+#define scan_spec_h
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "magnet.h"
+#include "run_random.h"
+#include "scan.h"
+
+/**
+\brief How one misalignment parameter of the selected magnets is set in each run.
+
+kFixed: value a. kGaus: mean a, sigma b. kUniform: in [a, b). kGrid: n points from a to b
+(both included); the runs of a scan step through the grid points, see ScanSpec.
+*/
+struct ParameterDistribution {
+  enum class Kind {
+    kFixed,
+    kGaus,
+    kUniform,
+    kGrid
+  };
+
+  Kind kind = Kind::kFixed;
+  double a = 0;
+  double b = 0;
+  int n = 1;
+
+  double Draw(RunRandom&, int grid_point) const;
+
+  double GetSigma() const; //!< standard deviation over the runs, 0 for fixed values
+};
+
+/**
+\brief Magnets a group applies to: all conditions must hold.
+
+An empty type or name list matches any magnet; names are as Magnet::GetName
+("QUADRUPOLE3", "RBEND1", ...).
+*/
+struct MagnetSelection {
+  std::string type;
+  std::vector<std::string> names;
+  double min_position = -1.e300; //!< [m]
+  double max_position = 1.e300;  //!< [m]
+
+  bool Matches(const Magnet&) const;
+};
+
+/**
+\brief Selected magnets and the distributions of their shifts and strength ratio.
+*/
+struct MagnetGroup {
+  MagnetSelection selection;
+  ParameterDistribution x_shift;        //!< [m]
+  ParameterDistribution y_shift;        //!< [m]
+  ParameterDistribution z_shift;        //!< [m]
+  ParameterDistribution strength_ratio;
+
+  MagnetGroup();
+};
+
+/**
+\brief A scan read from a specification file, see ReadScanSpec.
+
+A magnet takes its misalignment from the first group selecting it; magnets selected by
+no group stay nominal. The scan has runs_per_point runs for every point of the grid
+spanned by the kGrid parameters (runs_per_point runs without grid), numbered from 1.
+Run run_id is at grid point (run_id - 1) / runs_per_point, the first grid parameter
+varying fastest, and draws its random values from RunRandom(seed, run_id).
+
+Every run compares the misaligned lattice with the default one at each observation
+point (CompareWithDefault). Empty output names are not written.
+*/
+struct ScanSpec {
+  std::string name = "scan";
+  std::string optics_file_name;
+  std::string input_file_name = "pythia8_13TeV_protons_100k.root";
+  uint64_t seed = 2020;
+  int runs_per_point = 1;
+  std::vector<double> obs_points = {205.};
+  std::vector<MagnetGroup> groups;
+
+  std::string changes_csv;         //!< RMS and mean of the differences per run, one file per observation point
+  std::string loss_map_prefix;     //!< loss map of run run_id at the last observation point in loss_map_prefix + run_id + ".lossmap"
+  std::string loss_map_csv;        //!< loss maps summed over the runs, needs loss_map_prefix
+  std::string report_prefix;       //!< run report in report_prefix + run_id + ".json"
+  std::string scan_report;         //!< run reports summed over the scan
+  std::string checkpoint;          //!< journal of the completed runs, see ScanCheckpoint
+  bool default_tracking = false;   //!< track the default lattice with simple_tracking first
+  bool sensitivity = false;        //!< predict the RMS of the differences from the sensitivity matrix
+
+  int GetNumberOfGridPoints() const;
+
+  int GetNumberOfRuns() const;
+
+  std::vector<MagnetMisalignment> DrawRun(const std::vector<Magnet>&, int run_id) const;
+
+  std::vector<double> GetParameterSigmas(const std::vector<Magnet>&) const;
+
+  std::string GetChangesCsv(size_t obs_index) const;
+
+  uint64_t GetFingerprint() const;
+};
+
+std::string InsertBeforeExtension(const std::string& file_name, const std::string& suffix);
+
+bool ReadScanSpec(const std::string&, ScanSpec&);
+
+ScanSpec DefaultScanSpec(const std::string& optics_file_name);
+
+/**
+\brief One run of one of several scans.
+*/
+struct ScanTask {
+  size_t spec; //!< index of the scan
+  int run_id;
+};
+
+/**
+\brief Runs of the scans that use the same optics and input, to be executed together.
+*/
+struct ScanBatch {
+  std::string optics_file_name;
+  std::string input_file_name;
+  std::vector<size_t> specs; //!< the scans of the batch, in the given order
+  std::vector<ScanTask> tasks; //!< their runs, scan by scan in run order
+};
+
+std::vector<ScanBatch> PlanScanBatches(const std::vector<ScanSpec>&);
+
+#endif
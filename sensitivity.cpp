@@ -0,0 +1,101 @@
+#include "sensitivity.h"
+
+#include <cstdint>
+#include <fstream>
+#include <math.h>
+#include <stdio.h>
+
+const char* SensitivityOutputName(int output) {
+  static const char* names[SensitivityMatrix::kOutputs] = {"x", "sx", "y", "sy"};
+  return names[output];
+}
+
+double SensitivityMatrix::GetMean(int output, size_t parameter) const {
+  return mean[output * GetNumberOfParameters() + parameter];
+}
+
+/**
+\brief Spread of d output / d parameter over the protons of the sample.
+*/
+double SensitivityMatrix::GetStdDev(int output, size_t parameter) const {
+  size_t i = output * GetNumberOfParameters() + parameter;
+  double variance = mean_square[i] - mean[i] * mean[i];
+  return variance > 0 ? sqrt(variance) : 0.;
+}
+
+/**
+\brief Expected RMS over protons of the output difference for independent Gaussian perturbations.
+
+sigmas[j] is the width of parameter j. To first order the difference of a proton is J delta,
+so the expected squared RMS over the sample is sum_j sigma_j^2 Var_p(J_j), which is what the
+scan in main measures one configuration at a time.
+*/
+double SensitivityMatrix::PredictRMS(int output, const std::vector<double>& sigmas) const {
+  double sum = 0;
+  for (size_t j = 0; j < GetNumberOfParameters() && j < sigmas.size(); j++) {
+    double s = GetStdDev(output, j);
+    sum += sigmas[j] * sigmas[j] * s * s;
+  }
+  return sqrt(sum);
+}
+
+/**
+\brief Expected spread (over configurations) of the mean output difference, sqrt(sum_j sigma_j^2 E_p[J_j]^2).
+*/
+double SensitivityMatrix::PredictMeanSpread(int output, const std::vector<double>& sigmas) const {
+  double sum = 0;
+  for (size_t j = 0; j < GetNumberOfParameters() && j < sigmas.size(); j++) {
+    double m = GetMean(output, j);
+    sum += sigmas[j] * sigmas[j] * m * m;
+  }
+  return sqrt(sum);
+}
+
+/**
+\brief Sample-averaged matrix: one row per parameter with mean and spread of every derivative.
+*/
+bool WriteSensitivityCsv(const std::string& filename, const SensitivityMatrix& matrix) {
+  std::ofstream f(filename);
+  if (!f) return false;
+
+  f << "Parameter";
+  for (int o = 0; o < SensitivityMatrix::kOutputs; o++) {
+    f << ",Mean(d" << SensitivityOutputName(o) << "),StdDev(d" << SensitivityOutputName(o) << ")";
+  }
+  f << "\n";
+  for (size_t j = 0; j < matrix.GetNumberOfParameters(); j++) {
+    f << matrix.parameter_names[j];
+    for (int o = 0; o < SensitivityMatrix::kOutputs; o++) {
+      f << "," << matrix.GetMean(o, j) << "," << matrix.GetStdDev(o, j);
+    }
+    f << "\n";
+  }
+  return bool(f);
+}
+
+/**
+\brief Per-proton Jacobians in a compact binary file.
+
+Layout: "PPSSSENS", uint32 version, uint32 number of outputs, uint64 number of protons,
+uint64 number of parameters, the parameter names (uint32 length + characters each),
+int32 ev_id per proton, then the float Jacobians of all protons.
+*/
+bool WriteSensitivityBinary(const std::string& filename, const SensitivityMatrix& matrix) {
+  FILE* f = fopen(filename.c_str(), "wb");
+  if (!f) return false;
+  uint32_t version = 1, n_outputs = SensitivityMatrix::kOutputs;
+  uint64_t n_protons = matrix.GetNumberOfProtons(), n_parameters = matrix.GetNumberOfParameters();
+  bool ok = fwrite("PPSSSENS", 1, 8, f) == 8 &&
+            fwrite(&version, sizeof(version), 1, f) == 1 &&
+            fwrite(&n_outputs, sizeof(n_outputs), 1, f) == 1 &&
+            fwrite(&n_protons, sizeof(n_protons), 1, f) == 1 &&
+            fwrite(&n_parameters, sizeof(n_parameters), 1, f) == 1;
+  for (const auto& name : matrix.parameter_names) {
+    uint32_t length = name.size();
+    ok = ok && fwrite(&length, sizeof(length), 1, f) == 1 && fwrite(name.data(), 1, length, f) == length;
+  }
+  ok = ok && fwrite(matrix.ev_id.data(), sizeof(int), n_protons, f) == n_protons;
+  ok = ok && fwrite(matrix.jacobians.data(), sizeof(float), matrix.jacobians.size(), f) == matrix.jacobians.size();
+  ok = fclose(f) == 0 && ok;
+  return ok;
+}
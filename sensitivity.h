@@ -0,0 +1,43 @@
+#ifndef sensitivity_h
+#define sensitivity_h
+
+#include <string>
+#include <vector>
+
+/**
+\brief Derivatives of the output coordinates at the observation point with respect to every magnet perturbation.
+
+Outputs are x, sx, y, sy (as written to the ntuple, i.e. x and y extrapolated to the
+observation point). Parameters are, for every magnet in GetMagnets() order, its dx, dy,
+dz shift and its strength ratio. Per-proton Jacobians are stored row-major as
+kOutputs x n_parameters floats; mean and mean_square are their sample averages.
+*/
+struct SensitivityMatrix {
+  static const int kOutputs = 4;
+
+  std::vector<std::string> parameter_names;
+  std::vector<int> ev_id;
+  std::vector<float> jacobians;
+  std::vector<double> mean;
+  std::vector<double> mean_square;
+
+  size_t GetNumberOfParameters() const { return parameter_names.size(); }
+
+  size_t GetNumberOfProtons() const { return ev_id.size(); }
+
+  double GetMean(int output, size_t parameter) const;
+
+  double GetStdDev(int output, size_t parameter) const;
+
+  double PredictRMS(int output, const std::vector<double>& sigmas) const;
+
+  double PredictMeanSpread(int output, const std::vector<double>& sigmas) const;
+};
+
+const char* SensitivityOutputName(int);
+
+bool WriteSensitivityCsv(const std::string&, const SensitivityMatrix&);
+
+bool WriteSensitivityBinary(const std::string&, const SensitivityMatrix&);
+
+#endif
@@ -0,0 +1,274 @@
+#include "transfer_map.h"
+
+#include <cmath>
+
+namespace {
+
+PlaneMap DriftMap(double L) {
+  PlaneMap m;
+  m.m12 = L;
+  return m;
+}
+
+bool IsMagnet(ElementKind kind) {
+  return kind == ElementKind::kRectangularDipole || kind == ElementKind::kHorizontalKicker ||
+         kind == ElementKind::kVerticalKicker || kind == ElementKind::kQuadrupole;
+}
+
+void QuadrupoleMaps(const TransferSegment& seg, double beam_energy, double pz, PlaneMap& mx, PlaneMap& my) {
+  double qk  = sqrt((fabs(seg.strength) * beam_energy)/(pz * seg.length));
+  double qkl = qk * seg.length;
+
+  PlaneMap focusing, defocusing;
+  focusing.m11 = cos(qkl);
+  focusing.m12 = sin(qkl) / qk;
+  focusing.m21 = -qk * sin(qkl);
+  focusing.m22 = cos(qkl);
+  defocusing.m11 = cosh(qkl);
+  defocusing.m12 = sinh(qkl) / qk;
+  defocusing.m21 = qk * sinh(qkl);
+  defocusing.m22 = cosh(qkl);
+
+  if (seg.strength >= 0.) { //horizontal focussing
+    mx = focusing;
+    my = defocusing;
+  } else { //vertical focussing
+    mx = defocusing;
+    my = focusing;
+  }
+}
+
+void Record(ProtonState& plane, double x, double sx, double y, double sy, double z, double pz, bool is_lost) {
+  plane.x = x;
+  plane.sx = sx;
+  plane.y = y;
+  plane.sy = sy;
+  plane.z = z;
+  plane.pz = pz;
+  plane.is_lost = is_lost;
+}
+
+} // namespace
+
+PlaneMap Compose(const PlaneMap& outer, const PlaneMap& inner) {
+  PlaneMap m;
+  m.m11 = outer.m11 * inner.m11 + outer.m12 * inner.m21;
+  m.m12 = outer.m11 * inner.m12 + outer.m12 * inner.m22;
+  m.m21 = outer.m21 * inner.m11 + outer.m22 * inner.m21;
+  m.m22 = outer.m21 * inner.m12 + outer.m22 * inner.m22;
+  m.d1 = outer.m11 * inner.d1 + outer.m12 * inner.d2 + outer.d1;
+  m.d2 = outer.m21 * inner.d1 + outer.m22 * inner.d2 + outer.d2;
+  m.k1 = outer.m11 * inner.k1 + outer.m12 * inner.k2 + outer.k1;
+  m.k2 = outer.m21 * inner.k1 + outer.m22 * inner.k2 + outer.k2;
+  return m;
+}
+
+TransferLine::TransferLine(const std::vector<BeamElement>& beamline, 
+                           const std::vector<ElementPerturbation>& perturbations, 
+                           double obs_point, 
+                           double beam_energy,
+                           double beampipe_separation,
+                           double collimator150_rect_x,
+                           double collimator185_rect_x)
+  : TransferLine(beamline, perturbations, std::vector<double>{obs_point}, beam_energy, beampipe_separation,
+                 collimator150_rect_x, collimator185_rect_x)
+{
+}
+
+TransferLine::TransferLine(const std::vector<BeamElement>& beamline, 
+                           const std::vector<ElementPerturbation>& perturbations, 
+                           const std::vector<double>& obs_points, 
+                           double beam_energy,
+                           double beampipe_separation,
+                           double collimator150_rect_x,
+                           double collimator185_rect_x)
+  : beam_energy(beam_energy),
+    n_planes(obs_points.size())
+{
+  double z = 0;
+  double drift = 0;
+  double separation = 0;
+  bool separated = false;
+  size_t next_plane = 0;
+  if (n_planes == 0) return;
+
+  for (size_t a = 0; a < beamline.size(); a++) {
+    const BeamElement& el = beamline[a];
+    const ElementPerturbation& perturbation = perturbations[a];
+
+    double strength = el.strength;
+    if (perturbation.strength_ratio != 1) strength = strength * perturbation.strength_ratio;
+    // magnets with vanishing strength are tracked as drifts, without aperture check nor shift
+    bool is_checked = el.kind == ElementKind::kCollimator || (IsMagnet(el.kind) && fabs(strength) >= 1.e-15);
+
+    if (el.kind != ElementKind::kMarker) z += el.length;
+
+    if (!is_checked) {
+      if (el.kind != ElementKind::kMarker) drift += el.length;
+      if (z > 130. && !separated) {
+        separated = true;
+        separation = beampipe_separation;
+      }
+      if (z > obs_points[next_plane]) {
+        TransferSegment seg;
+        seg.z_begin = z;
+        seg.z_end = z;
+        seg.entry_x = DriftMap(drift);
+        seg.entry_x.d1 = separation;
+        seg.entry_y = DriftMap(drift);
+        while (next_plane < n_planes && z > obs_points[next_plane]) {
+          seg.n_observed++;
+          next_plane++;
+        }
+        segments.push_back(seg);
+        drift = 0;
+        separation = 0;
+      }
+      if (next_plane == n_planes) break;
+      continue;
+    }
+
+    TransferSegment seg;
+    seg.kind = el.kind;
+    seg.element = a;
+    seg.length = el.length;
+    seg.strength = strength;
+    seg.aperture = el.aperture;
+    if (el.collimator == CollimatorSlot::kCollimator150m) seg.aperture = WithHalfGapX(el.aperture, collimator150_rect_x);
+    if (el.collimator == CollimatorSlot::kCollimator185m) seg.aperture = WithHalfGapX(el.aperture, collimator185_rect_x);
+    seg.z_begin = z - el.length;
+    seg.z_end = z;
+
+    ElementPerturbation shift;
+    if (IsMagnet(el.kind)) shift = perturbation;
+
+    // drifts, separation, then into the element frame: u -> u - du + u' dz
+    seg.entry_x = DriftMap(drift + shift.dz);
+    seg.entry_x.d1 = separation - shift.dx;
+    seg.entry_y = DriftMap(drift + shift.dz);
+    seg.entry_y.d1 = -shift.dy;
+
+    PlaneMap body_x = DriftMap(el.length);
+    PlaneMap body_y = DriftMap(el.length);
+    if (el.kind == ElementKind::kRectangularDipole || el.kind == ElementKind::kHorizontalKicker) {
+      body_x.k1 = el.length * 0.5 * strength;
+      body_x.k2 = strength;
+    } else if (el.kind == ElementKind::kVerticalKicker) {
+      body_y.k1 = el.length * 0.5 * strength;
+      body_y.k2 = strength;
+    }
+    seg.fused_x = Compose(body_x, seg.entry_x);
+    seg.fused_y = Compose(body_y, seg.entry_y);
+
+    // out of the element frame: u -> u + du + u' dz
+    seg.exit_x = DriftMap(shift.dz);
+    seg.exit_x.d1 = shift.dx;
+    seg.exit_y = DriftMap(shift.dz);
+    seg.exit_y.d1 = shift.dy;
+
+    if (z > 130. && !separated) {
+      separated = true;
+      seg.separation_after = beampipe_separation;
+    }
+    while (next_plane < n_planes && z > obs_points[next_plane]) {
+      seg.n_observed++;
+      next_plane++;
+    }
+    segments.push_back(seg);
+
+    drift = 0;
+    separation = 0;
+    if (next_plane == n_planes) break;
+  }
+  n_reached_planes = next_plane;
+  reaches_obs_point = n_reached_planes == n_planes;
+}
+
+bool TransferLine::Track(double& x, double& sx, double& y, double& sy, double& z, double pz, bool& is_lost) const {
+  int lost_element;
+  return Track(x, sx, y, sy, z, pz, is_lost, lost_element, 0) == n_planes;
+}
+
+size_t TransferLine::Track(double& x, double& sx, double& y, double& sy, double& z, double pz, bool& is_lost, 
+                           int& lost_element, ProtonState* planes) const {
+  double energy_ratio = beam_energy / pz;
+  is_lost = false;
+  lost_element = -1;
+  size_t n_recorded = 0;
+
+  for (const auto& seg : segments) {
+    if (seg.kind == ElementKind::kDrift) {
+      seg.entry_x.Apply(x, sx, energy_ratio);
+      seg.entry_y.Apply(y, sy, energy_ratio);
+      z = seg.z_end;
+      for (int k = 0; k < seg.n_observed; k++, n_recorded++) {
+        if (planes) Record(planes[n_recorded], x, sx, y, sy, z, pz, false);
+      }
+      continue;
+    }
+
+    double x0 = x, sx0 = sx, y0 = y, sy0 = sy;
+    if (seg.kind == ElementKind::kQuadrupole) {
+      PlaneMap quad_x, quad_y;
+      QuadrupoleMaps(seg, beam_energy, pz, quad_x, quad_y);
+      seg.entry_x.Apply(x0, sx0, energy_ratio);
+      seg.entry_y.Apply(y0, sy0, energy_ratio);
+      quad_x.Apply(x0, sx0, energy_ratio);
+      quad_y.Apply(y0, sy0, energy_ratio);
+    } else {
+      seg.fused_x.Apply(x0, sx0, energy_ratio);
+      seg.fused_y.Apply(y0, sy0, energy_ratio);
+    }
+
+    if (seg.aperture.IsChecked() && seg.aperture.IsLost(x0, y0)) {
+      // in front of the element, moved into and out of its frame like the element kernels do
+      is_lost = true;
+      lost_element = seg.element;
+      seg.entry_x.Apply(x, sx, energy_ratio);
+      seg.entry_y.Apply(y, sy, energy_ratio);
+      seg.exit_x.Apply(x, sx, energy_ratio);
+      seg.exit_y.Apply(y, sy, energy_ratio);
+      z = seg.z_begin;
+      for (; n_recorded < n_planes; n_recorded++) {
+        if (planes) Record(planes[n_recorded], x, sx, y, sy, z, pz, true);
+      }
+      return n_recorded;
+    }
+
+    seg.exit_x.Apply(x0, sx0, energy_ratio);
+    seg.exit_y.Apply(y0, sy0, energy_ratio);
+    x = x0 + seg.separation_after;
+    sx = sx0;
+    y = y0;
+    sy = sy0;
+    z = seg.z_end;
+    for (int k = 0; k < seg.n_observed; k++, n_recorded++) {
+      if (planes) Record(planes[n_recorded], x, sx, y, sy, z, pz, false);
+    }
+  }
+  return n_recorded;
+}
+
+size_t TransferLine::GetNumberOfSegments() const {
+  return segments.size();
+}
+
+const std::vector<TransferSegment>& TransferLine::GetSegments() const {
+  return segments;
+}
+
+bool TransferLine::ReachesObsPoint() const {
+  return reaches_obs_point;
+}
+
+size_t TransferLine::GetNumberOfPlanes() const {
+  return n_planes;
+}
+
+size_t TransferLine::GetNumberOfReachedPlanes() const {
+  return n_reached_planes;
+}
+
+double TransferLine::GetBeamEnergy() const {
+  return beam_energy;
+}
@@ -0,0 +1,137 @@
+#ifndef transfer_map_h
+#define transfer_map_h
+
+#include <vector>
+#include "beamline.h"
+#include "perturbation.h"
+#include "proton_state.h"
+
+/**
+\brief Affine map of one transverse plane (u, u').
+
+u  -> m11 u + m12 u' + d1 + k1 * E/pz
+u' -> m21 u + m22 u' + d2 + k2 * E/pz
+
+The k terms carry the momentum dependence of dipoles and kickers.
+*/
+struct PlaneMap {
+  double m11 = 1, m12 = 0, m21 = 0, m22 = 1;
+  double d1 = 0, d2 = 0;
+  double k1 = 0, k2 = 0;
+
+  void Apply(double& u, double& up, double energy_ratio) const {
+    double u0 = u;
+    u = m11 * u0 + m12 * up + d1 + k1 * energy_ratio;
+    up = m21 * u0 + m22 * up + d2 + k2 * energy_ratio;
+  }
+};
+
+/**
+\brief Map equivalent to applying inner, then outer.
+*/
+PlaneMap Compose(const PlaneMap& outer, const PlaneMap& inner);
+
+/**
+\brief Everything between two aperture checks, ending with the checked element.
+
+entry: merged drifts (and beampipe separation) up to the element, followed by the
+move into the element frame. body: the element itself; for quadrupoles it depends
+on pz and is built per proton. exit: move back out of the element frame; a lost
+proton goes through entry and exit only, as in the element kernels.
+kind is kDrift for a drift segment without a checked element, ending just past an
+observation plane. n_observed planes are recorded at the end of the segment.
+*/
+struct TransferSegment {
+  ElementKind kind = ElementKind::kDrift;
+  double length = 0;
+  double strength = 0;
+  Aperture aperture; //!< collimators with their gap already applied
+  double z_begin = 0; //!< z at the entrance of the checked element
+  double z_end = 0;
+  PlaneMap entry_x, entry_y;
+  PlaneMap fused_x, fused_y; //!< body after entry, for elements whose body does not depend on pz
+  PlaneMap exit_x, exit_y;
+  double separation_after = 0; //!< beampipe separation reached at the end of the element
+  int n_observed = 0; //!< observation planes passed at the end of the segment
+  int element = -1; //!< beamline index of the checked element
+};
+
+/**
+\brief Beamline from the IP to the observation point(s) folded into transfer segments.
+
+Built once per run from the compiled beamline and its perturbation table. Consecutive
+drifts, markers and zero-strength magnets are merged; segments break only at elements
+with an aperture check (magnets and collimators). Misalignments are affine offsets of
+the entry and exit maps. With several observation planes the line runs up to the last
+one and a segment also ends at the first element past each plane, so that one pass
+records the proton at every plane.
+
+Reproduces element-by-element tracking up to floating point reassociation: differences
+stay below 1e-12 relative (1e-15 absolute near zero), far below the float precision of
+the output tree, and the lost/observed decision is the same.
+*/
+class TransferLine {
+public:
+  TransferLine(const std::vector<BeamElement>&, 
+               const std::vector<ElementPerturbation>&, 
+               double obs_point, 
+               double beam_energy,
+               double beampipe_separation,
+               double collimator150_rect_x,
+               double collimator185_rect_x);
+
+  /**
+  \brief Line through several observation planes, given in increasing z.
+  */
+  TransferLine(const std::vector<BeamElement>&, 
+               const std::vector<ElementPerturbation>&, 
+               const std::vector<double>& obs_points, 
+               double beam_energy,
+               double beampipe_separation,
+               double collimator150_rect_x,
+               double collimator185_rect_x);
+
+  /**
+  \brief Transport one proton; x, sx, y, sy, z are updated in place.
+
+  A lost proton is left as it was in front of the element that stopped it.
+  \return false if the proton was neither lost nor reached the observation point
+  */
+  bool Track(double& x, double& sx, double& y, double& sy, double& z, double pz, bool& is_lost) const;
+
+  /**
+  \brief Transport one proton and record it at every observation plane.
+
+  planes[k] gets x, sx, y, sy, z and is_lost at the end of the first segment past plane k,
+  as the single plane Track would leave them. A proton lost on the way is recorded lost
+  at all remaining planes and lost_element is set to the beamline index of the element
+  that stopped it.
+  \return number of planes recorded
+  */
+  size_t Track(double& x, double& sx, double& y, double& sy, double& z, double pz, bool& is_lost, 
+               int& lost_element, ProtonState* planes) const;
+
+  size_t GetNumberOfSegments() const;
+
+  const std::vector<TransferSegment>& GetSegments() const;
+
+  bool ReachesObsPoint() const;
+
+  size_t GetNumberOfPlanes() const;
+
+  /**
+  \brief Number of observation planes inside the beamline; the line ends past the last of them.
+  */
+  size_t GetNumberOfReachedPlanes() const;
+
+  double GetBeamEnergy() const;
+
+private:
+  std::vector<TransferSegment> segments;
+  double beam_energy;
+  bool reaches_obs_point = false;
+  size_t n_planes = 0;
+  size_t n_reached_planes = 0;
+};
+
+#endif
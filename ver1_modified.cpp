@@ -27,6 +27,32 @@
 #include "distributions_difference.h"
 #include "shift.h"
 #include "magnet.h"
+#include "beamline.h"
+#include "aperture.h"
+#include "perturbation.h"
+#include "transfer_map.h"
+#include "batch_transport.h"
+#include "proton_state.h"
+#include "parallel.h"
+#include "scan.h"
+#include "running_statistics.h"
+#include "pythia_sample.h"
+#include "lattice_artifact.h"
+#include "dual.h"
+#include "sensitivity.h"
+#include "alignment_fit.h"
+#include "loss_map.h"
+#include "output_writer.h"
+#include "benchmark.h"
+#include "run_report.h"
+#include "run_random.h"
+#include "scan_spec.h"
+#include "scan_checkpoint.h"
+#include <memory>
+#include <set>
+#include <chrono>
+#include <thread>
+#include <atomic>
 using std::cout;
 using std::endl;
 using std::vector;
@@ -41,25 +67,6 @@ using std::istringstream;
 
 
 
-double ApplyOperation(double lvalue, double rvalue, const std::string& op) {
-  if (op == "+") {
-    return lvalue + rvalue;
-  } else if (op == "-") {
-    return lvalue - rvalue;
-  } else if (op == "*") {
-    return lvalue * rvalue;
-  } 
-  return 0;
-}
-
-bool operator < (Magnet lhs, Magnet rhs) {
-  return lhs.GetName() < rhs.GetName();
-}
-
-bool operator == (Magnet lhs, Magnet rhs) {
-  return lhs.GetName() == rhs.GetName();
-}
-
 // 6 quadrupoles, 2 dipoles, 5 horizotal kickers and 5 vertical kickers
 
 struct MagnetIdIterators {
@@ -81,11 +88,13 @@ class FileName {
 public:
   FileName(const std::string& init_filename, 
            bool is_shifted, 
-           bool is_strength_changed) 
+           bool is_strength_changed,
+           int run_id = 0) 
     : init_filename(init_filename),
       output_filename(""),
       is_shifted(is_shifted),
-      is_strength_changed(is_strength_changed)
+      is_strength_changed(is_strength_changed),
+      run_id(run_id)
   {
   }
 
@@ -102,8 +111,14 @@ public:
     }
 
     output_filename += "pythia8_13TeV_protons_100k_transported_205m" + 
-                                   init_filename.substr(init_filename.find("_beta")) + 
-                                   ".root";
+                                   init_filename.substr(init_filename.find("_beta"));
+
+    // runs of a scan may be executed concurrently, each needs its own file
+    if (run_id > 0) {
+      output_filename += "_run" + std::to_string(run_id);
+    }
+
+    output_filename += ".root";
   }
 
   std::string GetOutputFileName() const {
@@ -115,6 +130,7 @@ private:
   std::string output_filename;
   bool is_shifted = false;
   bool is_strength_changed = false;
+  int run_id = 0;
 };
 
 class ProtonTransport {
@@ -122,24 +138,47 @@ class ProtonTransport {
     ProtonTransport(); //!< constructor 
     ~ProtonTransport(); //!< destructor 
     void PrepareBeamline(bool, bool); 
+    void PrepareBeamlineFromArtifact(bool);
     void simple_tracking(double);
+    void simple_tracking(const std::vector<double>&);
     void simple_pythia_tracking(double);
     void SetBeamEnergy(double);
     double GetBeamEnergy();
     void SetBeampipeSeparation(double);
     double GetBeampipeSeparation();
+    void SetUseTransferMaps(bool);
+    void SetUseBatchTracking(bool);
+    void SetNumberOfThreads(unsigned);
+    void SetRunId(int);
+    void SetUseInputSidecar(bool);
+    void SetInputFileName(const std::string&);
+    void SetOutputOptions(const OutputOptions&);
+    void SetUsePipeline(bool);
+    void SetUseRunReport(bool);
+    void SetUsePerfCounters(bool);
+    const RunReport& GetRunReport() const;
     void SetShift(const Magnet&, const Shift&);
-    void DoShift(const Magnet&, const string&);
+    template <class T> void DoShift(BasicProtonState<T>&, const BasicElementPerturbation<T>&, double) const;
     void SetStrengthRatio(const Magnet&, double);
-    void ApplyStrengthRatio(const Magnet&, double&);
+    template <class T> void ApplyStrengthRatio(const BasicElementPerturbation<T>&, T&) const;
     void SetProcessedFileName(const std::string&);
     std::string GetROOTOutputFileName() const;
-    void WriteChangesInCsv(const std::string&, DistributionsDifference*, int);
+    void WriteChangesInCsv(const std::string&, DistributionsDifference*, int) const;
+    void WriteChangesInCsv(std::ostream&, DistributionsDifference*, int, bool) const;
+    void WriteChangesInCsv(std::ostream&, const std::map<std::string, double>&, 
+                           const std::map<std::string, double>&, int, bool) const;
+    std::map<std::string, RunningStatistics> CompareWithDefault(double);
+    SensitivityMatrix ComputeSensitivity(double, int);
+    AlignmentFitResult FitAlignment(const std::string&, const std::string&, double, const AlignmentFitOptions&);
     void WriteLostProtonsInCsv(const std::string&) const;
+    const LossRecords& GetLostProtons() const;
+    const LossMap& GetLossMap() const;
     void SetPositions();
     std::vector<Magnet> GetMagnets() const;
     void SetMagnets(const std::vector<Magnet>&); 
-    bool is_current_lost=false;
+    std::shared_ptr<const std::vector<BeamElement>> GetBeamline() const;
+    void SetBeamline(std::shared_ptr<const std::vector<BeamElement>>);
+    std::vector<BenchmarkResult> BenchmarkKernels(int, int, int) const;
 
     double sigma1 = 0; // sigma = sqrt(eps * beta / gamma) sqrt(10e-2 m * 10e-6 m * rad) 
     double sigma2 = 0; // sigma = sqrt(eps * beta / gamma) sqrt(10e-2 m * 10e-6 m * rad) 
@@ -147,30 +186,52 @@ class ProtonTransport {
 
   private:
     double IP1Pos;
-    double x, y, z, px, py, pz, sx, sy;
     std::map<Magnet, Shift> magnet_to_shift;
     MagnetIdIterators iterators;
     std::string processed_filename;
     std::string optics_root_file_name;
     std::map<Magnet, double> magnet_to_ratio;
     std::vector<Magnet> magnets;
-    std::vector<std::vector<double>> lost_protons;
+    LossRecords lost_protons; //!< protons lost in the last simple_tracking or CompareWithDefault
+    LossMap loss_map; //!< lost_protons counted per beamline element
     //obj type -diplole quadrupole etc
     //shift obj id 1st 2dn dipole etc ; shift value - self explanatory ;shift axis_axis- x y z strength - condition applied in magnet methods
     // values or vectors- depending if we'll shift 2 things at once - if not values will work
     // numb_of_obj_uses - how many times an magnet/dipole etc has been used for specifiv proton - needs to be cleared NEEDS TO BE A VECTOR WITH ENTRY CORESPONDING OBJ TYPE 
     double beam_energy;
-    bool BeampipesAreSeparated;
     double BeampipeSeparation;
-    void Marker(bool);
-    void simple_drift(double, bool, double, double, double, double, bool);
-    void simple_rectangular_dipole(double, double, double, double, double, double);
-    void simple_horizontal_kicker(double, double, double, double, double, double);
-    void simple_vertical_kicker(double, double, double, double, double, double);
-    void simple_quadrupole(double, double, double, double, double, double, bool);
-    bool isLost(double, double, double, double, double, double);
+    template <class T> void Marker(const BasicProtonState<T>&, bool verbose = false) const;
+    template <class T> void simple_drift(BasicProtonState<T>&, double, bool verbose = false, const Aperture& aperture = Aperture()) const;
+    template <class T> void simple_rectangular_dipole(BasicProtonState<T>&, double, double, const Aperture&, const BasicElementPerturbation<T>&) const;
+    template <class T> void simple_horizontal_kicker(BasicProtonState<T>&, double, double, const Aperture&, const BasicElementPerturbation<T>&) const;
+    template <class T> void simple_vertical_kicker(BasicProtonState<T>&, double, double, const Aperture&, const BasicElementPerturbation<T>&) const;
+    template <class T> void simple_quadrupole(BasicProtonState<T>&, double, double, const Aperture&, const BasicElementPerturbation<T>&, bool verbose = false) const;
+    void compute_collimator_sigmas();
+    RunReport* run_report();
+    std::vector<int> magnet_index_per_element() const;
+    template <class T> bool track_proton(BasicProtonState<T>&, double, const std::vector<BasicElementPerturbation<T>>&) const;
+    template <class T> size_t track_proton(BasicProtonState<T>&, const double*, size_t, BasicProtonState<T>*, 
+                                           const std::vector<BasicElementPerturbation<T>>&) const;
+    void track_events(const PythiaSample&, int, int, double, const TransferLine*, 
+                      std::vector<TrackedProton>&, LossRecords&) const;
+    void track_events(const PythiaSample&, int, int, const std::vector<double>&, const TransferLine*, 
+                      std::vector<std::vector<TrackedProton>>&, LossRecords&) const;
+    std::shared_ptr<const PythiaSample> track_pipelined(const std::vector<double>&, const TransferLine*, OutputWriter&, 
+                                                        const std::vector<std::string>&, const std::vector<std::string>&);
     vector <vector <string> > element;
+    std::shared_ptr<const std::vector<BeamElement>> beamline; //!< element compiled into typed records, shared between transports
+    std::vector<ElementPerturbation> perturbations; //!< shifts and strength ratios resolved per beamline element
     bool DoApertureCut;
+    bool UseTransferMaps;
+    bool UseBatchTracking;
+    unsigned NumberOfThreads;
+    int RunId;
+    std::string input_file_name;
+    bool UseInputSidecar;
+    OutputOptions OutputSettings;
+    bool UsePipeline;
+    bool UseRunReport;
+    RunReport report; //!< stage times and counters of this transport, see SetUseRunReport
 };
 
 /** \class ProtonTransport
@@ -178,15 +239,30 @@ class ProtonTransport {
 
 Class constructor sets the following default values: \n 
 beam_energy of 6500 \n 
-BeampipesAreSeparated = false \n 
 BeampipeSeparation of 97.e-3 \n 
-DoApertureCut = true
+DoApertureCut = true \n 
+UseTransferMaps = false \n 
+UseBatchTracking = false \n 
+NumberOfThreads = 1 \n 
+RunId = 0 \n 
+input_file_name = "pythia8_13TeV_protons_100k.root" \n 
+UseInputSidecar = false \n 
+OutputSettings: TTree with ROOT's default compression \n 
+UsePipeline = false \n 
+UseRunReport = false
 */
 ProtonTransport::ProtonTransport() :
   beam_energy(6500.),
-  BeampipesAreSeparated(false),
   BeampipeSeparation(97.e-3),
-  DoApertureCut(true)
+  DoApertureCut(true),
+  UseTransferMaps(false),
+  UseBatchTracking(false),
+  NumberOfThreads(1),
+  RunId(0),
+  input_file_name("pythia8_13TeV_protons_100k.root"),
+  UseInputSidecar(false),
+  UsePipeline(false),
+  UseRunReport(false)
 {
 }
 
@@ -237,153 +313,264 @@ double ProtonTransport::GetBeampipeSeparation(){
   return BeampipeSeparation;
 }
 
+/**
+\brief Track with fused transfer maps between aperture checks instead of element by element.
+
+Results agree with element-by-element tracking up to floating point reassociation
+(below 1e-12 relative, invisible in the float branches of the output tree). Verbose
+printing at markers is not available in this mode.
+*/
+void ProtonTransport::SetUseTransferMaps(bool use){
+  UseTransferMaps = use;
+}
+
+/**
+\brief Track bundles of protons with the vectorized kernels of BatchTransport.
+
+Implies SetUseTransferMaps(true). Events are read and tracked in bundles and written
+in the same order as in the element-by-element mode.
+*/
+void ProtonTransport::SetUseBatchTracking(bool use){
+  UseBatchTracking = use;
+}
+
+/**
+\brief Number of threads tracking events in simple_tracking.
+
+The output does not depend on it: events are written in ev_id order.
+*/
+void ProtonTransport::SetNumberOfThreads(unsigned n){
+  NumberOfThreads = n;
+}
+
+/**
+\brief Id of the scan run this transport belongs to.
+
+A positive id is appended to the ROOT output file name, so that runs executed
+concurrently do not overwrite each other's output. 0 (default) keeps the plain name.
+*/
+void ProtonTransport::SetRunId(int run_id){
+  RunId = run_id;
+}
+
+/**
+\brief Keep the decoded input in a binary sidecar next to the Pythia file.
+
+The first process decodes the ROOT file and writes input_file_name + ".cache";
+later processes load the columns from it with a single read. The sidecar is
+rebuilt when the ROOT file changes.
+*/
+void ProtonTransport::SetUseInputSidecar(bool use){
+  UseInputSidecar = use;
+}
+
+/**
+\brief Input of simple_tracking and CompareWithDefault: a Pythia sample or the output of simple_tracking.
+*/
+void ProtonTransport::SetInputFileName(const std::string& file_name){
+  input_file_name = file_name;
+}
+
+/**
+\brief Format, compression and cluster size of the output of simple_tracking.
+
+OutputFormat::kNone skips the output file altogether (the loss map is still written).
+With OutputFormat::kColumnar the file name ends in ".columns" instead of ".root".
+*/
+void ProtonTransport::SetOutputOptions(const OutputOptions& options){
+  OutputSettings = options;
+}
+
+/**
+\brief Read the input, track and write the output of simple_tracking concurrently.
+
+The input is decoded in chunks on its own thread and tracked as soon as a chunk is
+ready; the output is serialised and compressed on another thread while later chunks
+are tracked. The output is identical to that of the sequential mode.
+*/
+void ProtonTransport::SetUsePipeline(bool use){
+  UsePipeline = use;
+}
+
+/**
+\brief Time the stages of PrepareBeamline, simple_tracking and CompareWithDefault and count what they do.
+
+The times and counters add up over all calls into GetRunReport(); see RunReport for
+what is measured and WriteRunReportJson for the report. Without it (or with
+PPSS_NO_INSTRUMENTATION defined at compile time) nothing is measured.
+*/
+void ProtonTransport::SetUseRunReport(bool use){
+  UseRunReport = use;
+}
+
+/**
+\brief Profiling mode: also read the hardware counters (cycles, instructions, branch and cache misses) of every timed stage.
+
+Needs SetUseRunReport(true). The report then gives IPC and misses per proton per stage;
+counters the machine does not offer are reported as unavailable. Per element kind the
+counters are taken around the kernel benchmarks, see BenchmarkKernels.
+*/
+void ProtonTransport::SetUsePerfCounters(bool use){
+  report.SetUsePerfCounters(use);
+}
+
+const RunReport& ProtonTransport::GetRunReport() const {
+  return report;
+}
+
+RunReport* ProtonTransport::run_report() {
+  return kInstrumentation && UseRunReport ? &report : 0;
+}
+
 /**
 \brief Beam element - marker.
 
 Marker is a "dummy" beam element used to mark a certain place between elements (in drift).
 */
-void ProtonTransport::Marker(bool verbose=false){
+template <class T>
+void ProtonTransport::Marker(const BasicProtonState<T>& proton, bool verbose) const {
   if (!verbose) return;
   cout << "MARKER\t";
-  cout << "z [m]: " << z;
-  cout << "\tx [mm]: " << x*1.e3; 
-  cout << "\ty [mm]: " << y*1.e3;
-  cout << "\tpx [GeV]: " << px;
-  cout << "\tpy [GeV]: " << py;
-  cout << "\tpz [GeV]: " << pz;
-  cout << "\tsx: " << sx;
-  cout << "\tsy: " << sy << endl;
+  cout << "z [m]: " << proton.z;
+  cout << "\tx [mm]: " << proton.x*1.e3; 
+  cout << "\ty [mm]: " << proton.y*1.e3;
+  cout << "\tpx [GeV]: " << proton.px;
+  cout << "\tpy [GeV]: " << proton.py;
+  cout << "\tpz [GeV]: " << proton.pz;
+  cout << "\tsx: " << proton.sx;
+  cout << "\tsy: " << proton.sy << endl;
 	//cout << z << "\t" << x << "\t" << y << "\t" << sx*pz << "\t" << sy*pz << endl;
 }  
 
-void ProtonTransport::simple_drift(double L, bool verbose=false, double rect_x=0, double rect_y=0, double el_x=0, double el_y=0, bool is_collimator=false){
-  double x0 = x;
-  double y0 = y;
-  double z0 = z;
+template <class T>
+void ProtonTransport::simple_drift(BasicProtonState<T>& proton, double L, bool verbose, const Aperture& aperture) const {
+  T x0 = proton.x;
+  T y0 = proton.y;
+  T z0 = proton.z;
 
-  x0+=L*sx;
-  y0+=L*sy;
+  x0+=L*proton.sx;
+  y0+=L*proton.sy;
   z0+=L;
 
-  if (is_collimator) {
-    if (!ProtonTransport::isLost(x0, y0, rect_x, rect_y, el_x, el_y)) {
-      x = x0;
-      y = y0;
-      z = z0;
+  if (aperture.IsChecked()) {
+    if (!aperture.IsLost(Value(x0), Value(y0))) {
+      proton.x = x0;
+      proton.y = y0;
+      proton.z = z0;
     } else {
-      lost_protons.push_back(std::vector<double>{px, py, pz});
+      proton.is_lost = true;
     }
   } else {
-    x = x0;
-    y = y0;
-    z = z0;
+    proton.x = x0;
+    proton.y = y0;
+    proton.z = z0;
   }
 
   if (!verbose) return;
   cout << "DRIFT\t";
-  cout << "z [m]: " << z;
-  cout << "\tx [mm]: " << x*1.e3; 
-  cout << "\ty [mm]: " << y*1.e3;
-  cout << "\tpx [GeV]: " << px;
-  cout << "\tpy [GeV]: " << py;
-  cout << "\tpz [GeV]: " << pz;
-  cout << "\tsx: " << sx;
-  cout << "\tsy: " << sy << endl;
+  cout << "z [m]: " << proton.z;
+  cout << "\tx [mm]: " << proton.x*1.e3; 
+  cout << "\ty [mm]: " << proton.y*1.e3;
+  cout << "\tpx [GeV]: " << proton.px;
+  cout << "\tpy [GeV]: " << proton.py;
+  cout << "\tpz [GeV]: " << proton.pz;
+  cout << "\tsx: " << proton.sx;
+  cout << "\tsy: " << proton.sy << endl;
 }
 
-void ProtonTransport::simple_rectangular_dipole(double L, double K0L, double rect_x, double rect_y, double el_x, double el_y){
-  iterators.IncreaseItByOne("RBEND_it");
-  //std::cout << "DIP" << iterators.GetIt("RBEND_it") << std::endl;
-  ApplyStrengthRatio(Dipole(iterators.GetIt("RBEND_it"), 0), K0L);
+template <class T>
+void ProtonTransport::simple_rectangular_dipole(BasicProtonState<T>& proton, double L, double K0L_nominal, const Aperture& aperture, const BasicElementPerturbation<T>& perturbation) const {
+  T K0L = K0L_nominal;
+  ApplyStrengthRatio(perturbation, K0L);
 
   if (fabs(K0L) < 1.e-15)
   {
-    simple_drift(L);
+    simple_drift(proton, L);
     return;
   }
-  DoShift(Dipole(iterators.GetIt("RBEND_it"), 0), "-");
-  double x0 = x;
-  double y0 = y;
-  double z0 = z;
-  double sx0 = sx;
+  DoShift(proton, perturbation, -1);
+  T x0 = proton.x;
+  T y0 = proton.y;
+  T z0 = proton.z;
+  T sx0 = proton.sx;
   z0 += L;
-  x0 += L*sx + L*0.5*K0L*beam_energy/pz; // length * initial slope + length * half of angle (from geometry) * correction due to energy loss
-  y0 += L*sy;
-  sx0 += K0L*beam_energy/pz;
+  x0 += L*proton.sx + L*0.5*K0L*beam_energy/proton.pz; // length * initial slope + length * half of angle (from geometry) * correction due to energy loss
+  y0 += L*proton.sy;
+  sx0 += K0L*beam_energy/proton.pz;
   //sy does not change
-  if (!ProtonTransport::isLost(x0, y0, rect_x, rect_y, el_x, el_y)) {
-    x = x0;
-    y = y0;
-    z = z0;
-    sx = sx0;
+  if (!aperture.IsChecked() || !aperture.IsLost(Value(x0), Value(y0))) {
+    proton.x = x0;
+    proton.y = y0;
+    proton.z = z0;
+    proton.sx = sx0;
   } else {
-    lost_protons.push_back(std::vector<double>{px, py, pz});
+    proton.is_lost = true;
   }
 
-  DoShift(Dipole(iterators.GetIt("RBEND_it"), 0), "+");
+  DoShift(proton, perturbation, +1);
 }
 
-void ProtonTransport::simple_horizontal_kicker(double L, double HKICK, double rect_x, double rect_y, double el_x, double el_y){
-  iterators.IncreaseItByOne("HKICKER_it");
-  //std::cout << "HKICKER" << iterators.GetIt("HKICKER_it") << std::endl;
-  ApplyStrengthRatio(HorizontalKicker(iterators.GetIt("HKICKER_it"), 0), HKICK);
+template <class T>
+void ProtonTransport::simple_horizontal_kicker(BasicProtonState<T>& proton, double L, double HKICK_nominal, const Aperture& aperture, const BasicElementPerturbation<T>& perturbation) const {
+  T HKICK = HKICK_nominal;
+  ApplyStrengthRatio(perturbation, HKICK);
 
 
   if (fabs(HKICK) < 1.e-15)
   {
-    simple_drift(L);
+    simple_drift(proton, L);
     return;
   }
-  DoShift(HorizontalKicker(iterators.GetIt("HKICKER_it"), 0), "-");
-  double x0 = x;
-  double y0 = y;
-  double z0 = z;
-  double sx0 = sx;
+  DoShift(proton, perturbation, -1);
+  T x0 = proton.x;
+  T y0 = proton.y;
+  T z0 = proton.z;
+  T sx0 = proton.sx;
   z0 += L;
-  x0 += L*sx + L*0.5*HKICK*beam_energy/pz; // length * initial slope + length * half of angle (from geometry) * correction due to energy loss
-  y0 += L*sy;
-  sx0 += HKICK*beam_energy/pz;
-  if (!ProtonTransport::isLost(x0, y0, rect_x, rect_y, el_x, el_y)) {
-    x = x0;
-    y = y0;
-    z = z0;
-    sx = sx0;
+  x0 += L*proton.sx + L*0.5*HKICK*beam_energy/proton.pz; // length * initial slope + length * half of angle (from geometry) * correction due to energy loss
+  y0 += L*proton.sy;
+  sx0 += HKICK*beam_energy/proton.pz;
+  if (!aperture.IsChecked() || !aperture.IsLost(Value(x0), Value(y0))) {
+    proton.x = x0;
+    proton.y = y0;
+    proton.z = z0;
+    proton.sx = sx0;
   } else {
-    lost_protons.push_back(std::vector<double>{px, py, pz});
+    proton.is_lost = true;
   }
 
-  DoShift(HorizontalKicker(iterators.GetIt("HKICKER_it"), 0), "+");
+  DoShift(proton, perturbation, +1);
 }
 
-void ProtonTransport::simple_vertical_kicker(double L, double VKICK, double rect_x, double rect_y, double el_x, double el_y){
-  iterators.IncreaseItByOne("VKICKER_it");
-  //std::cout << "VKICKER" << iterators.GetIt("VKICKER_it") << std::endl;
-  ApplyStrengthRatio(VerticalKicker(iterators.GetIt("VKICKER_it"), 0), VKICK);
+template <class T>
+void ProtonTransport::simple_vertical_kicker(BasicProtonState<T>& proton, double L, double VKICK_nominal, const Aperture& aperture, const BasicElementPerturbation<T>& perturbation) const {
+  T VKICK = VKICK_nominal;
+  ApplyStrengthRatio(perturbation, VKICK);
 
   if (fabs(VKICK) < 1.e-15)
   {
-    simple_drift(L);
+    simple_drift(proton, L);
     return;
   }
-  DoShift(VerticalKicker(iterators.GetIt("VKICKER_it"), 0), "-");
-  double x0 = x;
-  double y0 = y;
-  double z0 = z;
-  double sy0 = sy;
+  DoShift(proton, perturbation, -1);
+  T x0 = proton.x;
+  T y0 = proton.y;
+  T z0 = proton.z;
+  T sy0 = proton.sy;
   z0 += L;
-  x0 += L*sx;
-  y0 += L*sy + L*0.5*VKICK*beam_energy/pz; // length * initial slope + length * half of angle (from geometry) * correction due to energy loss
-  sy0 += VKICK*beam_energy/pz;
-  if (!ProtonTransport::isLost(x0, y0, rect_x, rect_y, el_x, el_y)) {
-    x = x0;
-    y = y0;
-    z = z0;
-    sy = sy0;
+  x0 += L*proton.sx;
+  y0 += L*proton.sy + L*0.5*VKICK*beam_energy/proton.pz; // length * initial slope + length * half of angle (from geometry) * correction due to energy loss
+  sy0 += VKICK*beam_energy/proton.pz;
+  if (!aperture.IsChecked() || !aperture.IsLost(Value(x0), Value(y0))) {
+    proton.x = x0;
+    proton.y = y0;
+    proton.z = z0;
+    proton.sy = sy0;
   } else {
-    lost_protons.push_back(std::vector<double>{px, py, pz});
+    proton.is_lost = true;
   }
 
-  DoShift(VerticalKicker(iterators.GetIt("VKICKER_it"), 0), "+"); 
+  DoShift(proton, perturbation, +1);
 }
 
 
@@ -391,19 +578,17 @@ void ProtonTransport::SetShift(const Magnet& magnet, const Shift& shift){ //1 qu
   magnet_to_shift[magnet] = shift;
 }
 
-void ProtonTransport::DoShift(const Magnet& m, const string& op) {
-  if (magnet_to_shift.find(m) != magnet_to_shift.end()) {
-    if (magnet_to_shift.at(m).GetXShift() != 0) x = ApplyOperation(x, magnet_to_shift.at(m).GetXShift(), op);
-    if (magnet_to_shift.at(m).GetYShift() != 0) y = ApplyOperation(y, magnet_to_shift.at(m).GetYShift(), op);
-    if (magnet_to_shift.at(m).GetZShift() != 0) {
-      z = ApplyOperation(z, magnet_to_shift.at(m).GetZShift(), op);
-      x = ApplyOperation(x, 
-                         ApplyOperation(sx, magnet_to_shift.at(m).GetZShift(), "*"), 
-                         "+");
-      y = ApplyOperation(y, 
-                         ApplyOperation(sy, magnet_to_shift.at(m).GetZShift(), "*"), 
-                         "+");
-    }
+/**
+\brief Move the proton into (sign = -1) or out of (sign = +1) the frame of a shifted element.
+*/
+template <class T>
+void ProtonTransport::DoShift(BasicProtonState<T>& proton, const BasicElementPerturbation<T>& perturbation, double sign) const {
+  if (perturbation.dx != 0) proton.x += sign * perturbation.dx;
+  if (perturbation.dy != 0) proton.y += sign * perturbation.dy;
+  if (perturbation.dz != 0) {
+    proton.z += sign * perturbation.dz;
+    proton.x += proton.sx * perturbation.dz;
+    proton.y += proton.sy * perturbation.dz;
   }
 }
 
@@ -411,9 +596,10 @@ void ProtonTransport::SetStrengthRatio(const Magnet& magnet, double ratio) {
   magnet_to_ratio[magnet] = ratio;
 }
 
-void ProtonTransport::ApplyStrengthRatio(const Magnet& m, double& strength) {
-  if (magnet_to_ratio.find(m) != magnet_to_ratio.end()) {
-    strength = strength * magnet_to_ratio.at(m);
+template <class T>
+void ProtonTransport::ApplyStrengthRatio(const BasicElementPerturbation<T>& perturbation, T& strength) const {
+  if (perturbation.strength_ratio != 1) {
+    strength = strength * perturbation.strength_ratio;
   }
 }
 
@@ -421,30 +607,30 @@ void ProtonTransport::SetProcessedFileName(const std::string& filename) {
   processed_filename = filename;
 }
 
-void ProtonTransport::simple_quadrupole(double L, double K1L, double rect_x, double rect_y, double el_x, double el_y, bool verbose=false){
-  iterators.IncreaseItByOne("QUADRUPOLE_it");
-  //std::cout << "Q" << iterators.GetIt("QUADRUPOLE_it") << std::endl;
-  ApplyStrengthRatio(Quadrupole(iterators.GetIt("QUADRUPOLE_it"), 0), K1L);
+template <class T>
+void ProtonTransport::simple_quadrupole(BasicProtonState<T>& proton, double L, double K1L_nominal, const Aperture& aperture, const BasicElementPerturbation<T>& perturbation, bool verbose) const {
+  T K1L = K1L_nominal;
+  ApplyStrengthRatio(perturbation, K1L);
 
   if (fabs(K1L) < 1.e-15)
   {
-    simple_drift(L);
+    simple_drift(proton, L);
     return;
   }
 
-  DoShift(Quadrupole(iterators.GetIt("QUADRUPOLE_it"), 0), "-"); 
+  DoShift(proton, perturbation, -1);
 
-  double x0 = x;
-  double y0 = y;
-  double z0 = z;
-  double sx0 = sx;
-  double sy0 = sy;
+  T x0 = proton.x;
+  T y0 = proton.y;
+  T z0 = proton.z;
+  T sx0 = proton.sx;
+  T sy0 = proton.sy;
 
   z0 += L;
-  double qk  = sqrt((fabs(K1L) * beam_energy)/(pz * L));
-  double qkl = qk * L;
-  double x_tmp = x0;
-  double y_tmp = y0;
+  T qk  = sqrt((fabs(K1L) * beam_energy)/(proton.pz * L));
+  T qkl = qk * L;
+  T x_tmp = x0;
+  T y_tmp = y0;
 
   if (K1L >= 0.) //horizontal focussing
   {
@@ -463,7 +649,7 @@ void ProtonTransport::simple_quadrupole(double L, double K1L, double rect_x, dou
   else //vertical focussing
   {
     fabs(y0)  > 1.e-15 ? y0 =  cos(qkl) * y0       : y0 = 0.;
-    fabs(sy0) > 1.e-15 ? y0 += sin(qkl) * sy / qk : y0 += 0.;
+    fabs(sy0) > 1.e-15 ? y0 += sin(qkl) * proton.sy / qk : y0 += 0.;
 
     fabs(x0)  > 1.e-15 ? x0 = cosh(qkl) * x0        : x0 = 0.;
     fabs(sx0) > 1.e-15 ? x0 += sinh(qkl) * sx0 / qk : x0 += 0.;
@@ -474,32 +660,32 @@ void ProtonTransport::simple_quadrupole(double L, double K1L, double rect_x, dou
     fabs(sx0) > 1.e-15 ? sx0 = cosh(qkl) * sx0          : sx0 = 0.;
     fabs(x_tmp)  > 1.e-15 ? sx0 += qk * sinh(qkl) * x_tmp : sx0 += 0.;
   }
-  if (!ProtonTransport::isLost(x0, y0, rect_x, rect_y, el_x, el_y)) {
-    x = x0;
-    y = y0;
-    z = z0;
-    sx = sx0;
-    sy = sy0;
+  if (!aperture.IsChecked() || !aperture.IsLost(Value(x0), Value(y0))) {
+    proton.x = x0;
+    proton.y = y0;
+    proton.z = z0;
+    proton.sx = sx0;
+    proton.sy = sy0;
   } else {
-    lost_protons.push_back(std::vector<double>{px, py, pz});
+    proton.is_lost = true;
   }
   
 
-  DoShift(Quadrupole(iterators.GetIt("QUADRUPOLE_it"), 0), "+"); 
+  DoShift(proton, perturbation, +1);
 
 
 // std::cout<<numb_of_obj_uses<<'\n';
   
   if (!verbose) return;
   cout << "QUADRUPOLE\t";
-  cout << "z [m]: " << z;
-  cout << "\tx [mm]: " << x*1.e3; 
-  cout << "\ty [mm]: " << y*1.e3;
-  cout << "\tpx [GeV]: " << px;
-  cout << "\tpy [GeV]: " << py;
-  cout << "\tpz [GeV]: " << pz;
-  cout << "\tsx: " << sx;
-  cout << "\tsy: " << sy << endl;
+  cout << "z [m]: " << proton.z;
+  cout << "\tx [mm]: " << proton.x*1.e3; 
+  cout << "\ty [mm]: " << proton.y*1.e3;
+  cout << "\tpx [GeV]: " << proton.px;
+  cout << "\tpy [GeV]: " << proton.py;
+  cout << "\tpz [GeV]: " << proton.pz;
+  cout << "\tsx: " << proton.sx;
+  cout << "\tsy: " << proton.sy << endl;
 }
 
 /**
@@ -508,6 +694,7 @@ void ProtonTransport::simple_quadrupole(double L, double K1L, double rect_x, dou
 Twiss files may provide 
 */
 void ProtonTransport::PrepareBeamline(bool verbose=false, bool is_default=false){
+  StageTimer timer(run_report(), Stage::kPrepareBeamline);
 
   vector <string> sorted_param; //type, S, L, HKICK, VKICK, K0L, K1L, K2L, K3L, APERTYPE, APER_1, APER_2, APER_3, APER_4, X, Y, PX, PY
   vector <string> unsorted_name;
@@ -582,9 +769,41 @@ void ProtonTransport::PrepareBeamline(bool verbose=false, bool is_default=false)
     
   }
 
+  beamline = std::make_shared<const std::vector<BeamElement>>(CompileBeamline(element));
   if (is_default) SetPositions();
 }
 
+/**
+\brief PrepareBeamline(verbose, true) through the compiled lattice artifact processed_filename + ".lattice".
+
+If the artifact was built from the current content of the Twiss file (same FNV-1a hash)
+it is memory-mapped and the element table and magnets are taken from it without parsing.
+Otherwise the Twiss file is parsed and the artifact is rebuilt for the next process.
+*/
+void ProtonTransport::PrepareBeamlineFromArtifact(bool verbose=false){
+  StageTimer timer(run_report(), Stage::kPrepareBeamline);
+  uint64_t source_hash;
+  if (!HashFileContent(processed_filename, source_hash)) {cout << "ERROR! No file named: " << processed_filename << endl; return;}
+
+  std::string artifact_name = processed_filename + ".lattice";
+  MappedLattice lattice;
+  if (lattice.Open(artifact_name, source_hash)) {
+    const BeamElement* elements = lattice.GetElements();
+    beamline = std::make_shared<const std::vector<BeamElement>>(elements, elements + lattice.GetNumberOfElements());
+    magnets = lattice.GetMagnets();
+    return;
+  }
+
+  // timed by itself
+  timer.Stop();
+  PrepareBeamline(verbose, true);
+  timer.Start();
+  if (!beamline) return;
+  if (!WriteLatticeArtifact(artifact_name, source_hash, *beamline, magnets)) {
+    cout << "WARNING! Cannot write lattice artifact " << artifact_name << endl;
+  }
+}
+
 void ProtonTransport::SetPositions() {
   if (element.empty()) {
     std::cout << "Use PrepareBeamline() first!" << std::endl;
@@ -616,19 +835,312 @@ void ProtonTransport::SetMagnets(const std::vector<Magnet>& magnets_) {
   magnets  = magnets_;
 }
 
-bool ProtonTransport::isLost(double x0, double y0, double rect_x, double rect_y, double el_x, double el_y) {
-  if ((x0*x0/(el_x*el_x) + y0*y0/(el_y*el_y) > 1) || ((fabs(x0) > rect_x) || (fabs(y0) > rect_y))) {
-    is_current_lost=true;
-    return 1;
-  } 
-  else {
-    is_current_lost=false;
+/**
+\brief Return the compiled beamline, to be shared with other transports using the same optics.
+*/
+std::shared_ptr<const std::vector<BeamElement>> ProtonTransport::GetBeamline() const {
+  return beamline;
+}
+
+/**
+\brief Use an already compiled beamline instead of calling PrepareBeamline().
+
+The beamline is immutable; shifts and strength ratios are kept per transport.
+*/
+void ProtonTransport::SetBeamline(std::shared_ptr<const std::vector<BeamElement>> beamline_) {
+  beamline = beamline_;
+}
+
+/**
+\brief Time every element kernel and the aperture checks on n_protons protons.
+
+Each kernel runs on the first element of its kind in the beamline, unperturbed; the
+protons are drawn once from a fixed stream (a few mm around the axis, Pythia-like
+slopes) and restored before every repetition, outside the timed region. The aperture
+checks are timed per APERTYPE present, as the scalar Aperture::IsLost of the element
+kernels and as the bundles run it, one lane at a time into the lost column.
+*/
+std::vector<BenchmarkResult> ProtonTransport::BenchmarkKernels(int warmup, int repetitions, int n_protons) const {
+  std::vector<BenchmarkResult> results;
+  if (!beamline) {cout << "Use PrepareBeamline() or SetBeamline() first!" << endl; return results;}
+  const std::vector<BeamElement>& elements = *beamline;
+
+  RunRandom random(2020, 0);
+  std::vector<ProtonState> initial(n_protons);
+  std::vector<double> xs(n_protons), ys(n_protons);
+  for (ProtonState& proton : initial) {
+    proton.px = random.Gaus(0., 0.6);
+    proton.py = random.Gaus(0., 0.6) + 140.e-6*6500.;
+    proton.pz = beam_energy * (1. - 0.2 * random.Uniform());
+    proton.sx = proton.px/proton.pz;
+    proton.sy = proton.py/proton.pz;
+    proton.x = random.Gaus(0., 2.e-3);
+    proton.y = random.Gaus(0., 2.e-3);
+  }
+  for (int i = 0; i < n_protons; i++) {
+    xs[i] = initial[i].x;
+    ys[i] = initial[i].y;
+  }
+  std::vector<ProtonState> protons;
+  auto reset = [&]() { protons = initial; };
+  const ElementPerturbation nominal;
+
+  auto first_of = [&](ElementKind kind) -> const BeamElement* {
+    for (const BeamElement& el : elements) if (el.kind == kind) return &el;
     return 0;
+  };
+  auto kernel = [&](const char* name, ElementKind kind, auto&& step) {
+    const BeamElement* el = first_of(kind);
+    if (!el) return;
+    results.push_back(RunBenchmark(name, "proton", n_protons, warmup, repetitions, [&]() {
+      for (ProtonState& proton : protons) step(proton, *el);
+    }, reset));
+  };
+  kernel("simple_drift", ElementKind::kDrift, [&](ProtonState& p, const BeamElement& el) {
+    simple_drift(p, el.length);
+  });
+  kernel("simple_quadrupole", ElementKind::kQuadrupole, [&](ProtonState& p, const BeamElement& el) {
+    simple_quadrupole(p, el.length, el.strength, el.aperture, nominal);
+  });
+  kernel("simple_rectangular_dipole", ElementKind::kRectangularDipole, [&](ProtonState& p, const BeamElement& el) {
+    simple_rectangular_dipole(p, el.length, el.strength, el.aperture, nominal);
+  });
+  kernel("simple_horizontal_kicker", ElementKind::kHorizontalKicker, [&](ProtonState& p, const BeamElement& el) {
+    simple_horizontal_kicker(p, el.length, el.strength, el.aperture, nominal);
+  });
+  kernel("simple_vertical_kicker", ElementKind::kVerticalKicker, [&](ProtonState& p, const BeamElement& el) {
+    simple_vertical_kicker(p, el.length, el.strength, el.aperture, nominal);
+  });
+
+  // the counts are kept so that the checks are not optimised away
+  volatile size_t n_lost = 0;
+  std::vector<unsigned char> lost(n_protons);
+  for (ApertureType type : {ApertureType::kCircle, ApertureType::kEllipse, ApertureType::kRectangle, ApertureType::kRectEllipse}) {
+    const BeamElement* with_type = 0;
+    for (const BeamElement& el : elements) if (el.aperture.type == type) {with_type = &el; break;}
+    if (!with_type) continue;
+    const Aperture& aperture = with_type->aperture;
+
+    std::string name = std::string("Aperture::IsLost ") + ApertureTypeName(type);
+    results.push_back(RunBenchmark(name, "proton", n_protons, warmup, repetitions, [&]() {
+      size_t n = 0;
+      for (int i = 0; i < n_protons; i++) n += aperture.IsLost(xs[i], ys[i]);
+      n_lost = n;
+    }));
+    name = std::string("Aperture::IsLost bundle lanes ") + ApertureTypeName(type);
+    results.push_back(RunBenchmark(name, "proton", n_protons, warmup, repetitions, [&]() {
+      const Aperture seg_aperture = aperture;
+      const double* __restrict x = xs.data();
+      const double* __restrict y = ys.data();
+      unsigned char* __restrict lane_lost = lost.data();
+#pragma GCC ivdep
+      for (int i = 0; i < n_protons; i++) lane_lost[i] |= seg_aperture.IsLost(x[i], y[i]);
+      n_lost = lost[n_protons - 1];
+    }, [&]() { std::fill(lost.begin(), lost.end(), 0); }));
   }
+  return results;
 }
 
-void ProtonTransport::simple_tracking(double obs_point){
 
+/**
+\brief Transport one proton from the IP through the beamline, element by element.
+
+\return true if the proton was lost or reached obs_point, i.e. if it is written to the output
+*/
+template <class T>
+bool ProtonTransport::track_proton(BasicProtonState<T>& proton, double obs_point, 
+                                   const std::vector<BasicElementPerturbation<T>>& perturbations) const {
+  return track_proton(proton, &obs_point, 1, (BasicProtonState<T>*)0, perturbations) == 1;
+}
+
+/**
+\brief Transport one proton element by element through n_planes observation planes (increasing z).
+
+planes[k], if given, gets the state of the proton after the first element past obs_points[k];
+a proton lost on the way is recorded lost at all remaining planes. Tracking stops after
+the last plane.
+\return number of planes recorded
+*/
+template <class T>
+size_t ProtonTransport::track_proton(BasicProtonState<T>& proton, const double* obs_points, size_t n_planes, 
+                                     BasicProtonState<T>* planes, 
+                                     const std::vector<BasicElementPerturbation<T>>& perturbations) const {
+  const std::vector<BeamElement>& elements = *beamline;
+
+  size_t next_plane = 0;
+  bool Observe = false, Observed = false;
+  for (unsigned int a=0; a<elements.size() && next_plane<n_planes; a++)
+  {  
+    const BeamElement& el = elements[a];
+    if (fabs(proton.z+el.length - obs_points[next_plane]) < 1.e-3 && !Observe && !Observed) {Observed = true; Observe = true;}
+    else Observe = false;
+    switch (el.kind)
+    {
+      case ElementKind::kMarker:
+        ProtonTransport::Marker(proton, Observe); //Marker(true) will return proton x, y, z, px, py, pz at position of marker
+        break;
+      case ElementKind::kDrift:
+        ProtonTransport::simple_drift(proton, el.length, Observe);
+        break;
+      case ElementKind::kRectangularDipole:
+        ProtonTransport::simple_rectangular_dipole(proton, el.length, el.strength, el.aperture, perturbations[a]); //L, K0L
+        break;
+      case ElementKind::kHorizontalKicker:
+        ProtonTransport::simple_horizontal_kicker(proton, el.length, el.strength, el.aperture, perturbations[a]); //L, HKICK
+        break;
+      case ElementKind::kVerticalKicker:
+        ProtonTransport::simple_vertical_kicker(proton, el.length, el.strength, el.aperture, perturbations[a]); //L, VKICK
+        break;
+      case ElementKind::kQuadrupole:
+        ProtonTransport::simple_quadrupole(proton, el.length, el.strength, el.aperture, perturbations[a], Observe); //L, K1L
+        break;
+      case ElementKind::kCollimator:
+      {
+        // 15 * sigma at 150.53 m, 35 * sigma at 184.857 m
+        double rect_x = el.collimator == CollimatorSlot::kCollimator150m ? 15 * sigma1 : 35 * sigma2;
+        ProtonTransport::simple_drift(proton, el.length, false, WithHalfGapX(el.aperture, rect_x)); 
+        break;
+      }
+    }
+
+    if (proton.is_lost) {
+      proton.lost_element = a;
+      for (; next_plane<n_planes; next_plane++) if (planes) planes[next_plane] = proton;
+      return next_plane;
+    }
+
+    if (proton.z > 130. && !proton.beampipes_are_separated)
+    {
+      proton.beampipes_are_separated = true;
+      proton.x += BeampipeSeparation;
+    }
+    while (next_plane<n_planes && proton.z > obs_points[next_plane])
+    {
+      if (planes) planes[next_plane] = proton;
+      next_plane++;
+      Observed = false;
+    }
+  }
+  return next_plane;
+}
+
+namespace {
+
+TrackedProton MakeTrackedProton(const PythiaSample& input, int evt, double obs_point,
+                                double x, double sx, double y, double sy, double z, bool is_lost) {
+  TrackedProton row;
+  row.process_code = input.process_code[evt];
+  row.px = input.px[evt];
+  row.py = input.py[evt];
+  row.pz = input.pz[evt];
+  row.e = input.e[evt];
+  row.x = x - sx*(z - obs_point);
+  row.y = y - sy*(z - obs_point);
+  row.sx = sx;
+  row.sy = sy;
+  row.ev_id = evt;
+  row.is_lost = is_lost;
+  return row;
+}
+
+} // namespace
+
+/**
+\brief Track events [first, last) of the input and buffer their output rows and lost protons.
+
+Only the output arguments are written, so disjoint ranges can be tracked concurrently.
+*/
+void ProtonTransport::track_events(const PythiaSample& input, int first, int last, double obs_point, 
+                                   const TransferLine* transfer_line,
+                                   std::vector<TrackedProton>& output, 
+                                   LossRecords& lost) const {
+  std::vector<std::vector<TrackedProton>> plane_output(1);
+  plane_output[0].swap(output);
+  track_events(input, first, last, std::vector<double>{obs_point}, transfer_line, plane_output, lost);
+  output.swap(plane_output[0]);
+}
+
+/**
+\brief Track events [first, last) once through all observation planes.
+
+output[k] gets the rows at obs_points[k], extrapolated to the plane; transfer_line, if
+given, must be built for the same planes. A lost proton enters lost once.
+*/
+void ProtonTransport::track_events(const PythiaSample& input, int first, int last, 
+                                   const std::vector<double>& obs_points, 
+                                   const TransferLine* transfer_line,
+                                   std::vector<std::vector<TrackedProton>>& output, 
+                                   LossRecords& lost) const {
+  size_t n_planes = obs_points.size();
+  output.resize(n_planes);
+
+  if (UseBatchTracking) {
+    BatchTransport batch(*transfer_line);
+    ProtonBundle bundle;
+    bundle.Resize(last - first);
+    for (int evt=first; evt<last; evt++)
+    {
+      double px0 = input.px[evt];
+      double py0 = input.py[evt] + 140.e-6*6500.;
+      double pz0 = input.pz[evt];
+      bundle.Set(evt - first, px0/pz0, py0/pz0, pz0);
+    }
+
+    batch.Track(bundle);
+
+    for (size_t k=0; k<n_planes; k++)
+    {
+      const ProtonBundle::Station& station = bundle.stations[k];
+      for (int evt=first; evt<last; evt++)
+      {
+        int i = evt - first;
+        if (station.recorded[i]) {
+          output[k].push_back(MakeTrackedProton(input, evt, obs_points[k], station.x[i], station.sx[i], 
+                                                station.y[i], station.sy[i], station.z[i], station.lost[i]));
+        }
+      }
+    }
+    for (int evt=first; evt<last; evt++)
+    {
+      int i = evt - first;
+      if (bundle.lost[i]) lost.Add(evt, bundle.lost_element[i], bundle.z[i], bundle.x[i], bundle.y[i], 
+                                   input.px[evt], input.py[evt] + 140.e-6*6500., input.pz[evt]);
+    }
+    return;
+  }
+
+  std::vector<ProtonState> planes(n_planes);
+  for (int evt=first; evt<last; evt++)
+  {
+    ProtonState proton;
+    proton.px = input.px[evt];
+    proton.py = input.py[evt] + 140.e-6*6500.;
+    proton.pz = input.pz[evt];
+    proton.sx = proton.px/proton.pz;
+    proton.sy = proton.py/proton.pz;
+
+    size_t n_recorded;
+    if (transfer_line) {
+      n_recorded = transfer_line->Track(proton.x, proton.sx, proton.y, proton.sy, proton.z, proton.pz, proton.is_lost, 
+                                        proton.lost_element, planes.data());
+    } else {
+      n_recorded = track_proton(proton, obs_points.data(), n_planes, planes.data(), perturbations);
+    }
+
+    for (size_t k=0; k<n_recorded; k++)
+    {
+      const ProtonState& plane = planes[k];
+      output[k].push_back(MakeTrackedProton(input, evt, obs_points[k], plane.x, plane.sx, 
+                                            plane.y, plane.sy, plane.z, plane.is_lost));
+    }
+    if (proton.is_lost) lost.Add(evt, proton.lost_element, proton.z, proton.x, proton.y, proton.px, proton.py, proton.pz);
+  }
+}
+
+/**
+\brief Collimator openings are given in units of the beam size at 150.53 m and 184.857 m.
+*/
+void ProtonTransport::compute_collimator_sigmas(){
   double gamma = 6927.628566; // [no units]
   double beta1 = 745.7519114; // [m]
   double beta2 = 219.0364112; // [m]
@@ -637,268 +1149,662 @@ void ProtonTransport::simple_tracking(double obs_point){
   sigma2 = sqrt(beta2 * epsilon / gamma);
   std::cout << "Sigma1 = " << 5 * sigma1 << std::endl;
   std::cout << "Sigma2 = " << 5 * sigma2 << std::endl;
+}
 
-  int m_process_code;
-  vector<float> *m_px;
-  vector<float> *m_py;
-  vector<float> *m_pz;
-  vector<float> *m_e;
-  
-  TBranch        *b_process_code;   //!
-  TBranch        *b_px;   //!
-  TBranch        *b_py;   //!
-  TBranch        *b_pz;   //!
-  TBranch        *b_e;   //!
+namespace {
 
-  m_px = 0;
-  m_py = 0;
-  m_pz = 0;
-  m_e = 0;
+// Events [first, last) of the input, ready to be tracked.
+struct InputChunk {
+  const PythiaSample* input;
+  int first;
+  int last;
+  size_t index;
+};
 
+// Output rows (one list per observation plane) and lost protons of one tracked chunk.
+struct TrackedChunk {
+  size_t index;
+  std::vector<std::vector<TrackedProton>> rows;
+  LossRecords lost;
+};
 
-  TFile *f = new TFile("pythia8_13TeV_protons_100k.root", "READ");
-  TTree * ntuple;
-  f->GetObject("ntuple",ntuple);
+} // namespace
 
-  TH1F * h_sigma;
-  f->GetObject("sigma",h_sigma);
-  TH1F * h_eff;
-  f->GetObject("efficiency",h_eff);
+/**
+\brief Read, track and write the input concurrently, in chunks of 4096 events.
 
-  gROOT->ProcessLine("#include <vector>");
+A reader thread decodes the input (see StreamPythiaSample), NumberOfThreads workers track
+the decoded chunks, and a writer thread streams the rows to writer in chunk order, so
+the output is the same as without the pipeline. Both queues hold two chunks per worker:
+a reader ahead of the trackers, or trackers ahead of the writer, waits instead of
+buffering the whole sample. Fills lost_protons; returns the input.
+*/
+std::shared_ptr<const PythiaSample> ProtonTransport::track_pipelined(const std::vector<double>& obs_points, 
+                                                                     const TransferLine* transfer_line, OutputWriter& writer, 
+                                                                     const std::vector<std::string>& sample_names, 
+                                                                     const std::vector<std::string>& sample_titles){
+  const int chunk_size = 4096;
+  unsigned n_workers = std::max(1u, NumberOfThreads);
+  BoundedQueue<InputChunk> to_track(2 * n_workers);
+  BoundedQueue<TrackedChunk> to_write(2 * n_workers);
+
+  // the input and output ROOT files are used from the reader and the writer thread at once
+  ROOT::EnableThreadSafety();
+
+  std::shared_ptr<const PythiaSample> sample;
+  std::thread reader([&]() {
+    size_t index = 0;
+    uint64_t bytes_read = 0;
+    // decoding is timed, waiting for the trackers is not
+    StageTimer timer(run_report(), Stage::kReadInput);
+    sample = StreamPythiaSample(input_file_name, UseInputSidecar, chunk_size, 
+                                [&](const PythiaSample& input, size_t first, size_t last) {
+      timer.Stop();
+      bool pushed = to_track.Push(InputChunk{&input, (int)first, (int)last, index++});
+      timer.Start();
+      return pushed;
+    }, &bytes_read);
+    timer.Stop();
+    if (run_report()) run_report()->AddBytesRead(bytes_read);
+    to_track.Close();
+  });
+
+  std::thread output([&]() {
+    writer.BeginSamples(sample_names, sample_titles);
+    std::map<size_t, TrackedChunk> waiting;
+    size_t next = 0;
+    TrackedChunk chunk;
+    while (to_write.Pop(chunk)) {
+      size_t index = chunk.index;
+      waiting[index] = std::move(chunk);
+      for (auto it = waiting.find(next); it != waiting.end(); it = waiting.find(++next)) {
+        StageTimer timer(run_report(), Stage::kWriteOutput);
+        for (size_t k=0; k<it->second.rows.size(); k++) writer.AppendRows(k, it->second.rows[k]);
+        lost_protons.Append(it->second.lost);
+        waiting.erase(it);
+      }
+    }
+    StageTimer timer(run_report(), Stage::kWriteOutput);
+    writer.EndSamples();
+  });
+
+  try {
+    ParallelFor(n_workers, n_workers, [&](size_t) {
+      InputChunk chunk;
+      while (to_track.Pop(chunk)) {
+        TrackedChunk tracked;
+        tracked.index = chunk.index;
+        {
+          StageTimer timer(run_report(), Stage::kTracking);
+          track_events(*chunk.input, chunk.first, chunk.last, obs_points, transfer_line, tracked.rows, tracked.lost);
+        }
+        if (!to_write.Push(std::move(tracked))) return;
+      }
+    });
+  } catch (...) {
+    to_track.Close();
+    to_write.Close();
+    reader.join();
+    output.join();
+    throw;
+  }
+  to_write.Close();
+  reader.join();
+  output.join();
+  return sample;
+}
 
-  ntuple->SetMakeClass(1);
+void ProtonTransport::simple_tracking(double obs_point){
+  simple_tracking(std::vector<double>{obs_point});
+}
 
-  ntuple->SetBranchAddress("process_code", &m_process_code, &b_process_code);
-  ntuple->SetBranchAddress("px", &m_px, &b_px);
-  ntuple->SetBranchAddress("py", &m_py, &b_py);
-  ntuple->SetBranchAddress("pz", &m_pz, &b_pz);
-  ntuple->SetBranchAddress("e", &m_e, &b_e);
+/**
+\brief Track the input once and record the protons at several observation planes.
 
-  int nevents = ntuple->GetEntries();
-  
-  int n_process_code,n_ev_id;
-  float n_px, n_py, n_pz, n_e;
-  float n_x, n_y, n_sx, n_sy;
-  bool n_is_lost;
+Each proton continues past the earlier planes, so the cost is that of tracking to the
+last one. With a single plane the output tree is "ntuple" as before; with several,
+plane obs_points[k] goes to its own tree "ntuple_<obs>m" (e.g. ntuple_205m, ntuple_217m)
+with the same branches. Lost protons are written lost to every plane behind the loss.
+*/
+void ProtonTransport::simple_tracking(const std::vector<double>& obs_points_in){
+  StageTimer run_timer(run_report(), Stage::kRun);
 
+  std::vector<double> obs_points = obs_points_in;
+  std::sort(obs_points.begin(), obs_points.end());
+  obs_points.erase(std::unique(obs_points.begin(), obs_points.end()), obs_points.end());
+  if (obs_points.empty()) {cout << "No observation point given!" << endl; return;}
+  size_t n_planes = obs_points.size();
 
+  compute_collimator_sigmas();
 
-  FileName* fn = new FileName(processed_filename, !magnet_to_shift.empty(), !magnet_to_ratio.empty());
-  fn->ProcessFileName();
-  optics_root_file_name = fn->GetOutputFileName();
-
-  std::cout << "The ROOT output file: " << optics_root_file_name << std::endl; 
-  TFile * p = new TFile(optics_root_file_name.c_str(),"recreate");
-
-  TH1F * cs = new TH1F("sigma", "cross-section [mb]", 1, 0., 1.);
-  TH1F * efficiency = new TH1F("efficiency", "efficiency", 1, 0., 1.);
-  TTree * tree = new TTree("ntuple", "ntuple");
-  tree->Branch("process_code", &n_process_code);
-//  tree->Branch("n_particles", &n_particles);
-  tree->Branch("px", &n_px);
-  tree->Branch("py", &n_py);
-  tree->Branch("pz", &n_pz);
-  tree->Branch("e", &n_e);
-  tree->Branch("x", &n_x);
-  tree->Branch("y", &n_y);
-  tree->Branch("sx", &n_sx);
-  tree->Branch("sy", &n_sy);
-  tree->Branch("ev_id", &n_ev_id);
-  tree->Branch("is_lost", &n_is_lost);
-  
-  for (int evt=0; evt<nevents; evt++)
-  {
-    //std::cout << "\n\nRESET\n\n" << std::endl;
-    iterators = {};
-    ntuple->GetEntry(evt);
+  if (!beamline) {cout << "Use PrepareBeamline() or SetBeamline() first!" << endl; return;}
+  const std::vector<BeamElement>& elements = *beamline;
+  perturbations = ResolvePerturbations(elements, magnet_to_shift, magnet_to_ratio);
 
-//  for (double E=6500.; E<=1.00001*7000.; E += 100.)
-  {
-  //  for (double x0 = 2.e-5; x0 >= -1.000001*2.e-5; x0 -= 1.e-5)
-    {
-    // for (double y0 = -2.e-5; y0 <= 1.000001*2.e-5; y0 += 1.e-5)
-      {
-      //  for (double px0 = 0.4e0; px0 >=-1.000001*0.4e0; px0 -= 0.2e0)
-        {
-        //  for (double py0 = -0.4e0; py0 <=1.000001*0.4e0; py0 += 0.2e0)
-          {
-//            double z0 = 0.;
-//double E=7000., x0=0., y0=0., px0=0., py0=0.;            
- //           cout << E << "\t" << x0 << "\t" << y0 << "\t" << z0 << "\t" << px0 << "\t" << py0 << "\t";
+  TransferLine* transfer_line = 0;
+  if (UseTransferMaps || UseBatchTracking) {
+    transfer_line = new TransferLine(elements, perturbations, obs_points, beam_energy, BeampipeSeparation, 
+                                     15 * sigma1, 35 * sigma2);
+  }
 
-  x = 0.;
-  y = 0.;
-  z = 0.;
-  px = m_px->at(0);
-  py = m_py->at(0) + 140.e-6*6500.;
-  pz = m_pz->at(0);
-  sx = px/pz;
-  sy = py/pz;
+  lost_protons.Clear();
+  loss_map = LossMap(elements.size());
 
-  BeampipesAreSeparated = false;
+  FileName* fn = new FileName(processed_filename, !magnet_to_shift.empty(), !magnet_to_ratio.empty(), RunId);
+  fn->ProcessFileName();
+  std::string root_file_name = fn->GetOutputFileName();
+  delete fn;
+  optics_root_file_name = OutputWriter::OutputFileName(root_file_name, OutputSettings.format);
 
-  bool Observe = false, Observed = false;
-  for (unsigned int a=0; a<element.size(); a++)
-  {  
-    if (fabs(z+stod(element[a].at(2)) - obs_point) < 1.e-3 && !Observe && !Observed) {Observed = true; Observe = true;}
-    else Observe = false;
-    if ((element[a].at(0)).compare("\"MARKER\"") == 0) ProtonTransport::Marker(Observe); //Marker(true) will return proton x, y, z, px, py, pz at position of marker
-    else if ((element[a].at(0)).compare("\"DRIFT\"") == 0) {
-      ProtonTransport::simple_drift(stod(element[a].at(2)), Observe); // L
-    }
-    else if ((element[a].at(0)).compare("\"RBEND\"") == 0) { 
-      ProtonTransport::simple_rectangular_dipole(stod(element[a].at(2)), stod(element[a].at(5)), 
-                                                 stod(element[a].at(10)), stod(element[a].at(11)), stod(element[a].at(12)), stod(element[a].at(13))); //L, K0L
-    }  
-    else if ((element[a].at(0)).compare("\"HKICKER\"") == 0) { 
-      ProtonTransport::simple_horizontal_kicker(stod(element[a].at(2)), stod(element[a].at(3)),
-                                                stod(element[a].at(10)), stod(element[a].at(11)), stod(element[a].at(12)), stod(element[a].at(13))); //L, HKICK
-    }
-    else if ((element[a].at(0)).compare("\"VKICKER\"") == 0) { 
-      ProtonTransport::simple_vertical_kicker(stod(element[a].at(2)), stod(element[a].at(4)),
-                                              stod(element[a].at(10)), stod(element[a].at(11)), stod(element[a].at(12)), stod(element[a].at(13))); //L, VKICK
-    }
-    else if ((element[a].at(0)).compare("\"QUADRUPOLE\"") == 0) { 
-      ProtonTransport::simple_quadrupole(stod(element[a].at(2)), stod(element[a].at(6)),
-                                         stod(element[a].at(10)), stod(element[a].at(11)), stod(element[a].at(12)), stod(element[a].at(13)), Observe); //L, K1L 
-    }
-    else if ((element[a].at(0)).compare("\"MULTIPOLE\"") == 0)
-    {
-      if ( fabs(stod(element[a].at(5))) > 1.e-10 )
-      {
-        cout << "Warning! MULTIPOLE taken as rectangular dipole! Check in twiss files if this is correct! Position: " << element[a].at(1) << endl;
-        ProtonTransport::simple_rectangular_dipole(stod(element[a].at(2)), stod(element[a].at(5)), 
-                                                   stod(element[a].at(10)), stod(element[a].at(11)), stod(element[a].at(12)), stod(element[a].at(13))); //L, K0L
-      }
-      else if ( fabs(stod(element[a].at(3))) > 1.e-10 )
-      {
-        cout << "Warning! MULTIPOLE taken as horizontal kicker! Check in twiss files if this is correct! Position: " << element[a].at(1) << endl;
-        ProtonTransport::simple_horizontal_kicker(stod(element[a].at(2)), stod(element[a].at(3)),
-                                                  stod(element[a].at(10)), stod(element[a].at(11)), stod(element[a].at(12)), stod(element[a].at(13))); //L, HKICK
-      }
-      else if ( fabs(stod(element[a].at(4))) > 1.e-10 )
-      {
-        cout << "Warning! MULTIPOLE taken as vertical kicker! Check in twiss files if this is correct! Position: " << element[a].at(1) << endl;
-        ProtonTransport::simple_vertical_kicker(stod(element[a].at(2)), stod(element[a].at(4)),
-                                                stod(element[a].at(10)), stod(element[a].at(11)), stod(element[a].at(12)), stod(element[a].at(13))); //L, VKICK
-      }
-      else if ( fabs(stod(element[a].at(6))) > 1.e-10 )
-      {
-        cout << "Warning! MULTIPOLE taken as quadrupole! Check in twiss files if this is correct! Position: " << element[a].at(1) << endl;
-        ProtonTransport::simple_quadrupole(stod(element[a].at(2)), stod(element[a].at(6)),
-                                           stod(element[a].at(10)), stod(element[a].at(11)), stod(element[a].at(12)), stod(element[a].at(13)), Observe); //L, K1L 
-      }
-      else
-      {
-//TODO        cout << "Warning! MULTIPOLE taken as drift! Check in twiss files if this is correct! Position: " << element[a].at(1) << endl;
-        ProtonTransport::simple_drift(stod(element[a].at(2)), Observe); // L
-      }
+  std::unique_ptr<OutputWriter> writer = OutputWriter::Create(OutputSettings);
+  if (OutputSettings.format != OutputFormat::kNone) {
+    std::cout << "The " << OutputFormatName(OutputSettings.format) << " output file: " << optics_root_file_name << std::endl; 
+  }
+  if (!writer->Open(optics_root_file_name)) {delete transfer_line; return;}
 
-    }
-    else if (fabs(stod(element[a].at(1)) - 150.53) < 1e-10) 
+  if (UseBatchTracking) std::cout << "Batch tracking with " << BatchTransport::GetInstructionSet() << " kernels" << std::endl;
+
+  // with several planes, plane obs_points[k] is sample "ntuple_<obs>m"
+  std::vector<std::string> sample_names(n_planes, "ntuple"), sample_titles(n_planes, "ntuple");
+  for (size_t k=0; n_planes > 1 && k<n_planes; k++)
+  {
+    std::ostringstream plane;
+    plane << obs_points[k];
+    sample_names[k] += "_" + plane.str() + "m";
+    sample_titles[k] += " at " + plane.str() + " m";
+  }
+
+  std::shared_ptr<const PythiaSample> sample;
+  if (UsePipeline) {
+    sample = track_pipelined(obs_points, transfer_line, *writer, sample_names, sample_titles);
+  } else {
+    // the input is decoded once per process and shared by all transports
     {
-      double rect_x = 15 * sigma1;
-      double el_x =  stod(element[a].at(12));
-      //double el_x =  5 * sigma1;
-      //double rect_x = stod(element[a].at(10));
-      //double el_x = stod(element[a].at(12));
-      ProtonTransport::simple_drift(stod(element[a].at(2)), false, rect_x, stod(element[a].at(11)), el_x, stod(element[a].at(13)), true); 
+      StageTimer timer(run_report(), Stage::kReadInput);
+      uint64_t bytes_read = 0;
+      sample = LoadPythiaSample(input_file_name, UseInputSidecar, &bytes_read);
+      if (run_report()) run_report()->AddBytesRead(bytes_read);
     }
-    else if (fabs(stod(element[a].at(1)) - 184.857) < 1e-10)
+    const PythiaSample& input = *sample;
+    int nevents = input.Size();
+
+    // chunks of events are tracked concurrently and their buffers written in chunk order,
+    // so the tree is the same for any number of threads
+    const int chunk_size = 4096;
+    int n_chunks = (nevents + chunk_size - 1) / chunk_size;
+    std::vector<std::vector<std::vector<TrackedProton>>> chunk_output(n_chunks);
+    std::vector<LossRecords> chunk_lost(n_chunks);
+    ParallelFor(n_chunks, NumberOfThreads, [&](size_t c) {
+      StageTimer timer(run_report(), Stage::kTracking);
+      int first = c * chunk_size;
+      int last = std::min(nevents, first + chunk_size);
+      track_events(input, first, last, obs_points, transfer_line, chunk_output[c], chunk_lost[c]);
+    });
+
+    // every plane is handed to the writer as whole columns
+    StageTimer timer(run_report(), Stage::kWriteOutput);
+    for (size_t k=0; k<n_planes; k++)
     {
-      // 35 * sigma 
-      double rect_x = 35 * sigma2;
-      double el_x = stod(element[a].at(12));
-      //double el_x =  5 * sigma2;
-      //double rect_x = stod(element[a].at(10));
-      //double el_x = stod(element[a].at(12));
-      ProtonTransport::simple_drift(stod(element[a].at(2)), false, rect_x, stod(element[a].at(11)), el_x, stod(element[a].at(13)), true); 
+      TrackedColumns columns;
+      for (int c=0; c<n_chunks; c++) columns.Append(chunk_output[c][k]);
+      writer->WriteSample(sample_names[k], sample_titles[k], columns);
     }
-/*
-   The following elements are taken as a drift (if L!=0) or monitor (if L=0):
-      * SOLENOID (TODO)
-      * RCOLLIMATOR (TODO)
-      * MONITOR (L=0 anyway)
-      * PLACEHOLDER
-      * INSTRUMENT
+    for (int c=0; c<n_chunks; c++) lost_protons.Append(chunk_lost[c]);
+  }
+  loss_map.AddTracked(sample->Size());
+  loss_map.Fill(lost_protons);
+  if (run_report()) run_report()->AddElementCounts(elements, obs_points.back(), sample->Size(), lost_protons);
+
+  {
+    StageTimer timer(run_report(), Stage::kCloseOutput);
+    writer->WriteSummary(sample->cross_section, sample->efficiency);
+    if (!writer->Close()) std::cout << "WARNING! The output " << optics_root_file_name << " is incomplete." << std::endl;
+    if (run_report()) run_report()->AddBytesWritten(writer->GetFileSize());
+  }
+  delete transfer_line;
+  std::cout << "Number of lost protons: " << lost_protons.Size() << '\n';
+
+  StageTimer timer(run_report(), Stage::kWriteOutput);
+  std::string loss_map_name = root_file_name.substr(0, root_file_name.rfind(".root")) + ".lossmap";
+  if (!WriteLossMap(loss_map_name, loss_map, RunId)) std::cout << "WARNING! Cannot write loss map " << loss_map_name << std::endl;
+
+}
+
+/**
+\brief Compare this lattice with the default one in lockstep, without writing or reading any ROOT output.
+
+Every input proton is tracked through the default lattice (same beamline, no shifts and
+no strength changes) and through this one back to back, and the differences
+default - perturbed of the float output values go straight into the returned statistics,
+keyed d_x, d_sx, d_y, d_sy, d_px, d_py, d_pz as in DistributionsDifference. Events are
+paired by ev_id and only events written by both lattices enter. Tracking uses transfer
+maps (bundles if SetUseBatchTracking) and NumberOfThreads threads; the result does not
+depend on the number of threads.
 */
-    else
+std::map<std::string, RunningStatistics> ProtonTransport::CompareWithDefault(double obs_point){
+  StageTimer run_timer(run_report(), Stage::kRun);
+  std::map<std::string, RunningStatistics> var_name_to_stats;
+
+  compute_collimator_sigmas();
+
+  if (!beamline) {cout << "Use PrepareBeamline() or SetBeamline() first!" << endl; return var_name_to_stats;}
+  const std::vector<BeamElement>& elements = *beamline;
+  perturbations = ResolvePerturbations(elements, magnet_to_shift, magnet_to_ratio);
+
+  TransferLine default_line(elements, std::vector<ElementPerturbation>(elements.size()), obs_point, beam_energy, 
+                            BeampipeSeparation, 15 * sigma1, 35 * sigma2);
+  TransferLine line(elements, perturbations, obs_point, beam_energy, BeampipeSeparation, 
+                    15 * sigma1, 35 * sigma2);
+
+  std::shared_ptr<const PythiaSample> sample;
+  {
+    StageTimer timer(run_report(), Stage::kReadInput);
+    uint64_t bytes_read = 0;
+    sample = LoadPythiaSample(input_file_name, UseInputSidecar, &bytes_read);
+    if (run_report()) run_report()->AddBytesRead(bytes_read);
+  }
+  const PythiaSample& input = *sample;
+  int nevents = input.Size();
+  lost_protons.Clear();
+  loss_map = LossMap(elements.size());
+  loss_map.AddTracked(nevents);
+
+  const char* var_names[] = {"d_x", "d_sx", "d_y", "d_sy", "d_px", "d_py", "d_pz"};
+  const int n_vars = 7;
+
+  const int chunk_size = 4096;
+  int n_chunks = (nevents + chunk_size - 1) / chunk_size;
+  std::vector<std::vector<RunningStatistics>> chunk_stats(n_chunks, std::vector<RunningStatistics>(n_vars));
+  std::vector<LossRecords> chunk_lost(n_chunks), chunk_default_lost(n_chunks);
+  ParallelFor(n_chunks, NumberOfThreads, [&](size_t c) {
+    StageTimer tracking_timer(run_report(), Stage::kTracking);
+    int first = c * chunk_size;
+    int last = std::min(nevents, first + chunk_size);
+    std::vector<TrackedProton> rows1, rows2;
+    track_events(input, first, last, obs_point, &default_line, rows1, chunk_default_lost[c]);
+    track_events(input, first, last, obs_point, &line, rows2, chunk_lost[c]);
+    tracking_timer.Stop();
+
+    // both row lists are ordered by ev_id
+    StageTimer compare_timer(run_report(), Stage::kCompare);
+    std::vector<RunningStatistics>& stats = chunk_stats[c];
+    for (size_t i1 = 0, i2 = 0; i1 < rows1.size() && i2 < rows2.size(); )
     {
-      if (stod(element[a].at(2)) > 1.e-10) ProtonTransport::simple_drift(stod(element[a].at(2)));
-      else ProtonTransport::Marker(Observe);
+      const TrackedProton& r1 = rows1[i1];
+      const TrackedProton& r2 = rows2[i2];
+      if (r1.ev_id < r2.ev_id) {i1++; continue;}
+      if (r2.ev_id < r1.ev_id) {i2++; continue;}
+      stats[0].Fill(r1.x - r2.x);
+      stats[1].Fill(r1.sx - r2.sx);
+      stats[2].Fill(r1.y - r2.y);
+      stats[3].Fill(r1.sy - r2.sy);
+      stats[4].Fill(r1.px - r2.px);
+      stats[5].Fill(r1.py - r2.py);
+      stats[6].Fill(r1.pz - r2.pz);
+      i1++;
+      i2++;
     }
+  });
 
-    if (is_current_lost) {
-      
+  for (int c=0; c<n_chunks; c++)
+  {
+    for (int v=0; v<n_vars; v++) var_name_to_stats[var_names[v]].Merge(chunk_stats[c][v]);
+    lost_protons.Append(chunk_lost[c]);
+  }
+  loss_map.Fill(lost_protons);
+  if (run_report()) {
+    LossRecords default_lost;
+    for (int c=0; c<n_chunks; c++) default_lost.Append(chunk_default_lost[c]);
+    run_report()->AddElementCounts(elements, obs_point, nevents, default_lost);
+    run_report()->AddElementCounts(elements, obs_point, nevents, lost_protons);
+  }
+  return var_name_to_stats;
+}
 
-      n_process_code =  m_process_code;
-      n_px = m_px->at(0);
-      n_py = m_py->at(0);
-      n_pz = m_pz->at(0);
-      n_e = m_e->at(0);
-      n_x = x - sx*(z - obs_point);
-      n_y = y - sy*(z - obs_point);
-      n_sx = sx;
-      n_sy = sy;
-      n_ev_id=evt;
-      n_is_lost=is_current_lost;
-
-      tree->Fill();
-      
-      is_current_lost=false;
-      break;
+/**
+\brief Index in GetMagnets() of the magnet of every beamline element, -1 for other elements.
+*/
+std::vector<int> ProtonTransport::magnet_index_per_element() const {
+  std::map<Magnet, int> magnet_to_index;
+  for (size_t m = 0; m < magnets.size(); m++) magnet_to_index[magnets[m]] = m;
+
+  std::vector<int> magnet_of(beamline->size(), -1);
+  for (size_t a = 0; a < beamline->size(); a++)
+  {
+    std::string type = MagnetType((*beamline)[a].kind);
+    if (type.empty()) continue;
+    auto it = magnet_to_index.find(Magnet(type, (*beamline)[a].magnet_id, 0));
+    if (it != magnet_to_index.end()) magnet_of[a] = it->second;
+  }
+  return magnet_of;
+}
+
+/**
+\brief Jacobian of x, sx, y, sy at obs_point with respect to dx, dy, dz and strength ratio of every magnet.
+
+The element kernels are run with Dual numbers: the perturbation of every magnet from
+GetMagnets() is seeded as an independent variable at its current value (nominal unless
+SetShift/SetStrengthRatio were used), so one tracking pass per proton gives all
+derivatives. Lost protons do not enter. At most max_events input events are used
+(all if max_events <= 0), tracked on NumberOfThreads threads.
+*/
+SensitivityMatrix ProtonTransport::ComputeSensitivity(double obs_point, int max_events){
+  SensitivityMatrix matrix;
+
+  compute_collimator_sigmas();
+
+  if (!beamline) {cout << "Use PrepareBeamline() or SetBeamline() first!" << endl; return matrix;}
+  if (magnets.empty()) {cout << "Use SetPositions() or SetMagnets() first!" << endl; return matrix;}
+  const std::vector<BeamElement>& elements = *beamline;
+  perturbations = ResolvePerturbations(elements, magnet_to_shift, magnet_to_ratio);
+
+  for (size_t m = 0; m < magnets.size(); m++) {
+    for (const char* parameter : {":dx", ":dy", ":dz", ":strength_ratio"}) {
+      matrix.parameter_names.push_back(magnets[m].GetName() + parameter);
     }
+  }
+  const size_t n_parameters = matrix.parameter_names.size();
+
+  std::vector<int> magnet_of = magnet_index_per_element();
+  std::vector<BasicElementPerturbation<Dual>> dual_perturbations(elements.size());
+  for (size_t a = 0; a < elements.size(); a++)
+  {
+    const ElementPerturbation& p = perturbations[a];
+    BasicElementPerturbation<Dual>& d = dual_perturbations[a];
+    d.dx = p.dx;
+    d.dy = p.dy;
+    d.dz = p.dz;
+    d.strength_ratio = p.strength_ratio;
+
+    if (magnet_of[a] < 0) continue;
+    size_t first = 4 * magnet_of[a];
+    d.dx = Dual::Variable(p.dx, first, n_parameters);
+    d.dy = Dual::Variable(p.dy, first + 1, n_parameters);
+    d.dz = Dual::Variable(p.dz, first + 2, n_parameters);
+    d.strength_ratio = Dual::Variable(p.strength_ratio, first + 3, n_parameters);
+  }
 
-    if (z > 130. && !BeampipesAreSeparated)
+  std::shared_ptr<const PythiaSample> sample = LoadPythiaSample(input_file_name, UseInputSidecar);
+  const PythiaSample& input = *sample;
+  int nevents = input.Size();
+  if (max_events > 0 && max_events < nevents) nevents = max_events;
+
+  const int n_entries = SensitivityMatrix::kOutputs * n_parameters;
+  const int chunk_size = 256;
+  int n_chunks = (nevents + chunk_size - 1) / chunk_size;
+  std::vector<std::vector<int>> chunk_ev_id(n_chunks);
+  std::vector<std::vector<float>> chunk_jacobians(n_chunks);
+  std::vector<std::vector<double>> chunk_sum(n_chunks), chunk_sum2(n_chunks);
+  ParallelFor(n_chunks, NumberOfThreads, [&](size_t c) {
+    int first = c * chunk_size;
+    int last = std::min(nevents, first + chunk_size);
+    chunk_sum[c].assign(n_entries, 0.);
+    chunk_sum2[c].assign(n_entries, 0.);
+    for (int evt=first; evt<last; evt++)
     {
-      BeampipesAreSeparated = true;
-      x += BeampipeSeparation;
+      BasicProtonState<Dual> proton;
+      double px = input.px[evt];
+      double py = input.py[evt] + 140.e-6*6500.;
+      double pz = input.pz[evt];
+      proton.px = px;
+      proton.py = py;
+      proton.pz = pz;
+      proton.sx = px/pz;
+      proton.sy = py/pz;
+
+      if (!track_proton(proton, obs_point, dual_perturbations) || proton.is_lost) continue;
+
+      Dual outputs[SensitivityMatrix::kOutputs] = {proton.x - proton.sx*(proton.z - obs_point), proton.sx, 
+                                                   proton.y - proton.sy*(proton.z - obs_point), proton.sy};
+      chunk_ev_id[c].push_back(evt);
+      for (int o = 0; o < SensitivityMatrix::kOutputs; o++)
+      {
+        const std::vector<double>& grad = outputs[o].grad;
+        for (size_t j = 0; j < n_parameters; j++)
+        {
+          double g = grad.empty() ? 0. : grad[j];
+          chunk_jacobians[c].push_back(g);
+          chunk_sum[c][o * n_parameters + j] += g;
+          chunk_sum2[c][o * n_parameters + j] += g * g;
+        }
+      }
     }
-    if (z > obs_point)
+  });
+
+  matrix.mean.assign(n_entries, 0.);
+  matrix.mean_square.assign(n_entries, 0.);
+  for (int c=0; c<n_chunks; c++)
+  {
+    matrix.ev_id.insert(matrix.ev_id.end(), chunk_ev_id[c].begin(), chunk_ev_id[c].end());
+    matrix.jacobians.insert(matrix.jacobians.end(), chunk_jacobians[c].begin(), chunk_jacobians[c].end());
+    for (int i = 0; i < n_entries; i++)
     {
-      //cout << element[a].at(0) << "\t" << z << "\t" << x  << "\t" << sx << "\t" << sx*(z - obs_point) << endl;
-      n_process_code = m_process_code;
-      n_px = m_px->at(0);
-      n_py = m_py->at(0);
-      n_pz = m_pz->at(0);
-      n_e = m_e->at(0);
-      n_x = x - sx*(z - obs_point);
-      n_y = y - sy*(z - obs_point);
-      n_sx = sx;
-      n_sy = sy;
-      n_ev_id=evt;
-      n_is_lost=is_current_lost;
-
-      tree->Fill();
-      
-      
-      break;
+      matrix.mean[i] += chunk_sum[c][i];
+      matrix.mean_square[i] += chunk_sum2[c][i];
     }
-
   }
-  
+  size_t n_protons = matrix.GetNumberOfProtons();
+  for (int i = 0; n_protons > 0 && i < n_entries; i++)
+  {
+    matrix.mean[i] /= n_protons;
+    matrix.mean_square[i] /= n_protons;
+  }
+  return matrix;
 }
 
-}
+/**
+\brief Fit the shifts and strength ratios of all magnets to a simulated transported sample (closure test).
+
+observed_file_name is an output of simple_tracking of a simulated misaligned machine made
+from the same Pythia input, sample_name its sample at obs_point (see ReadObservedSample).
+The distance minimised is the sum over events matched by ev_id, and not lost in either
+sample, of the squared x, y, sx, sy residuals divided by the resolutions in options. The
+events are fixed at the start of every subsample and no step may lose one of them. As the
+protons are paired event by event, the fit cannot be applied to measured data, which has
+no matching events. Levenberg-Marquardt steps use the exact Jacobian from
+one Dual tracking pass per event (see ComputeSensitivity) on a subsample that grows as the
+fit converges. The fitted values are applied with SetShift/SetStrengthRatio, and observed
+vs fitted distributions are written to alignment_fit_overlay.root; overlay_written of the
+result tells whether that succeeded.
+*/
+AlignmentFitResult ProtonTransport::FitAlignment(const std::string& observed_file_name, const std::string& sample_name, 
+                                                 double obs_point, const AlignmentFitOptions& options){
+  AlignmentFitResult result;
 
-}
+  compute_collimator_sigmas();
 
-}
+  if (!beamline) {cout << "Use PrepareBeamline() or SetBeamline() first!" << endl; return result;}
+  if (magnets.empty()) {cout << "Use SetPositions() or SetMagnets() first!" << endl; return result;}
+  const std::vector<BeamElement>& elements = *beamline;
+  perturbations = ResolvePerturbations(elements, magnet_to_shift, magnet_to_ratio);
 
-}
+  ObservedSample observed;
+  if (!ReadObservedSample(observed_file_name, sample_name, observed)) return result;
+  std::shared_ptr<const PythiaSample> sample = LoadPythiaSample(input_file_name, UseInputSidecar);
+  const PythiaSample& input = *sample;
+  int nevents = input.Size();
 
-}
+  std::vector<int> observed_index(nevents, -1);
+  for (size_t i = 0; i < observed.ev_id.size(); i++)
+  {
+    int evt = observed.ev_id[i];
+    if (evt >= 0 && evt < nevents && !observed.is_lost[i]) observed_index[evt] = i;
+  }
 
-  cs->Fill(0.5, h_sigma->GetBinContent(1));
-  cs->Write();
-  efficiency->Fill(0.5, h_eff->GetBinContent(1));
-  efficiency->Write();
-  tree->Write();
-//  p->Write();
-  p->Close();
-  std::cout << "Number of lost protons: " << lost_protons.size() << '\n';
+  std::vector<int> magnet_of = magnet_index_per_element();
+  std::vector<std::string> names;
+  std::vector<double> start;
+  for (const auto& magnet : magnets) {
+    Shift shift;
+    if (magnet_to_shift.count(magnet)) shift = magnet_to_shift.at(magnet);
+    double ratio = magnet_to_ratio.count(magnet) ? magnet_to_ratio.at(magnet) : 1.;
+    start.insert(start.end(), {shift.GetXShift(), shift.GetYShift(), shift.GetZShift(), ratio});
+    for (const char* parameter : {":dx", ":dy", ":dz", ":strength_ratio"}) names.push_back(magnet.GetName() + parameter);
+  }
+  const size_t n_parameters = start.size();
+  const double resolutions[4] = {options.position_resolution, options.slope_resolution, 
+                                 options.position_resolution, options.slope_resolution};
+
+  // perturbation table of parameters p
+  auto make_table = [&](const std::vector<double>& p) {
+    std::vector<ElementPerturbation> table = perturbations;
+    for (size_t a = 0; a < elements.size(); a++)
+    {
+      if (magnet_of[a] < 0) continue;
+      const double* q = &p[4 * magnet_of[a]];
+      table[a].dx = q[0];
+      table[a].dy = q[1];
+      table[a].dz = q[2];
+      table[a].strength_ratio = q[3];
+    }
+    return table;
+  };
+
+  auto start_proton = [&](auto& proton, int evt) {
+    double px = input.px[evt];
+    double py = input.py[evt] + 140.e-6*6500.;
+    double pz = input.pz[evt];
+    proton.px = px;
+    proton.py = py;
+    proton.pz = pz;
+    proton.sx = px/pz;
+    proton.sy = py/pz;
+  };
+
+  // the events of a subsample: matched, and surviving at the parameters of its start
+  std::vector<unsigned char> selected(nevents, 0);
+  auto select = [&](const std::vector<double>& p, int n) {
+    std::vector<ElementPerturbation> table = make_table(p);
+    const int chunk_size = 256;
+    int n_chunks = (n + chunk_size - 1) / chunk_size;
+    ParallelFor(n_chunks, NumberOfThreads, [&](size_t c) {
+      int last = std::min(n, (int)(c + 1) * chunk_size);
+      for (int evt = c * chunk_size; evt < last; evt++)
+      {
+        selected[evt] = 0;
+        if (observed_index[evt] < 0) continue;
+        ProtonState proton;
+        start_proton(proton, evt);
+        selected[evt] = track_proton(proton, obs_point, table) && !proton.is_lost;
+      }
+    });
+  };
+
+  auto evaluate = [&](const std::vector<double>& p, int n, std::vector<double>& residuals, std::vector<double>* jacobian) {
+    std::atomic<bool> same_events(true);
+    residuals.assign(4 * n, 0.);
+    if (jacobian) jacobian->assign(4 * n * n_parameters, 0.);
+
+    std::vector<ElementPerturbation> table = make_table(p);
+    std::vector<BasicElementPerturbation<Dual>> dual_table;
+    if (jacobian) {
+      dual_table.resize(elements.size());
+      for (size_t a = 0; a < elements.size(); a++)
+      {
+        dual_table[a].dx = table[a].dx;
+        dual_table[a].dy = table[a].dy;
+        dual_table[a].dz = table[a].dz;
+        dual_table[a].strength_ratio = table[a].strength_ratio;
+        if (magnet_of[a] < 0) continue;
+        size_t first = 4 * magnet_of[a];
+        dual_table[a].dx = Dual::Variable(table[a].dx, first, n_parameters);
+        dual_table[a].dy = Dual::Variable(table[a].dy, first + 1, n_parameters);
+        dual_table[a].dz = Dual::Variable(table[a].dz, first + 2, n_parameters);
+        dual_table[a].strength_ratio = Dual::Variable(table[a].strength_ratio, first + 3, n_parameters);
+      }
+    }
+
+    const int chunk_size = 256;
+    int n_chunks = (n + chunk_size - 1) / chunk_size;
+    ParallelFor(n_chunks, NumberOfThreads, [&](size_t c) {
+      int last = std::min(n, (int)(c + 1) * chunk_size);
+      for (int evt = c * chunk_size; evt < last; evt++)
+      {
+        if (!selected[evt]) continue;
+        int i = observed_index[evt];
+        const double measured[4] = {observed.x[i], observed.sx[i], observed.y[i], observed.sy[i]};
+
+        if (jacobian) {
+          BasicProtonState<Dual> proton;
+          start_proton(proton, evt);
+          if (!track_proton(proton, obs_point, dual_table) || proton.is_lost) {same_events = false; continue;}
+          Dual simulated[4] = {proton.x - proton.sx*(proton.z - obs_point), proton.sx, 
+                               proton.y - proton.sy*(proton.z - obs_point), proton.sy};
+          for (int o = 0; o < 4; o++)
+          {
+            residuals[4 * evt + o] = (simulated[o].value - measured[o]) / resolutions[o];
+            double* row = &(*jacobian)[(4 * evt + o) * n_parameters];
+            for (size_t j = 0; j < simulated[o].grad.size(); j++) row[j] = simulated[o].grad[j] / resolutions[o];
+          }
+        } else {
+          ProtonState proton;
+          start_proton(proton, evt);
+          if (!track_proton(proton, obs_point, table) || proton.is_lost) {same_events = false; continue;}
+          double simulated[4] = {proton.x - proton.sx*(proton.z - obs_point), proton.sx, 
+                                 proton.y - proton.sy*(proton.z - obs_point), proton.sy};
+          for (int o = 0; o < 4; o++) residuals[4 * evt + o] = (simulated[o] - measured[o]) / resolutions[o];
+        }
+      }
+    });
+    return same_events.load();
+  };
+
+  result = LevenbergMarquardtFit(evaluate, select, start, nevents, options);
+  result.parameter_names = names;
 
+  for (size_t m = 0; m < magnets.size(); m++) {
+    const double* q = &result.parameters[4 * m];
+    SetShift(magnets[m], Shift(q[0], q[1], q[2]));
+    SetStrengthRatio(magnets[m], q[3]);
+  }
+
+  // observed vs fitted distributions on the events of the final subsample
+  std::vector<ElementPerturbation> fitted = make_table(result.parameters);
+  const char* var_names[4] = {"x", "sx", "y", "sy"};
+  std::vector<float> observed_values[4], fitted_values[4];
+  for (int evt = 0; evt < result.n_events; evt++)
+  {
+    if (!selected[evt]) continue;
+    int i = observed_index[evt];
+    ProtonState proton;
+    start_proton(proton, evt);
+    if (!track_proton(proton, obs_point, fitted) || proton.is_lost) continue;
+    const double measured[4] = {observed.x[i], observed.sx[i], observed.y[i], observed.sy[i]};
+    const double simulated[4] = {proton.x - proton.sx*(proton.z - obs_point), proton.sx, 
+                                 proton.y - proton.sy*(proton.z - obs_point), proton.sy};
+    for (int o = 0; o < 4; o++) {
+      observed_values[o].push_back(measured[o]);
+      fitted_values[o].push_back(simulated[o]);
+    }
+  }
+  const std::string overlay_name = "alignment_fit_overlay.root";
+  TFile* overlay = new TFile(overlay_name.c_str(), "recreate");
+  if (overlay->IsZombie()) {
+    cout << "ERROR! Cannot create " << overlay_name << endl;
+    delete overlay;
+    return result;
+  }
+  bool written = true;
+  for (int o = 0; o < 4 && !observed_values[o].empty(); o++)
+  {
+    auto range = std::minmax_element(observed_values[o].begin(), observed_values[o].end());
+    std::string name = var_names[o];
+    TH1F* h_observed = new TH1F((name + "_observed").c_str(), (name + " observed").c_str(), 100, *range.first, *range.second);
+    TH1F* h_fitted = new TH1F((name + "_fitted").c_str(), (name + " fitted").c_str(), 100, *range.first, *range.second);
+    for (size_t k = 0; k < observed_values[o].size(); k++) {
+      h_observed->Fill(observed_values[o][k]);
+      h_fitted->Fill(fitted_values[o][k]);
+    }
+    written = h_observed->Write() > 0 && written;
+    written = h_fitted->Write() > 0 && written;
+  }
+  overlay->Close();
+  written = written && !overlay->TestBit(TFile::kWriteError);
+  if (!written) cout << "ERROR! Cannot write " << overlay_name << endl;
+  delete overlay;
+  result.overlay_written = written;
+
+  return result;
 }
 
 std::string ProtonTransport::GetROOTOutputFileName() const {
@@ -907,37 +1813,73 @@ std::string ProtonTransport::GetROOTOutputFileName() const {
 
 void ProtonTransport::WriteLostProtonsInCsv(const std::string& filename) const {
   std::ofstream f;
-  f.open(filename, std::fstream::app);
+  f.open(filename, std::fstream::trunc);
 
-  f << "No," << "px," << "py," << "pz\n";
+  f << "No," << "ev_id," << "element," << "z," << "x," << "y," << "px," << "py," << "pz\n";
 
-  for (int i = 0; i < lost_protons.size(); i++) {
-    f << i << "," << lost_protons[i][0] 
-      << "," << lost_protons[i][1] << "," 
-      << lost_protons[i][2] << "\n";
+  for (size_t i = 0; i < lost_protons.Size(); i++) {
+    f << i << "," << lost_protons.ev_id[i] << "," << lost_protons.element[i] 
+      << "," << lost_protons.z[i] << "," << lost_protons.x[i] << "," << lost_protons.y[i] 
+      << "," << lost_protons.px[i] << "," << lost_protons.py[i] << "," 
+      << lost_protons.pz[i] << "\n";
   }
 
   f.close();
 }
 
-void ProtonTransport::WriteChangesInCsv(const std::string& filename, DistributionsDifference* diff, int run_id) {
-  std::map<std::string, double> var_name_to_rms = diff->GetRMSs("histos_1d_diffs");
-  std::map<std::string, double> var_name_to_mean = diff->GetMeans("histos_1d_diffs");
+/**
+\brief Protons lost in the last simple_tracking or CompareWithDefault call.
+*/
+const LossRecords& ProtonTransport::GetLostProtons() const {
+  return lost_protons;
+}
 
+/**
+\brief Losses of the last simple_tracking or CompareWithDefault call counted per beamline element.
+
+simple_tracking also writes it next to the ROOT output (".lossmap" instead of ".root"),
+see WriteLossMap.
+*/
+const LossMap& ProtonTransport::GetLossMap() const {
+  return loss_map;
+}
+
+void ProtonTransport::WriteChangesInCsv(const std::string& filename, DistributionsDifference* diff, int run_id) const {
   std::ofstream f;
   f.open(filename, std::fstream::app);
   
   // Check if file's not empty (or we already have columns names)
   std::ifstream f_check;
   f_check.open(filename);
-  if (f_check.peek() == std::ifstream::traits_type::eof()) {
+  bool with_header = f_check.peek() == std::ifstream::traits_type::eof();
+  f_check.close();
+
+  WriteChangesInCsv(f, diff, run_id, with_header);
+  
+  f.close();
+}
+
+/**
+\brief Write the rows of run run_id (one per changed magnet), preceded by the column names if with_header.
+*/
+void ProtonTransport::WriteChangesInCsv(std::ostream& f, DistributionsDifference* diff, int run_id, bool with_header) const {
+  WriteChangesInCsv(f, diff->GetRMSs("histos_1d_diffs"), diff->GetMeans("histos_1d_diffs"), run_id, with_header);
+}
+
+/**
+\brief Write the rows of run run_id with the given RMS and mean of every compared variable.
+*/
+void ProtonTransport::WriteChangesInCsv(std::ostream& f, 
+                                        const std::map<std::string, double>& var_name_to_rms, 
+                                        const std::map<std::string, double>& var_name_to_mean, 
+                                        int run_id, bool with_header) const {
+  if (with_header) {
     f << "No," << "Magnet," << "Position," << "x_shift[m]," << "y_shift[m]," << "z_shift[m]," << "Strength_ratio";
     for (const auto& [var_name, rms] : var_name_to_rms) {
       f << "," << "RMS(" << var_name << ")," << "Mean(" << var_name << ")"; 
     }
     f << "\n";
   }
-  f_check.close();
   
   int local_run_id = 1;
   if (!magnet_to_shift.empty()) {
@@ -986,57 +1928,357 @@ void ProtonTransport::WriteChangesInCsv(const std::string& filename, Distributio
       }
     }
   }
-  
-  f.close();
 }
 
-int main() {
-  std::string optics_file_name = "optics_PPSS_2020/alfaTwiss1.txt_beta40cm_6500GeV_y-185murad";
-  std::string changes_fn = "multiple_changes_inst2.csv";
-
-  ProtonTransport* p_default = new ProtonTransport;
+/**
+\brief Time the stages of a transport with the optics optics_file_name and write the results to benchmark_results.json.
+
+Every benchmark is run once untimed and then repetitions times:
+- PrepareBeamline (Twiss parsing) and PrepareBeamlineFromArtifact (mapped lattice), per element;
+- the element kernels and aperture checks, see BenchmarkKernels;
+- simple_tracking of the bundled transported sample (its initial kinematics are tracked
+  again), per event: element by element and in bundles, on one thread and on all, without
+  output, then end to end with pipelined TTree output;
+- DistributionsDifference of the bundled sample against that output, per event.
+The input sample is decoded in the warm-up run; it is cached for the timed ones. The
+tracking runs write the loss map and output file names of the optics, as simple_tracking does.
+*/
+void RunBenchmarkSuite(const std::string& optics_file_name, int repetitions) {
+  const int warmup = 1;
+  const std::string sample_file_name = 
+    "def_shifted__changed_strength_pythia8_13TeV_protons_100k_transported_205m_beta40cm_6500GeV_y-185murad.root";
+  std::vector<BenchmarkResult> results;
+
+  ProtonTransport reference;
+  reference.SetProcessedFileName(optics_file_name);
+  reference.PrepareBeamlineFromArtifact(false);
+  if (!reference.GetBeamline()) return;
+  double n_elements = reference.GetBeamline()->size();
+
+  results.push_back(RunBenchmark("PrepareBeamline", "element", n_elements, warmup, repetitions, [&]() {
+    ProtonTransport p;
+    p.SetProcessedFileName(optics_file_name);
+    p.PrepareBeamline(false, true);
+  }));
+  results.push_back(RunBenchmark("PrepareBeamlineFromArtifact", "element", n_elements, warmup, repetitions, [&]() {
+    ProtonTransport p;
+    p.SetProcessedFileName(optics_file_name);
+    p.PrepareBeamlineFromArtifact(false);
+  }));
+
+  for (const BenchmarkResult& r : reference.BenchmarkKernels(warmup, repetitions, 100000)) results.push_back(r);
+
+  double n_events = LoadPythiaSample(sample_file_name)->Size();
+  std::string tracked_file_name;
+  auto tracking = [&](const std::string& name, bool batch, unsigned threads, OutputFormat format, bool pipeline) {
+    results.push_back(RunBenchmark(name, "event", n_events, warmup, repetitions, [&]() {
+      ProtonTransport p;
+      p.SetProcessedFileName(optics_file_name);
+      p.SetBeamline(reference.GetBeamline());
+      p.SetInputFileName(sample_file_name);
+      p.SetUseBatchTracking(batch);
+      p.SetNumberOfThreads(threads);
+      OutputOptions options;
+      options.format = format;
+      p.SetOutputOptions(options);
+      p.SetUsePipeline(pipeline);
+      p.simple_tracking(205.);
+      tracked_file_name = p.GetROOTOutputFileName();
+    }));
+    // the counters see the calling thread only, i.e. part of the work
+    if (threads > 1 || pipeline) results.back().perf = PerfTotals();
+  };
+  unsigned n_threads = HardwareThreads();
+  tracking("simple_tracking elements, 1 thread", false, 1, OutputFormat::kNone, false);
+  tracking("simple_tracking bundles, 1 thread", true, 1, OutputFormat::kNone, false);
+  tracking("simple_tracking bundles, " + std::to_string(n_threads) + " threads", true, n_threads, OutputFormat::kNone, false);
+  tracking("simple_tracking bundles, " + std::to_string(n_threads) + " threads, TTree output", 
+           true, n_threads, OutputFormat::kTTree, true);
+
+  results.push_back(RunBenchmark("DistributionsDifference", "event", n_events, warmup, repetitions, [&]() {
+    DistributionsDifference diff(sample_file_name, tracked_file_name);
+  }));
+
+  PrintBenchmarks(std::cout, results);
+  std::map<std::string, std::string> context = {
+    {"optics", optics_file_name},
+    {"sample", sample_file_name},
+    {"hardware_threads", std::to_string(n_threads)},
+    {"batch_instruction_set", BatchTransport::GetInstructionSet()},
+    {"compiler", __VERSION__}
+  };
+  if (!WriteBenchmarksJson("benchmark_results.json", results, context)) std::cout << "WARNING! Cannot write benchmark_results.json" << std::endl;
+}
 
-  p_default->SetProcessedFileName(optics_file_name);
-  p_default->PrepareBeamline(false, true);
-  p_default->simple_tracking(205.);
+/**
+\brief Execute the scans, batch by batch (see PlanScanBatches).
+
+Per batch the beamline is prepared once and shared by all runs, the input is decoded
+once (it stays cached), and the default tracking, kernel profile and sensitivity matrix
+are computed once if any scan of the batch asks for them. All runs of the batch then go
+through one pool of HardwareThreads() workers. Every run compares its misaligned lattice
+with the default one at each observation point of its scan; the csv rows of a scan are
+written in run order. Files of the batch-wide stages get "_batch<n>" with several batches.
+
+A scan with a checkpoint records every completed run in it (see ScanCheckpoint). A
+checkpoint holding runs is only discarded with CheckpointMode::kFresh. With kResume the
+recorded runs are not executed again: their csv rows come from the
+checkpoint, and their loss maps and run reports are those already written, so the
+outputs are the same as those of an uninterrupted scan. The scan report then covers
+the runs executed by this call only. Once its outputs are written, a scan marks its
+checkpoint as complete, so running it again starts it over. If the files of a run cannot be written, synced or
+recorded, the runs not yet started are skipped and the scans stop before their summaries
+are written.
+\return false if a checkpoint cannot be opened or a run cannot be completed
+*/
+bool RunScans(const std::vector<ScanSpec>& specs, bool use_perf_counters, CheckpointMode checkpoint_mode) {
+  std::vector<ScanBatch> batches = PlanScanBatches(specs);
+  ROOT::EnableThreadSafety();
+
+  for (size_t b = 0; b < batches.size(); b++) {
+    const ScanBatch& batch = batches[b];
+    std::string batch_suffix = batches.size() > 1 ? "_batch" + std::to_string(b + 1) : "";
+    bool default_tracking = false;
+    std::set<double> sensitivity_points;
+    for (size_t s : batch.specs) {
+      default_tracking = default_tracking || specs[s].default_tracking;
+      if (specs[s].sensitivity) sensitivity_points.insert(specs[s].obs_points.front());
+    }
 
-  std::vector<Magnet> magnets = p_default->GetMagnets();
+    ProtonTransport* p_default = new ProtonTransport;
+    p_default->SetUseRunReport(true);
+    p_default->SetUsePerfCounters(use_perf_counters);
+    p_default->SetProcessedFileName(batch.optics_file_name);
+    p_default->SetInputFileName(batch.input_file_name);
+    p_default->PrepareBeamlineFromArtifact(false);
+    if (!p_default->GetBeamline()) {delete p_default; continue;}
+    p_default->SetUseBatchTracking(true);
+    p_default->SetNumberOfThreads(HardwareThreads());
+    p_default->SetUseInputSidecar(true);
+    p_default->SetUsePipeline(true);
+    if (default_tracking) {
+      std::set<double> obs_points;
+      for (size_t s : batch.specs) {
+        if (specs[s].default_tracking) obs_points.insert(specs[s].obs_points.begin(), specs[s].obs_points.end());
+      }
+      p_default->simple_tracking(std::vector<double>(obs_points.begin(), obs_points.end()));
+      WriteRunReportJson("run_report_default" + batch_suffix + ".json", p_default->GetRunReport(), "default");
+    }
+    if (use_perf_counters) {
+      std::vector<BenchmarkResult> kernels = p_default->BenchmarkKernels(1, 5, 100000);
+      PrintBenchmarks(std::cout, kernels);
+      WriteBenchmarksJson("kernel_profile" + batch_suffix + ".json", kernels, 
+                          {{"batch_instruction_set", BatchTransport::GetInstructionSet()}});
+    }
 
-  remove(changes_fn.c_str());
+    std::vector<Magnet> magnets = p_default->GetMagnets();
+
+    // First-order prediction of the scans from one sensitivity pass per observation point
+    std::map<double, SensitivityMatrix> sensitivity;
+    for (double obs_point : sensitivity_points) {
+      std::ostringstream suffix;
+      suffix << batch_suffix;
+      if (sensitivity_points.size() > 1) suffix << "_" << obs_point << "m";
+      sensitivity[obs_point] = p_default->ComputeSensitivity(obs_point, 10000);
+      WriteSensitivityCsv(InsertBeforeExtension("sensitivity_matrix.csv", suffix.str()), sensitivity[obs_point]);
+      WriteSensitivityBinary(InsertBeforeExtension("sensitivity_matrix.bin", suffix.str()), sensitivity[obs_point]);
+    }
+    for (size_t s : batch.specs) {
+      if (!specs[s].sensitivity) continue;
+      std::vector<double> sigmas = specs[s].GetParameterSigmas(magnets);
+      for (int o = 0; o < SensitivityMatrix::kOutputs; o++) {
+        std::cout << specs[s].name << ": predicted RMS(d_" << SensitivityOutputName(o) << ") = " 
+                  << sensitivity[specs[s].obs_points.front()].PredictRMS(o, sigmas) << std::endl;
+      }
+    }
 
-  int run_id = 1;
-  TRandom* r = new TRandom();
-  for (int i = 0; i < 100; i++) {
-    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
-    std::cout << "Run: " << run_id << std::endl;
-    
-    ProtonTransport* p = new ProtonTransport;
-    p->SetProcessedFileName(optics_file_name);
-    p->PrepareBeamline(false);
+    // where the time of every scan goes, per run and summed over its runs
+    std::map<size_t, std::unique_ptr<RunReport>> scan_reports;
+    std::map<size_t, std::unique_ptr<StageTimer>> scan_timers;
+    std::map<size_t, std::vector<std::unique_ptr<std::ofstream>>> changes;
+    std::map<size_t, std::unique_ptr<ScanCheckpoint>> checkpoints;
+    for (size_t s : batch.specs) {
+      if (!specs[s].checkpoint.empty()) {
+        checkpoints[s].reset(new ScanCheckpoint);
+        if (!checkpoints[s]->Open(specs[s].checkpoint, specs[s].GetFingerprint(), checkpoint_mode)) {delete p_default; return false;}
+        if (checkpoint_mode == CheckpointMode::kResume) {
+          std::cout << specs[s].name << ": " << checkpoints[s]->GetNumberOfDone() << " of " 
+                    << specs[s].GetNumberOfRuns() << " runs done" << std::endl;
+        }
+      }
+      scan_reports[s].reset(new RunReport);
+      scan_timers[s].reset(new StageTimer(scan_reports[s].get(), Stage::kScan));
+      if (specs[s].changes_csv.empty()) continue;
+      for (size_t k = 0; k < specs[s].obs_points.size(); k++) {
+        changes[s].emplace_back(new std::ofstream(specs[s].GetChangesCsv(k)));
+      }
+    }
 
-  for (const auto& magnet : magnets) {
-     // if (magnet.GetType() == "DIPOLE") {
-        p->SetShift(magnet, Shift(r->Gaus(0, 0.00025), 
-                                  r->Gaus(0, 0.00025), 
-                                  r->Gaus(0, 0.001)));
+    // Every run draws its configuration from its own counter-based stream, so the runs
+    // can be executed concurrently and in any order.
+    std::atomic<bool> run_failed(false);
+    RunScan(batch.tasks.size(), HardwareThreads(), [&](size_t i) {
+      const ScanSpec& spec = specs[batch.tasks[i].spec];
+      int run_id = batch.tasks[i].run_id;
+      ScanCheckpoint* checkpoint = checkpoints.count(batch.tasks[i].spec) ? checkpoints[batch.tasks[i].spec].get() : 0;
+      std::vector<ScanOutput> outputs;
+      if (run_failed) return outputs;
+      if (checkpoint && checkpoint->IsDone(run_id)) {
+        std::vector<std::string> texts = checkpoint->GetTexts(run_id);
+        for (size_t k = 0; k < texts.size() && k < changes[batch.tasks[i].spec].size(); k++) {
+          outputs.push_back(ScanOutput{changes[batch.tasks[i].spec][k].get(), texts[k]});
+        }
+        return outputs;
+      }
+      std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+
+      ProtonTransport* p = new ProtonTransport;
+      p->SetProcessedFileName(batch.optics_file_name);
+      p->SetInputFileName(batch.input_file_name);
+      p->SetBeamline(p_default->GetBeamline());
+      p->SetUseBatchTracking(true);
+      p->SetUseInputSidecar(true);
+      p->SetUseRunReport(true);
+      p->SetUsePerfCounters(use_perf_counters);
+
+      for (const auto& m : spec.DrawRun(magnets, run_id)) {
+        p->SetShift(m.magnet, m.shift);
+        p->SetStrengthRatio(m.magnet, m.strength_ratio);
+      }
 
-        p->SetStrengthRatio(magnet,r->Gaus(1, 0.0005));
-     // }
+      // default and perturbed lattice are compared in lockstep, no ROOT file is written
+      std::vector<std::string> texts;
+      for (size_t k = 0; k < spec.obs_points.size(); k++) {
+        std::map<std::string, double> var_name_to_rms, var_name_to_mean;
+        for (const auto& [var_name, stats] : p->CompareWithDefault(spec.obs_points[k])) {
+          var_name_to_rms[var_name] = stats.GetRMS();
+          var_name_to_mean[var_name] = stats.GetMean();
+        }
+        if (spec.changes_csv.empty()) continue;
+        std::ostringstream rows;
+        p->WriteChangesInCsv(rows, var_name_to_rms, var_name_to_mean, run_id, run_id == 1);
+        texts.push_back(rows.str());
+        outputs.push_back(ScanOutput{changes[batch.tasks[i].spec][k].get(), rows.str()});
+      }
+      // a file left over from an earlier scan must not stand in for one that failed
+      std::vector<std::string> run_files;
+      bool written = true;
+      if (!spec.loss_map_prefix.empty()) {
+        run_files.push_back(spec.loss_map_prefix + std::to_string(run_id) + ".lossmap");
+        written = WriteLossMap(run_files.back(), p->GetLossMap(), run_id);
+      }
+      if (written && !spec.report_prefix.empty()) {
+        run_files.push_back(spec.report_prefix + std::to_string(run_id) + ".json");
+        written = WriteRunReportJson(run_files.back(), p->GetRunReport(), spec.name + " run " + std::to_string(run_id));
+      }
+      if (!written) {
+        std::cout << "ERROR! Cannot write " << run_files.back() << std::endl;
+        run_failed = true;
+      }
+      // the run is complete on disk once its record is
+      if (written && checkpoint) {
+        for (const auto& file : run_files) {
+          if (!SyncFile(file)) {
+            std::cout << "ERROR! Cannot sync " << file << std::endl;
+            written = false;
+            break;
+          }
+        }
+        if (!written || !checkpoint->Record(run_id, texts)) run_failed = true;
+      }
+      scan_reports[batch.tasks[i].spec]->Merge(p->GetRunReport());
+
+      delete p;
+      std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+      std::ostringstream log;
+      log << spec.name << " run: " << run_id << " done, execution time = " 
+          << (double)std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count()/1000 << "[s]\n";
+      std::cout << log.str();
+      return outputs;
+    });
+    if (run_failed) {
+      std::cout << "ERROR! Scan stopped, a run could not be completed" << std::endl;
+      delete p_default;
+      return false;
     }
 
-    p->simple_tracking(205.);
+    for (size_t s : batch.specs) {
+      const ScanSpec& spec = specs[s];
+      scan_timers[s]->Stop();
+      scan_reports[s]->Merge(p_default->GetRunReport());
+      if (!spec.scan_report.empty()) WriteRunReportJson(spec.scan_report, *scan_reports[s], spec.name);
+
+      // where the misaligned lattices lose their protons, summed over all runs
+      if (!spec.loss_map_csv.empty()) {
+        std::vector<std::string> loss_map_files;
+        for (int run_id = 1; run_id <= spec.GetNumberOfRuns(); run_id++) {
+          loss_map_files.push_back(spec.loss_map_prefix + std::to_string(run_id) + ".lossmap");
+        }
+        std::ofstream loss_map_csv(spec.loss_map_csv);
+        WriteLossMapCsv(loss_map_csv, AggregateLossMaps(loss_map_files), *p_default->GetBeamline());
+      }
 
-    DistributionsDifference* diff = new DistributionsDifference(p_default->GetROOTOutputFileName(), 
-                                                                p->GetROOTOutputFileName());
-    p->WriteChangesInCsv(changes_fn, diff, run_id++);
+      // with all outputs written the scan is finished, and the next one may start over
+      for (auto& out : changes[s]) out->close();
+      if (checkpoints.count(s) && !checkpoints[s]->Complete()) {delete p_default; return false;}
+    }
+
+    delete p_default;
+  }
+  return true;
+}
 
-    std::cout << "done\n\n"; 
-    delete p;
-    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
-    std::cout << "Execution time = " << (double)std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count()/1000 << "[s]" << std::endl;
+/**
+Without arguments the misalignment scan of DefaultScanSpec (misalignment.scan) is run.
+--scan file ... runs the scans of the given specification files, see ReadScanSpec;
+--resume skips the runs recorded in their checkpoints, --fresh discards them (without
+either, a checkpoint holding the runs of an unfinished scan is an error); --perf-counters
+turns the hardware counters on; --benchmark [repetitions] runs RunBenchmarkSuite; --fit
+observed.root [sample [obs_point]] fits the alignment to a simulated sample (FitAlignment,
+"ntuple" at 205 m by default) and writes alignment_fit.csv.
+*/
+int main(int argc, char** argv) {
+  std::string optics_file_name = "optics_PPSS_2020/alfaTwiss1.txt_beta40cm_6500GeV_y-185murad";
+  if (argc > 1 && std::string(argv[1]) == "--benchmark") {
+    RunBenchmarkSuite(optics_file_name, argc > 2 ? atoi(argv[2]) : 5);
+    return 0;
   }
-  delete p_default;
+  if (argc > 2 && std::string(argv[1]) == "--fit") {
+    ProtonTransport p;
+    p.SetProcessedFileName(optics_file_name);
+    p.PrepareBeamlineFromArtifact(false);
+    p.SetNumberOfThreads(HardwareThreads());
+    p.SetUseInputSidecar(true);
+    std::string sample_name = argc > 3 ? argv[3] : "ntuple";
+    double obs_point = argc > 4 ? atof(argv[4]) : 205.;
+    AlignmentFitResult result = p.FitAlignment(argv[2], sample_name, obs_point, AlignmentFitOptions());
+    if (result.parameters.empty()) return 1;
+    if (!WriteAlignmentFitCsv("alignment_fit.csv", result)) {
+      cout << "ERROR! Cannot write alignment_fit.csv" << endl;
+      return 1;
+    }
+    return result.overlay_written ? 0 : 1;
+  }
+  // profiling mode: hardware counters in the run reports and per element kind
+  bool use_perf_counters = false;
+  CheckpointMode checkpoint_mode = CheckpointMode::kNew;
+  std::vector<ScanSpec> specs;
+  bool reading_specs = false;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--perf-counters") {use_perf_counters = true; reading_specs = false;}
+    else if (arg == "--resume") {checkpoint_mode = CheckpointMode::kResume; reading_specs = false;}
+    else if (arg == "--fresh") {checkpoint_mode = CheckpointMode::kFresh; reading_specs = false;}
+    else if (arg == "--scan") reading_specs = true;
+    else if (reading_specs) {
+      specs.push_back(ScanSpec());
+      if (!ReadScanSpec(arg, specs.back())) return 1;
+    }
+    else {cout << "ERROR! Unknown argument: " << arg << endl; return 1;}
+  }
+  if (specs.empty()) specs.push_back(DefaultScanSpec(optics_file_name));
+
+  if (!RunScans(specs, use_perf_counters, checkpoint_mode)) return 1;
 
   return 0;
 }
-